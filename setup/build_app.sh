@@ -11,6 +11,11 @@ fi
 mkdir -p ~/mirror
 rm -rf ~/mirror/$1
 cp -r $ROOT/$1 ~/mirror/$1
+# Other apps include the userland headers through "../userland/"
+if [[ $1 != userland ]]; then
+	rm -rf ~/mirror/userland
+	cp -r $ROOT/userland ~/mirror/userland
+fi
 
 
 #echo "Now, make sure that ~/edk2/EmulatorPkg/EmulatorPkg.dsc contains '/home/edk2/mirror/$1/app.inf' in [Components] and run 'build'"
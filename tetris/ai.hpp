@@ -0,0 +1,281 @@
+#pragma once
+
+#include "core.hpp"
+
+namespace tetris {
+
+// Placement of the current piece: index of its position and column of the piece, dropped straight down from the top
+struct Move
+{
+	UINTN position = 0;
+	INTN x = 0;
+};
+
+// Beam search over the placements of the current and next piece, scored by a board heuristic
+// The beam keeps the best placements of the current piece, each of them is expanded with every placement of the next
+// piece, and the boards obtained that way are rated by the expected best placement of the piece after, which is not
+// known yet. That last ply holds almost all the work, and is spread across the workers of an Executor.
+// Executor must provide `UINTN getWorkerCount(void)`, `void setWorkerLimit(UINTN)` and `void parallelFor(UINTN count, Fn &&fn)`
+// calling `fn(i)` for every i in [0, count) from any worker. Results don't depend on the worker count.
+class Solver
+{
+public:
+	static inline constexpr UINTN maxBeamWidth = 16;
+	static inline constexpr UINTN defaultBeamWidth = 8;
+	// Upper bound of the placements of any piece
+	static inline constexpr UINTN maxPlacementCount = Game::Piece::maxPosCount * Game::fieldWidth;
+
+private:
+	using Rows = Game::Rows;
+
+	// Weights of the heuristic of Yiyuan Lee, scaled by 1000 to stay on integers
+	static inline constexpr INT64 heightWeight = -510;
+	static inline constexpr INT64 lineWeight = 760;
+	static inline constexpr INT64 holeWeight = -356;
+	static inline constexpr INT64 bumpinessWeight = -184;
+	// Score of a piece that can't be placed anywhere, below any board
+	static inline constexpr INT64 gameOverScore = -1000000;
+
+	struct BeamNode {
+		Rows rows;
+		UINT32 lineCount;
+		INT64 score;
+		Move move;
+	};
+
+	// Kept small, the whole solver sits on the stack of the player
+	struct Candidate {
+		Rows rows;
+		UINT16 lineCount;
+		UINT16 beamIndex;
+		UINT32 nodeCount;
+		INT64 score;
+	};
+
+	UINTN m_beamWidth;
+	UINTN m_beamCount;
+	BeamNode m_beam[maxBeamWidth];
+	UINTN m_candidateCount;
+	Candidate m_candidates[maxBeamWidth * maxPlacementCount];
+	UINT64 m_nodeCount = 0;
+
+	static INT64 evaluate(const Rows &rows, UINTN lineCount) {
+		// Top-down scan: a column gets its height on its first occupied cell, empty cells below covered ones are holes
+		UINTN heights[Game::fieldWidth] {};
+		UINT16 covered = 0;
+		UINTN holeCount = 0;
+		for (UINTN y = 0; y < Game::fieldHeight; y++) {
+			auto row = rows[y];
+			for (UINTN bits = row & ~covered; bits != 0; bits &= bits - 1)
+				heights[__builtin_ctz(bits)] = Game::fieldHeight - y;
+			holeCount += Game::countBits(covered & ~row);
+			covered |= row;
+		}
+
+		UINTN aggregateHeight = heights[0];
+		UINTN bumpiness = 0;
+		for (UINTN x = 1; x < Game::fieldWidth; x++) {
+			aggregateHeight += heights[x];
+			bumpiness += heights[x] > heights[x - 1] ? heights[x] - heights[x - 1] : heights[x - 1] - heights[x];
+		}
+		return heightWeight * static_cast<INT64>(aggregateHeight) + lineWeight * static_cast<INT64>(lineCount) +
+			holeWeight * static_cast<INT64>(holeCount) + bumpinessWeight * static_cast<INT64>(bumpiness);
+	}
+
+	// Fn is a `void (const Move &move, const Rows &rows, UINTN lineCount)`, called with the field after each placement
+	// Returns the number of placements
+	template <typename Fn>
+	static UINTN iteratePlacements(const Rows &rows, UINTN pieceIndex, Fn &&fn) {
+		auto &piece = Game::pieces[pieceIndex];
+		UINTN count = 0;
+		for (UINTN i = 0; i < piece.getPositionCount(); i++) {
+			auto &position = piece.getPosition(i);
+			auto top = -static_cast<INTN>(position.top);
+			for (auto x = -static_cast<INTN>(position.left); x + position.right <= static_cast<INTN>(Game::fieldWidth); x++) {
+				if (Game::isIntersecting(rows, position, x, top))
+					continue;
+				auto y = top;
+				while (!Game::isIntersecting(rows, position, x, y + 1))
+					y++;
+
+				Rows next;
+				CopyMem(next, rows, sizeof(next));
+				auto lines = Game::place(next, position, x, y);
+				if (lines != 0)
+					Game::removeLines(next, lines);
+				fn(Move { i, x }, next, Game::countBits(lines));
+				count++;
+			}
+		}
+		return count;
+	}
+
+	// Sum over every possible piece of its best placement, the pieces are drawn uniformly
+	static INT64 rateExpected(const Rows &rows, UINTN lineCount, UINT32 &nodeCount) {
+		INT64 res = 0;
+		for (UINTN i = 0; i < Game::pieceCount; i++) {
+			auto best = gameOverScore;
+			nodeCount += iteratePlacements(rows, i, [lineCount, &best](const Move&, const Rows &next, UINTN lines) {
+				auto score = evaluate(next, lineCount + lines);
+				if (score > best)
+					best = score;
+			});
+			res += best;
+		}
+		return res;
+	}
+
+	void insertIntoBeam(const BeamNode &node) {
+		// Sorted by decreasing score, ties keep the earlier placement so that searches are deterministic
+		auto i = m_beamCount < m_beamWidth ? m_beamCount++ : m_beamWidth;
+		for (; i > 0 && m_beam[i - 1].score < node.score; i--)
+			if (i < m_beamWidth)
+				m_beam[i] = m_beam[i - 1];
+		if (i < m_beamWidth)
+			m_beam[i] = node;
+	}
+
+public:
+	// `beamWidth` is clamped to [1, maxBeamWidth]
+	Solver(UINTN beamWidth = defaultBeamWidth) :
+		m_beamWidth(beamWidth < 1 ? 1 : beamWidth > maxBeamWidth ? maxBeamWidth : beamWidth),
+		m_beamCount(0),
+		m_candidateCount(0)
+	{
+	}
+
+	// Boards rated since the solver was created
+	UINT64 getNodeCount(void) const {
+		return m_nodeCount;
+	}
+
+	// Returns false when the current piece can't be placed anywhere
+	template <typename Executor>
+	bool search(const Game &game, Executor &executor, Move &move) {
+		m_beamCount = 0;
+		m_nodeCount += iteratePlacements(game.getFieldRows(), game.getCurrentPieceIndex(), [this](const Move &placement, const Rows &next, UINTN lines) {
+			BeamNode node;
+			CopyMem(node.rows, next, sizeof(node.rows));
+			node.lineCount = lines;
+			node.score = evaluate(next, lines);
+			node.move = placement;
+			insertIntoBeam(node);
+		});
+		if (m_beamCount == 0)
+			return false;
+
+		m_candidateCount = 0;
+		for (UINTN i = 0; i < m_beamCount; i++) {
+			auto &node = m_beam[i];
+			m_nodeCount += iteratePlacements(node.rows, game.getNextPieceIndex(), [this, &node, i](const Move&, const Rows &next, UINTN lines) {
+				auto &candidate = m_candidates[m_candidateCount++];
+				CopyMem(candidate.rows, next, sizeof(candidate.rows));
+				candidate.lineCount = node.lineCount + lines;
+				candidate.beamIndex = i;
+			});
+		}
+
+		executor.parallelFor(m_candidateCount, [this](UINTN i) {
+			auto &candidate = m_candidates[i];
+			candidate.nodeCount = 0;
+			candidate.score = rateExpected(candidate.rows, candidate.lineCount, candidate.nodeCount);
+		});
+
+		// Without any candidate, the next piece fits nowhere: the best placement of the current piece alone remains
+		UINTN bestBeamIndex = 0;
+		INT64 bestScore = 0;
+		for (UINTN i = 0; i < m_candidateCount; i++) {
+			auto &candidate = m_candidates[i];
+			m_nodeCount += candidate.nodeCount;
+			if (i == 0 || candidate.score > bestScore) {
+				bestScore = candidate.score;
+				bestBeamIndex = candidate.beamIndex;
+			}
+		}
+		move = m_beam[bestBeamIndex].move;
+		return true;
+	}
+};
+
+// Plays a `Game` through regular inputs, searching a move whenever a new piece spawns
+// Rotates the piece first, then moves it sideways, then pushes it down until it rests and gravity locks it.
+template <typename Executor>
+class AutoPlayer
+{
+	const Game &m_game;
+	Executor &m_executor;
+	Solver m_solver;
+	UINTN m_spawnCount = 0;
+	bool m_hasMove = false;
+	Move m_move;
+
+public:
+	AutoPlayer(const Game &game, Executor &executor, UINTN beamWidth = Solver::defaultBeamWidth) :
+		m_game(game),
+		m_executor(executor),
+		m_solver(beamWidth)
+	{
+	}
+
+	const Solver& getSolver(void) const {
+		return m_solver;
+	}
+
+	TickInput next(UINTN) {
+		TickInput res;
+		if (m_game.isGameOver())
+			return res;
+		if (m_game.getSpawnCount() != m_spawnCount) {
+			m_spawnCount = m_game.getSpawnCount();
+			m_hasMove = m_solver.search(m_game, m_executor, m_move);
+		}
+		if (!m_hasMove)
+			return res;
+
+		auto position = m_game.getCurrentPiecePosition();
+		auto x = m_game.getCurrentPieceX();
+		if (position != m_move.position) {
+			res.rot = 1;
+		} else if (x != m_move.x) {
+			res.x = x < m_move.x ? 1 : -1;
+		} else {
+			// Holding down while resting would hold gravity back as well, and the piece would never lock
+			auto &rows = m_game.getFieldRows();
+			auto &piecePosition = m_game.getCurrentPiece().getPosition(position);
+			res.y = Game::isIntersecting(rows, piecePosition, x, m_game.getCurrentPieceY() + 1) ? 0 : 1;
+		}
+		return res;
+	}
+};
+
+// Lets the solver play `pieceCount` pieces from `seed` with 1 to `executor.getWorkerCount()` workers, games are
+// restarted on game over. Clock is a `UINT64 (void)` with any unit, Fn is a
+// `void (UINTN workerCount, UINT64 nodeCount, UINT64 elapsed, UINTN score)` called after each run, `score` adds up
+// the scores of every game played: it is the same for every worker count.
+template <typename Executor, typename Clock, typename Fn>
+[[maybe_unused]] static void benchmarkSolver(Executor &executor, Clock &&clock, UINT64 seed, UINTN pieceCount, Fn &&fn) {
+	for (UINTN workerCount = 1; workerCount <= executor.getWorkerCount(); workerCount++) {
+		executor.setWorkerLimit(workerCount);
+
+		Game game(seed);
+		AutoPlayer<Executor> player(game, executor);
+		UINTN placedCount = 0;
+		UINTN score = 0;
+		auto begin = clock();
+		while (placedCount < pieceCount) {
+			auto spawnCount = game.getSpawnCount();
+			game.tick(player.next(game.getTick()));
+			if (game.getSpawnCount() != spawnCount)
+				placedCount++;
+			if (game.isGameOver()) {
+				score += game.getScore();
+				game.reset();
+			}
+		}
+		auto elapsed = clock() - begin;
+		fn(workerCount, player.getSolver().getNodeCount(), elapsed, score + game.getScore());
+	}
+	executor.setWorkerLimit(executor.getWorkerCount());
+}
+
+}
\ No newline at end of file
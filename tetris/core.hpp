@@ -0,0 +1,669 @@
+#pragma once
+
+extern "C" {
+
+#include <Uefi.h>
+#include <Library/BaseMemoryLib.h>
+
+}
+
+// Platform-free Tetris simulation: no firmware service, clock nor input device is used in here
+// The UEFI app steps it once per frame with keyboard input, `host/` builds it natively to benchmark it.
+namespace tetris {
+
+// xorshift64*, a game is fully determined by its seed and inputs
+class Random
+{
+	UINT64 m_state;
+
+public:
+	// The state must never be zero
+	Random(UINT64 seed) :
+		m_state(seed != 0 ? seed : 0xBAADBEEF)
+	{
+	}
+
+	UINT64 next(void) {
+		m_state ^= m_state >> 12;
+		m_state ^= m_state << 25;
+		m_state ^= m_state >> 27;
+		return m_state * 0x2545F4914F6CDD1D;
+	}
+};
+
+// Player input for a single tick: x and y move the piece, rot rotates it
+struct TickInput
+{
+	INTN x = 0;
+	INTN y = 0;
+	INTN rot = 0;
+};
+
+// Input source replaying a fixed list of events, then idling
+// Events must be sorted by tick, events sharing a tick are summed. Any input source exposes the same `next`.
+class InputScript
+{
+public:
+	struct Event {
+		UINTN tick;
+		TickInput input;
+	};
+
+private:
+	const Event *m_events;
+	UINTN m_eventCount;
+	UINTN m_nextEvent = 0;
+
+public:
+	InputScript(const Event *events, UINTN eventCount) :
+		m_events(events),
+		m_eventCount(eventCount)
+	{
+	}
+
+	TickInput next(UINTN tick) {
+		TickInput res;
+		for (; m_nextEvent < m_eventCount && m_events[m_nextEvent].tick <= tick; m_nextEvent++) {
+			auto &event = m_events[m_nextEvent];
+			if (event.tick != tick)
+				continue;
+			res.x += event.input.x;
+			res.y += event.input.y;
+			res.rot += event.input.rot;
+		}
+		return res;
+	}
+};
+
+class Game
+{
+public:
+	static inline constexpr UINTN fieldWidth = 10;
+	static inline constexpr UINTN fieldHeight = 18;
+	// Ticks per second, the difficulty ramps up with the time played
+	static inline constexpr UINTN framerate = 60;
+
+	class Piece
+	{
+	public:
+		static inline constexpr UINTN width = 4;
+		static inline constexpr UINTN height = 4;
+		static inline constexpr UINTN maxPosCount = 4;
+
+		struct Position {
+			// Bit x of a row is column `left + x` of the piece, rows out of [top, bottom) are empty
+			UINT8 rows[height];
+			// Bounding box of the piece within its 4x4 grid, as [left, right) and [top, bottom)
+			UINT8 left;
+			UINT8 right;
+			UINT8 top;
+			UINT8 bottom;
+		};
+
+	private:
+		CHAR16 m_display;
+		UINT8 m_positionCount;
+		// Puts the bounding box of the first position centered at the top of the field
+		INT8 m_spawnX;
+		INT8 m_spawnY;
+		Position m_positions[maxPosCount];
+
+	public:
+		template <UINTN PositionCount>
+		static constexpr Piece build(CHAR16 display, const bool (&positions)[PositionCount][height][width]) {
+			Piece res {};
+			res.m_display = display;
+			res.m_positionCount = PositionCount;
+			for (UINTN i = 0; i < PositionCount; i++) {
+				auto &position = res.m_positions[i];
+				position.left = width;
+				position.top = height;
+				for (UINTN y = 0; y < height; y++)
+					for (UINTN x = 0; x < width; x++) {
+						if (!positions[i][y][x])
+							continue;
+						position.left = x < position.left ? x : position.left;
+						position.right = x + 1 > position.right ? x + 1 : position.right;
+						position.top = y < position.top ? y : position.top;
+						position.bottom = y + 1;
+					}
+				for (UINTN y = position.top; y < position.bottom; y++)
+					for (UINTN x = position.left; x < position.right; x++)
+						position.rows[y] |= positions[i][y][x] << (x - position.left);
+			}
+
+			auto &spawn = res.m_positions[0];
+			res.m_spawnX = static_cast<INT8>((fieldWidth - (spawn.right - spawn.left)) / 2 - spawn.left);
+			res.m_spawnY = -static_cast<INT8>(spawn.top);
+			return res;
+		}
+
+		CHAR16 getDisplay(void) const {
+			return m_display;
+		}
+
+		UINTN getPositionCount(void) const {
+			return m_positionCount;
+		}
+
+		INTN getSpawnX(void) const {
+			return m_spawnX;
+		}
+
+		INTN getSpawnY(void) const {
+			return m_spawnY;
+		}
+
+		const Position& getPosition(UINTN position) const {
+			return m_positions[position];
+		}
+	};
+
+	static inline constexpr UINTN pieceCount = 7;
+	// Generated at compile time, see the definition below `Game`
+	static const Piece pieces[pieceCount];
+
+	// Bit x of a row is set when cell x is occupied, a row is complete once it equals `fullRow`
+	static inline constexpr UINT16 fullRow = (1 << fieldWidth) - 1;
+	using Rows = UINT16[fieldHeight];
+
+	// Field operations on bare rows, shared with `Solver` which works on copies of the field
+
+	static bool isIntersecting(const Rows &rows, const Piece::Position &position, INTN pieceX, INTN pieceY) {
+		// Walls and floor are a check of the bounding box, only the rows within it may overlap the field
+		auto left = pieceX + position.left;
+		if (
+			left < 0 || pieceX + position.right > static_cast<INTN>(fieldWidth) ||
+			pieceY + position.top < 0 || pieceY + position.bottom > static_cast<INTN>(fieldHeight)
+		)
+			return true;
+
+		UINT16 hit = 0;
+		for (UINTN i = position.top; i < position.bottom; i++)
+			hit |= rows[pieceY + i] & (position.rows[i] << left);
+		return hit != 0;
+	}
+
+	// Every dot of the piece must be within the field, returns the mask of the rows it completed
+	static UINT32 place(Rows &rows, const Piece::Position &position, INTN pieceX, INTN pieceY) {
+		auto left = pieceX + position.left;
+		UINT32 completedLines = 0;
+		for (UINTN i = position.top; i < position.bottom; i++) {
+			auto y = pieceY + i;
+			rows[y] |= position.rows[i] << left;
+			if (rows[y] == fullRow)
+				completedLines |= 1 << y;
+		}
+		return completedLines;
+	}
+
+	// Moves every row above the removed ones down in a single pass, from the bottom up
+	static void removeLines(Rows &rows, UINT32 lines) {
+		UINTN dst = fieldHeight;
+		for (UINTN src = fieldHeight; src-- > 0;) {
+			if ((lines >> src) & 1)
+				continue;
+			dst--;
+			rows[dst] = rows[src];
+		}
+		for (UINTN i = 0; i < dst; i++)
+			rows[i] = 0;
+	}
+
+	static UINTN countBits(UINT32 value) {
+		// Not `__builtin_popcount`, which is a libgcc call without POPCNT
+		value = value - ((value >> 1) & 0x55555555);
+		value = (value & 0x33333333) + ((value >> 2) & 0x33333333);
+		value = (value + (value >> 4)) & 0x0F0F0F0F;
+		return (value * 0x01010101) >> 24;
+	}
+
+private:
+	Rows m_fieldRows;
+	// Display of each occupied cell, only read when drawing
+	CHAR16 m_fieldColors[fieldHeight][fieldWidth];
+	// Bit y is set when row y is complete
+	UINT32 m_completedLines;
+
+	void resetField(void) {
+		ZeroMem(m_fieldRows, sizeof(m_fieldRows));
+		SetMem16(m_fieldColors, sizeof(m_fieldColors), u'\0');
+		m_completedLines = 0;
+	}
+
+	bool m_gameOver;
+	UINTN m_score;
+	UINTN m_completedLineTicks;
+
+	UINTN m_currentPiece;
+	UINTN m_currentPiecePosition;
+	INTN m_currentPieceX;
+	INTN m_currentPieceY;
+	UINTN m_currentPieceFall;
+	UINTN m_currentPieceFastFall;
+	UINTN m_currentPieceMove;
+	INTN m_currentPieceLastTickRot;
+	// Initialized, as the first `genNextPiece` of a game makes it the current piece
+	UINTN m_nextPiece = 0;
+	// Pieces spawned since the game started, lets players notice a new piece without diffing the state
+	UINTN m_spawnCount;
+
+	Random m_random;
+	UINTN m_tick;
+
+	void resetGame(void) {
+		m_tick = 0;
+		m_gameOver = false;
+		m_score = 0;
+		m_completedLineTicks = 0;
+		m_currentPieceLastTickRot = 0;
+		m_spawnCount = 0;
+		resetField();
+		for (UINTN i = 0; i < 2; i++)
+			genNextPiece();
+	}
+
+	void resetPieceTransient(void) {
+		m_currentPieceFall = 0;
+		m_currentPieceFastFall = 0;
+		m_currentPieceMove = 0;
+	}
+
+	void genNextPiece(void) {
+		m_currentPiece = m_nextPiece;
+		m_currentPiecePosition = 0;
+		m_currentPieceX = pieces[m_currentPiece].getSpawnX();
+		m_currentPieceY = pieces[m_currentPiece].getSpawnY();
+		resetPieceTransient();
+		m_nextPiece = m_random.next() % pieceCount;
+		m_spawnCount++;
+
+		if (isPieceIntersectingField(m_currentPiece, m_currentPiecePosition, m_currentPieceX, m_currentPieceY)) {
+			m_currentPieceX = -64;
+			m_gameOver = true;
+		}
+	}
+
+	UINTN getDifficulty(UINTN tick) const {
+		if (tick < framerate * 60)
+			return 0;
+		else if (tick < framerate * 60 * 3)
+			return 1;
+		else if (tick < framerate * 60 * 5)
+			return 2;
+		else if (tick < framerate * 60 * 10)
+			return 3;
+		else if (tick < framerate * 60 * 20)
+			return 4;
+		else if (tick < framerate * 60 * 45)
+			return 5;
+		else
+			return 6;
+	}
+
+	UINTN getFallingSpeed(UINTN difficulty) const {
+		if (difficulty == 0)
+			return 50;
+		else if (difficulty == 1)
+			return 40;
+		else if (difficulty == 2)
+			return 30;
+		else if (difficulty == 3)
+			return 20;
+		else if (difficulty == 4)
+			return 10;
+		else if (difficulty == 5)
+			return 5;
+		else
+			return 4;
+	}
+
+	UINTN getScorePerLine(UINTN difficulty) const {
+		if (difficulty == 0)
+			return 100;
+		else if (difficulty == 1)
+			return 250;
+		else if (difficulty == 2)
+			return 500;
+		else if (difficulty == 3)
+			return 1000;
+		else if (difficulty == 4)
+			return 2500;
+		else if (difficulty == 5)
+			return 5000;
+		else
+			return 10000;
+	}
+
+	bool isPieceIntersectingField(UINTN pieceIndex, UINTN piecePosition, INTN pieceX, INTN pieceY) const {
+		return isIntersecting(m_fieldRows, pieces[pieceIndex].getPosition(piecePosition), pieceX, pieceY);
+	}
+
+	bool moveBy(INTN rot, INTN x, INTN y) {
+		auto &currentPiece = pieces[m_currentPiece];
+
+		INTN nextPosition = m_currentPiecePosition + rot;
+		if (nextPosition < 0)
+			nextPosition = static_cast<INTN>(currentPiece.getPositionCount() - 1);
+		if (nextPosition >= static_cast<INTN>(currentPiece.getPositionCount()))
+			nextPosition = 0;
+		INTN nextX = m_currentPieceX + x;
+		INTN nextY = m_currentPieceY + y;
+
+		if (isPieceIntersectingField(m_currentPiece, nextPosition, nextX, nextY)) {
+			return false;
+		} else {
+			m_currentPiecePosition = nextPosition;
+			m_currentPieceX = nextX;
+			m_currentPieceY = nextY;
+			return true;
+		}
+	}
+
+	void emplaceCurrentPiece(void) {
+		auto &currentPiece = pieces[m_currentPiece];
+		auto currentPieceDisplay = currentPiece.getDisplay();
+		auto &position = currentPiece.getPosition(m_currentPiecePosition);
+		// Every dot of the piece is guaranteed to be within the field, so no boundary checking
+		m_completedLines |= place(m_fieldRows, position, m_currentPieceX, m_currentPieceY);
+		auto left = m_currentPieceX + position.left;
+		for (UINTN i = position.top; i < position.bottom; i++)
+			for (UINTN bits = position.rows[i]; bits != 0; bits &= bits - 1)
+				m_fieldColors[m_currentPieceY + i][left + __builtin_ctz(bits)] = currentPieceDisplay;
+	}
+
+	static inline constexpr UINTN completedLineIterationCount = 6;
+	static inline constexpr UINTN completedLineIterationLength = framerate / 3;
+
+	UINTN getCompletedLineCount(void) const {
+		return countBits(m_completedLines);
+	}
+
+	bool hasAnyCompletedLine(void) const {
+		return m_completedLines != 0;
+	}
+
+	// Moves every row above the completed ones down in a single pass, from the bottom up
+	void flushCompletedLines(UINTN difficulty) {
+		m_score += getCompletedLineCount() * getScorePerLine(difficulty);
+
+		removeLines(m_fieldRows, m_completedLines);
+		// Same pass over the display of the cells
+		UINTN dst = fieldHeight;
+		for (UINTN src = fieldHeight; src-- > 0;) {
+			if (isLineCompleted(src))
+				continue;
+			dst--;
+			if (dst != src)
+				CopyMem(m_fieldColors[dst], m_fieldColors[src], sizeof(m_fieldColors[dst]));
+		}
+		for (UINTN i = 0; i < dst; i++)
+			SetMem16(m_fieldColors[i], sizeof(m_fieldColors[i]), u'\0');
+		m_completedLines = 0;
+	}
+
+	void processTick(UINTN tick, INTN x, INTN y, INTN rot) {
+		if (m_gameOver)
+			return;
+
+		auto difficulty = getDifficulty(tick);
+
+		if (hasAnyCompletedLine()) {
+			if (getCompletedLineIteration() < completedLineIterationCount) {
+				m_completedLineTicks++;
+			} else {
+				flushCompletedLines(difficulty);
+				m_completedLineTicks = 0;
+			}
+			return;
+		}
+
+		if (y == 0)
+			m_currentPieceFall++;
+		if (m_currentPieceFall >= getFallingSpeed(difficulty)) {
+			m_currentPieceFall = 0;
+			if (!moveBy(0, 0, 1)) {
+				emplaceCurrentPiece();
+				genNextPiece();
+			}
+		}
+		auto didPlayMoveSucceed = moveBy(rot, x, y);
+		if (didPlayMoveSucceed && y != 0) {
+			// Prevent quick gravity fall if player wants to move faster
+			m_currentPieceFall = 0;
+		}
+	}
+
+public:
+	Game(UINT64 seed) :
+		m_random(seed)
+	{
+		resetGame();
+	}
+
+	// Starts a new game, the random sequence goes on from where the previous game left it
+	void reset(void) {
+		resetGame();
+	}
+
+	// Starts a new game with the piece sequence of `seed`, so that the same inputs play the same game again
+	void reset(UINT64 seed) {
+		m_random = Random(seed);
+		resetGame();
+	}
+
+	void tick(const TickInput &input) {
+		processTick(m_tick, input.x, input.y, input.rot);
+		m_tick++;
+	}
+
+	// InputSource must provide `TickInput next(UINTN tick)`, stops early on game over
+	template <typename InputSource>
+	void run(InputSource &inputSource, UINTN tickCount) {
+		for (UINTN i = 0; i < tickCount && !m_gameOver; i++)
+			tick(inputSource.next(m_tick));
+	}
+
+	UINTN getTick(void) const {
+		return m_tick;
+	}
+
+	bool isGameOver(void) const {
+		return m_gameOver;
+	}
+
+	UINTN getScore(void) const {
+		return m_score;
+	}
+
+	// Bit x is set when cell x of row y is occupied
+	UINT16 getFieldRow(UINTN y) const {
+		return m_fieldRows[y];
+	}
+
+	const Rows& getFieldRows(void) const {
+		return m_fieldRows;
+	}
+
+	// Display of an occupied cell
+	CHAR16 getFieldDisplay(UINTN x, UINTN y) const {
+		return m_fieldColors[y][x];
+	}
+
+	bool isLineCompleted(UINTN y) const {
+		return (m_completedLines >> y) & 1;
+	}
+
+	// Completed lines blink before being flushed, odd iterations are blank
+	UINTN getCompletedLineIteration(void) const {
+		return m_completedLineTicks / completedLineIterationLength;
+	}
+
+	const Piece& getCurrentPiece(void) const {
+		return pieces[m_currentPiece];
+	}
+
+	// Index into `pieces`
+	UINTN getCurrentPieceIndex(void) const {
+		return m_currentPiece;
+	}
+
+	UINTN getCurrentPiecePosition(void) const {
+		return m_currentPiecePosition;
+	}
+
+	INTN getCurrentPieceX(void) const {
+		return m_currentPieceX;
+	}
+
+	INTN getCurrentPieceY(void) const {
+		return m_currentPieceY;
+	}
+
+	const Piece& getNextPiece(void) const {
+		return pieces[m_nextPiece];
+	}
+
+	UINTN getNextPieceIndex(void) const {
+		return m_nextPiece;
+	}
+
+	// Increases on every new current piece, and restarts along with the game
+	UINTN getSpawnCount(void) const {
+		return m_spawnCount;
+	}
+};
+
+constexpr Game::Piece Game::pieces[pieceCount] {
+	Piece::build<1>(u'@', {
+		{
+			{false, true, true, false},
+			{false, true, true, false},
+			{false, false, false, false},
+			{false, false, false, false}
+		}
+	}),
+	Piece::build<2>(u'H', {
+		{
+			{false, false, false, false},
+			{true, true, true, true},
+			{false, false, false, false},
+			{false, false, false, false}
+		},
+		{
+			{false, true, false, false},
+			{false, true, false, false},
+			{false, true, false, false},
+			{false, true, false, false}
+		}
+	}),
+	Piece::build<2>(u'W', {
+		{
+			{false, true, true, false},
+			{true, true, false, false},
+			{false, false, false, false},
+			{false, false, false, false}
+		},
+		{
+			{false, true, false, false},
+			{false, true, true, false},
+			{false, false, true, false},
+			{false, false, false, false}
+		}
+	}),
+	Piece::build<2>(u'Z', {
+		{
+			{false, true, true, false},
+			{false, false, true, true},
+			{false, false, false, false},
+			{false, false, false, false}
+		},
+		{
+			{false, false, true, false},
+			{false, true, true, false},
+			{false, true, false, false},
+			{false, false, false, false}
+		}
+	}),
+	Piece::build<4>(u'L', {
+		{
+			{false, true, true, true},
+			{false, false, false, true},
+			{false, false, false, false},
+			{false, false, false, false}
+		},
+		{
+			{false, false, true, false},
+			{false, false, true, false},
+			{false, true, true, false},
+			{false, false, false, false}
+		},
+		{
+			{false, true, false, false},
+			{false, true, true, true},
+			{false, false, false, false},
+			{false, false, false, false}
+		},
+		{
+			{false, true, true, false},
+			{false, true, false, false},
+			{false, true, false, false},
+			{false, false, false, false}
+		}
+	}),
+	Piece::build<4>(u'T', {
+		{
+			{true, true, true, false},
+			{true, false, false, false},
+			{false, false, false, false},
+			{false, false, false, false}
+		},
+		{
+			{false, true, true, false},
+			{false, false, true, false},
+			{false, false, true, false},
+			{false, false, false, false}
+		},
+		{
+			{false, false, true, false},
+			{true, true, true, false},
+			{false, false, false, false},
+			{false, false, false, false}
+		},
+		{
+			{false, true, false, false},
+			{false, true, false, false},
+			{false, true, true, false},
+			{false, false, false, false}
+		}
+
+	}),
+	Piece::build<4>(u'X', {
+		{
+			{false, false, false, false},
+			{true, true, true, false},
+			{false, true, false, false},
+			{false, false, false, false}
+		},
+		{
+			{false, true, false, false},
+			{true, true, false, false},
+			{false, true, false, false},
+			{false, false, false, false}
+		},
+		{
+			{false, true, false, false},
+			{true, true, true, false},
+			{false, false, false, false},
+			{false, false, false, false}
+		},
+		{
+			{false, true, false, false},
+			{false, true, true, false},
+			{false, true, false, false},
+			{false, false, false, false}
+		}
+	})
+};
+
+}
\ No newline at end of file
@@ -0,0 +1,25 @@
+#pragma once
+
+// Host stand-in for the EDK2 BaseMemoryLib functions used by the game headers
+
+#include <Uefi.h>
+#include <string.h>
+
+static inline VOID* CopyMem(VOID *destinationBuffer, const VOID *sourceBuffer, UINTN length) {
+	return memmove(destinationBuffer, sourceBuffer, length);
+}
+
+static inline VOID* ZeroMem(VOID *buffer, UINTN length) {
+	return memset(buffer, 0, length);
+}
+
+static inline VOID* SetMem16(VOID *buffer, UINTN length, UINT16 value) {
+	UINT16 *p = (UINT16*)buffer;
+	for (UINTN i = 0; i < length / sizeof(UINT16); i++)
+		p[i] = value;
+	return buffer;
+}
+
+static inline INTN CompareMem(const VOID *destinationBuffer, const VOID *sourceBuffer, UINTN length) {
+	return memcmp(destinationBuffer, sourceBuffer, length);
+}
\ No newline at end of file
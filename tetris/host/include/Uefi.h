@@ -0,0 +1,19 @@
+#pragma once
+
+// Host stand-in for the EDK2 base types used by `../core.hpp`
+
+#include <stdint.h>
+
+typedef uint8_t UINT8;
+typedef uint16_t UINT16;
+typedef uint32_t UINT32;
+typedef uint64_t UINT64;
+typedef int8_t INT8;
+typedef int16_t INT16;
+typedef int32_t INT32;
+typedef int64_t INT64;
+typedef uint64_t UINTN;
+typedef int64_t INTN;
+typedef unsigned char BOOLEAN;
+typedef unsigned short CHAR16;
+typedef void VOID;
\ No newline at end of file
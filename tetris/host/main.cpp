@@ -0,0 +1,155 @@
+#include "../core.hpp"
+#include "../ai.hpp"
+#include "../replay.hpp"
+#include "threads.hpp"
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <vector>
+
+// Random player at about 15 inputs per second, so that pieces get moved, rotated and pushed down along the way
+class RandomInput
+{
+	tetris::Random m_random;
+
+public:
+	RandomInput(UINT64 seed) :
+		m_random(seed)
+	{
+	}
+
+	tetris::TickInput next(UINTN) {
+		tetris::TickInput res;
+		switch (m_random.next() % 16) {
+		case 0:
+			res.x = -1;
+			break;
+		case 1:
+			res.x = 1;
+			break;
+		case 2:
+			res.y = 1;
+			break;
+		case 3:
+			res.rot = 1;
+			break;
+		}
+		return res;
+	}
+};
+
+static int benchmarkSimulation(UINTN tickCount, UINT64 seed)
+{
+	tetris::Game game(seed);
+	RandomInput input(seed + 1);
+	UINTN gameCount = 1;
+	UINTN totalScore = 0;
+
+	auto begin = std::chrono::steady_clock::now();
+	for (UINTN i = 0; i < tickCount; i++) {
+		game.tick(input.next(game.getTick()));
+		if (game.isGameOver()) {
+			totalScore += game.getScore();
+			game.reset();
+			gameCount++;
+		}
+	}
+	auto end = std::chrono::steady_clock::now();
+	totalScore += game.getScore();
+
+	double seconds = std::chrono::duration<double>(end - begin).count();
+	printf("%lu ticks in %.3f s: %.0f ticks/s, %.2f ns/tick\n", tickCount, seconds, tickCount / seconds, seconds * 1e9 / tickCount);
+	// Same seed, same games: compare these between builds to catch behavior changes
+	printf("%lu games played, total score %lu (seed %lu)\n", gameCount, totalScore, seed);
+	return 0;
+}
+
+static int benchmarkSolver(UINTN pieceCount, UINT64 seed)
+{
+	ThreadPool threadPool;
+	printf("Solving %lu pieces on 1 to %lu threads (seed %lu)\n", pieceCount, threadPool.getWorkerCount(), seed);
+	auto clock = [] {
+		return static_cast<UINT64>(std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count());
+	};
+	double singleThreadNodesPerSecond = 0;
+	tetris::benchmarkSolver(threadPool, clock, seed, pieceCount, [&](UINTN workerCount, UINT64 nodeCount, UINT64 nanoseconds, UINTN score) {
+		double nodesPerSecond = nodeCount * 1e9 / nanoseconds;
+		if (workerCount == 1)
+			singleThreadNodesPerSecond = nodesPerSecond;
+		// The score must not change with the thread count
+		printf("%lu thread(s): %.0f nodes/s, speedup x%.2f (%lu nodes, score %lu)\n", workerCount, nodesPerSecond,
+			nodesPerSecond / singleThreadNodesPerSecond, nodeCount, score);
+	});
+	return 0;
+}
+
+// Records a game of the solver, in the same format as the recordings of the firmware app
+static int recordGame(const char *path, UINTN tickCount, UINT64 seed)
+{
+	std::vector<UINT8> buffer(sizeof(tetris::ReplayHeader) + tickCount * tetris::replayRunSize);
+	tetris::InputRecorder recorder(buffer.data(), buffer.size(), seed);
+	tetris::Game game(seed);
+	ThreadPool threadPool;
+	tetris::AutoPlayer<ThreadPool> input(game, threadPool);
+	for (UINTN i = 0; i < tickCount && !game.isGameOver(); i++) {
+		auto tickInput = input.next(game.getTick());
+		recorder.record(tickInput);
+		game.tick(tickInput);
+	}
+	auto size = recorder.finish(game.getScore());
+
+	auto file = fopen(path, "wb");
+	if (file == nullptr || fwrite(buffer.data(), 1, size, file) != size) {
+		perror(path);
+		return 1;
+	}
+	fclose(file);
+	printf("%lu ticks recorded to %s (%lu bytes), score %lu\n", game.getTick(), path, size, game.getScore());
+	return 0;
+}
+
+// Plays a recording back uncapped, from the firmware app or `recordGame`
+static int replayGame(const char *path)
+{
+	auto file = fopen(path, "rb");
+	if (file == nullptr) {
+		perror(path);
+		return 1;
+	}
+	std::vector<UINT8> buffer;
+	UINT8 chunk[4096];
+	for (size_t size; (size = fread(chunk, 1, sizeof(chunk), file)) > 0;)
+		buffer.insert(buffer.end(), chunk, chunk + size);
+	fclose(file);
+
+	tetris::InputReplay replay(buffer.data(), buffer.size());
+	if (!replay.isValid()) {
+		fprintf(stderr, "%s: not a valid recording of this version\n", path);
+		return 1;
+	}
+	tetris::Game game(replay.getSeed());
+	auto begin = std::chrono::steady_clock::now();
+	game.run(replay, replay.getTickCount());
+	auto end = std::chrono::steady_clock::now();
+
+	double seconds = std::chrono::duration<double>(end - begin).count();
+	printf("%lu ticks in %.6f s: %.0f ticks/s, %.2f ns/tick\n", game.getTick(), seconds, game.getTick() / seconds, seconds * 1e9 / game.getTick());
+	printf("score %lu, recorded score %lu\n", game.getScore(), replay.getScore());
+	return game.getScore() == replay.getScore() ? 0 : 1;
+}
+
+int main(int argc, char **argv)
+{
+	if (argc > 1 && strcmp(argv[1], "sim") == 0)
+		return benchmarkSimulation(argc > 2 ? strtoull(argv[2], nullptr, 0) : 10000000, argc > 3 ? strtoull(argv[3], nullptr, 0) : 1);
+	if (argc > 1 && strcmp(argv[1], "ai") == 0)
+		return benchmarkSolver(argc > 2 ? strtoull(argv[2], nullptr, 0) : 1000, argc > 3 ? strtoull(argv[3], nullptr, 0) : 1);
+	if (argc > 2 && strcmp(argv[1], "record") == 0)
+		return recordGame(argv[2], argc > 3 ? strtoull(argv[3], nullptr, 0) : 100000, argc > 4 ? strtoull(argv[4], nullptr, 0) : 1);
+	if (argc > 2 && strcmp(argv[1], "replay") == 0)
+		return replayGame(argv[2]);
+	fprintf(stderr, "Usage: %s sim [ticks] [seed] | ai [pieces] [seed] | record <file> [ticks] [seed] | replay <file>\n", argv[0]);
+	return 1;
+}
\ No newline at end of file
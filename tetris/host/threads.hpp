@@ -0,0 +1,110 @@
+#pragma once
+
+#include <Uefi.h>
+
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Host counterpart of `boot::MpExecutor`: runs loops across a fixed set of threads, the calling one included
+// Iterations are handed out dynamically from a shared counter.
+class ThreadPool
+{
+	std::vector<std::thread> m_threads;
+	std::mutex m_mutex;
+	std::condition_variable m_loopStarted;
+	std::condition_variable m_loopDone;
+	UINTN m_workerLimit;
+	UINTN m_generation = 0;
+	bool m_stopping = false;
+
+	// Current loop, only changed while no thread is running it
+	UINTN m_count = 0;
+	std::atomic<UINTN> m_next;
+	void *m_context = nullptr;
+	void (*m_body)(void *context, UINTN i) = nullptr;
+	UINTN m_runningCount = 0;
+
+	void runIterations(void) {
+		while (true) {
+			auto i = m_next.fetch_add(1, std::memory_order_relaxed);
+			if (i >= m_count)
+				break;
+			m_body(m_context, i);
+		}
+	}
+
+	// Thread `index` is worker `index + 1`, the caller of `parallelFor` being worker 0
+	void threadLoop(UINTN index) {
+		UINTN generation = 0;
+		while (true) {
+			{
+				std::unique_lock lock(m_mutex);
+				m_loopStarted.wait(lock, [&] { return m_stopping || m_generation != generation; });
+				if (m_stopping)
+					return;
+				generation = m_generation;
+			}
+			// Threads above the worker limit sit this loop out
+			if (index + 1 < m_workerLimit)
+				runIterations();
+			std::lock_guard lock(m_mutex);
+			if (--m_runningCount == 0)
+				m_loopDone.notify_one();
+		}
+	}
+
+public:
+	// Defaults to one worker per hardware thread
+	ThreadPool(UINTN workerCount = std::thread::hardware_concurrency()) :
+		m_workerLimit(workerCount < 1 ? 1 : workerCount)
+	{
+		for (UINTN i = 0; i + 1 < m_workerLimit; i++)
+			m_threads.emplace_back(&ThreadPool::threadLoop, this, i);
+	}
+
+	~ThreadPool() {
+		{
+			std::lock_guard lock(m_mutex);
+			m_stopping = true;
+		}
+		m_loopStarted.notify_all();
+		for (auto &thread : m_threads)
+			thread.join();
+	}
+
+	UINTN getWorkerCount(void) const {
+		return m_threads.size() + 1;
+	}
+
+	// Clamped to [1, getWorkerCount()]
+	void setWorkerLimit(UINTN workerLimit) {
+		m_workerLimit = workerLimit < 1 ? 1 : workerLimit > getWorkerCount() ? getWorkerCount() : workerLimit;
+	}
+
+	// Calls `fn(i)` for every i in [0, count) and returns once they all returned
+	template <typename Fn>
+	void parallelFor(UINTN count, Fn &&fn) {
+		m_count = count;
+		m_next.store(0, std::memory_order_relaxed);
+		m_context = &fn;
+		m_body = [](void *context, UINTN i) {
+			(*reinterpret_cast<Fn*>(context))(i);
+		};
+		if (count > 1 && m_workerLimit > 1) {
+			{
+				std::lock_guard lock(m_mutex);
+				m_runningCount = m_threads.size();
+				m_generation++;
+			}
+			m_loopStarted.notify_all();
+			runIterations();
+			std::unique_lock lock(m_mutex);
+			m_loopDone.wait(lock, [this] { return m_runningCount == 0; });
+		} else {
+			runIterations();
+		}
+	}
+};
\ No newline at end of file
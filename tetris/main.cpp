@@ -12,6 +12,14 @@ extern "C" {
 
 }
 
+#include "core.hpp"
+#include "ai.hpp"
+#include "replay.hpp"
+#include "pacer.hpp"
+#include "../userland/boot.hpp"
+#include "../userland/font.hpp"
+#include "../userland/mp.hpp"
+#include "../userland/tsc.hpp"
 #include <array>
 #include <optional>
 
@@ -47,6 +55,15 @@ public:
 		}
 		return std::nullopt;
 	}
+
+	EFI_INPUT_KEY waitKey(void) const {
+		while (true) {
+			UINTN index;
+			efiAssert(gBS->WaitForEvent(1, &m_input->WaitForKey, &index));
+			if (auto key = readKey())
+				return *key;
+		}
+	}
 };
 
 class Output
@@ -75,17 +92,38 @@ public:
 
 class Tetris
 {
-	Input m_input;
-	Output m_output;
-
-
+public:
 	static inline constexpr UINTN framebufferWidth = 80;
 	static inline constexpr UINTN framebufferHeight = 24;
-	CHAR16 m_framebuffer[framebufferHeight][framebufferWidth];
+	// Each row is null-terminated at `framebufferWidth - 1`
+	using Framebuffer = CHAR16[framebufferHeight][framebufferWidth];
+
+	static inline constexpr UINTN fieldWidth = tetris::Game::fieldWidth;
+	static inline constexpr UINTN fieldHeight = tetris::Game::fieldHeight;
+	static inline constexpr UINTN nextPieceX = 15;
+	static inline constexpr UINTN nextPieceY = 4;
 
-	static inline constexpr UINTN fieldWidth = 10;
-	static inline constexpr UINTN fieldHeight = 18;
+	// Cells of the field (borders included) and of the next piece, graphical renderers draw them as blocks rather than glyphs
+	static bool isBlockCell(UINTN x, UINTN y) {
+		if (x < fieldWidth + 2 && y < fieldHeight + 1)
+			return true;
+		return x >= nextPieceX && x < nextPieceX + tetris::Game::Piece::width && y >= nextPieceY && y < nextPieceY + tetris::Game::Piece::height;
+	}
+
+private:
+	using Piece = tetris::Game::Piece;
+	static inline constexpr UINTN framerate = tetris::Game::framerate;
+
+	Input m_input;
+	UINT64 m_tscFrequency;
+	tetris::Game m_game;
 
+	Framebuffer m_framebuffer;
+	// Values currently formatted into `m_framebuffer`, so that their strings are only built again on change
+	UINTN m_drawnScore;
+	tetris::FramePacer::Stats m_drawnStats;
+
+	// Static elements are drawn once here, every frame then only draws over what may have changed
 	void resetFramebuffer(void) {
 		SetMem16(m_framebuffer, sizeof(m_framebuffer), u' ');
 		for (UINTN i = 0; i < framebufferHeight; i++)
@@ -97,294 +135,31 @@ class Tetris
 			m_framebuffer[i][0] = u'#';
 			m_framebuffer[i][fieldWidth + 1] = u'#';
 		}
+		blit(14, 2, uToC16(u"NEXT:"));
+		m_drawnScore = static_cast<UINTN>(-1);
+		m_drawnStats = tetris::FramePacer::Stats { .missedCount = static_cast<UINTN>(-1) };
 	}
 
-	void sleep(UINTN microseconds) const {
-		efiAssert(gBS->Stall(microseconds));
-	}
-
-	class Piece
-	{
-	public:
-		static inline constexpr UINTN width = 4;
-		static inline constexpr UINTN height = 4;
-		static inline constexpr UINTN maxPosCount = 4;
-
-	private:
-		CHAR16 m_display;
-		UINTN m_positionCount;
-		bool m_positions[maxPosCount][height][width];
-
-	public:
-		Piece(CHAR16 display, UINTN maxPosCount, const bool (&positions)[][height][width]) :
-			m_display(display),
-			m_positionCount(maxPosCount) {
-			CopyMem(m_positions, positions, width * height * maxPosCount);
-		}
-
-		template <UINTN PositionCount>
-		static Piece build(CHAR16 display, const bool (&positions)[PositionCount][height][width]) {
-			return Piece(display, PositionCount, positions);
-		}
-
-		CHAR16 getDisplay(void) const {
-			return m_display;
-		}
-
-		UINTN getPositionCount(void) const {
-			return m_positionCount;
-		}
-
-		bool at(UINTN position, UINTN x, UINTN y) const {
-			return m_positions[position][y][x];
-		}
-	};
-
-	static inline constexpr UINTN pieceCount = 7;
-	const Piece m_pieces[pieceCount];
-	CHAR16 m_field[fieldHeight][fieldWidth];
-
-	void resetField(void) {
-		SetMem16(m_field, sizeof(m_field), u'\0');
-	}
-
-	bool m_gameOver;
-	UINTN m_score;
-	UINTN m_completedLineTicks;
-
-	UINTN m_currentPiece;
-	UINTN m_currentPiecePosition;
-	INTN m_currentPieceX;
-	INTN m_currentPieceY;
-	UINTN m_currentPieceFall;
-	UINTN m_currentPieceFastFall;
-	UINTN m_currentPieceMove;
-	INTN m_currentPieceLastTickRot;
-	UINTN m_nextPiece;
-
-	UINTN m_lastRandom = 0xBAADBEEF;
-	// To not use as a face value, always modulate this in some manner
-	UINTN random(void) {
-		auto cur = AsmReadTsc() >> 7;
-		auto res = cur ^ m_lastRandom;
-		m_lastRandom = res;
-		return res;
-	}
-
-	void resetGame(void) {
-		m_gameOver = false;
-		m_score = 0;
-		m_completedLineTicks = 0;
-		m_currentPieceLastTickRot = 0;
-		resetField();
-		for (UINTN i = 0; i < 2; i++)
-			genNextPiece();
-	}
-
-	void resetPieceTransient(void) {
-		m_currentPieceFall = 0;
-		m_currentPieceFastFall = 0;
-		m_currentPieceMove = 0;
-	}
-
-	void genNextPiece(void) {
-		m_currentPiece = m_nextPiece;
-		m_currentPiecePosition = 0;
-		m_currentPieceX = 3;
-		m_currentPieceY = 0;
-		resetPieceTransient();
-		m_nextPiece = random() % pieceCount;
-
-		if (isPieceIntersectingField(m_currentPiece, m_currentPiecePosition, m_currentPieceX, m_currentPieceY)) {
-			m_currentPieceX = -64;
-			m_gameOver = true;
-			drawGameOver();
-		}
-
-		drawNext();
-	}
-
-	static inline constexpr UINTN framerate = 60;
-
-	UINTN getDifficulty(UINTN tick) const {
-		if (tick < framerate * 60)
-			return 0;
-		else if (tick < framerate * 60 * 3)
-			return 1;
-		else if (tick < framerate * 60 * 5)
-			return 2;
-		else if (tick < framerate * 60 * 10)
-			return 3;
-		else if (tick < framerate * 60 * 20)
-			return 4;
-		else if (tick < framerate * 60 * 45)
-			return 5;
-		else
-			return 6;
-	}
-
-	UINTN getFallingSpeed(UINTN difficulty) const {
-		if (difficulty == 0)
-			return 50;
-		else if (difficulty == 1)
-			return 40;
-		else if (difficulty == 2)
-			return 30;
-		else if (difficulty == 3)
-			return 20;
-		else if (difficulty == 4)
-			return 10;
-		else if (difficulty == 5)
-			return 5;
-		else
-			return 4;
-	}
-
-	UINTN getScorePerLine(UINTN difficulty) const {
-		if (difficulty == 0)
-			return 100;
-		else if (difficulty == 1)
-			return 250;
-		else if (difficulty == 2)
-			return 500;
-		else if (difficulty == 3)
-			return 1000;
-		else if (difficulty == 4)
-			return 2500;
-		else if (difficulty == 5)
-			return 5000;
-		else
-			return 10000;
-	}
-
-	bool isPieceIntersectingField(UINTN pieceIndex, UINTN piecePosition, INTN pieceX, INTN pieceY) const {
-		auto &piece = m_pieces[pieceIndex];
-		for (UINTN i = 0; i < Piece::height; i++)
-			for (UINTN j = 0; j < Piece::width; j++) {
-				auto x = pieceX + static_cast<INTN>(j);
-				auto y = pieceY + static_cast<INTN>(i);
-				if (piece.at(piecePosition, j, i)) {
-					if (
-						x < 0 || x >= static_cast<INTN>(fieldWidth) ||
-						y < 0 || y >= static_cast<INTN>(fieldHeight)
-					)
-						return true;
-					if (m_field[y][x] != u'\0')
-						return true;
-				}
-			}
-		return false;
-	}
-
-	bool moveBy(INTN rot, INTN x, INTN y) {
-		auto &currentPiece = m_pieces[m_currentPiece];
-
-		INTN nextPosition = m_currentPiecePosition + rot;
-		if (nextPosition < 0)
-			nextPosition = static_cast<INTN>(currentPiece.getPositionCount() - 1);
-		if (nextPosition >= static_cast<INTN>(currentPiece.getPositionCount()))
-			nextPosition = 0;
-		INTN nextX = m_currentPieceX + x;
-		INTN nextY = m_currentPieceY + y;
-
-		if (isPieceIntersectingField(m_currentPiece, nextPosition, nextX, nextY)) {
-			return false;
-		} else {
-			m_currentPiecePosition = nextPosition;
-			m_currentPieceX = nextX;
-			m_currentPieceY = nextY;
-			return true;
-		}
-	}
-
-	void emplaceCurrentPiece(void) {
-		auto &currentPiece = m_pieces[m_currentPiece];
-		auto currentPieceDisplay = currentPiece.getDisplay();
-		for (UINTN i = 0; i < Piece::height; i++)
-			for (UINTN j = 0; j < Piece::width; j++) {
-				if (currentPiece.at(m_currentPiecePosition, j, i)) {
-					// Every dot of the piece is guaranteed to be within the field, so no boundary checking
-					m_field[m_currentPieceY + static_cast<INTN>(i)][m_currentPieceX + static_cast<INTN>(j)] = currentPieceDisplay;
-				}
-			}
-	}
-
-	static inline constexpr UINTN completedLineIterationCount = 6;
-	static inline constexpr UINTN completedLineIterationLength = framerate / 3;
-
-	bool isLineCompleted(UINTN y) const {
-		for (UINTN i = 0; i < fieldWidth; i++) {
-			if (m_field[y][i] == u'\0')
-				return false;
-		}
-		return true;
-	}
-
-	UINTN getCompletedLineCount(void) const {
-		UINTN res = 0;
-		for (UINTN i = 0; i < fieldHeight; i++) {
-			if (isLineCompleted(i))
-				res++;
-		}
-		return res;
-	}
-
-	bool hasAnyCompletedLine(void) const {
-		return getCompletedLineCount() > 0;
-	}
-
-	UINTN getCompletelineIteration(void) const {
-		return m_completedLineTicks / completedLineIterationLength;
+	void clearField(void) {
+		for (UINTN i = 0; i < fieldHeight; i++)
+			SetMem16(&m_framebuffer[i][1], fieldWidth * sizeof(CHAR16), u' ');
 	}
 
-	void deleteLine(UINTN y) {
-		for (UINTN i = y; i > 0; i--)
-			for (UINTN j = 0; j < fieldWidth; j++) {
-				m_field[i][j] = m_field[i - 1][j];
-			}
-		for (UINTN i = 0; i < fieldWidth; i++)
-			m_field[0][i] = u'\0';
+	void sleep(UINTN microseconds) const {
+		efiAssert(gBS->Stall(microseconds));
 	}
 
-	void flushCompletedLines(UINTN difficulty) {
-		for (UINTN i = 0; i < fieldHeight; i++) {
-			if (isLineCompleted(i)) {
-				m_score += getScorePerLine(difficulty);
-				deleteLine(i);
-			}
-		}
-	}
-
-	void processTick(UINTN tick, INTN x, INTN y, INTN rot) {
-		if (m_gameOver)
-			return;
-
-		auto difficulty = getDifficulty(tick);
-
-		if (hasAnyCompletedLine()) {
-			if (getCompletelineIteration() < completedLineIterationCount) {
-				m_completedLineTicks++;
-			} else {
-				flushCompletedLines(difficulty);
-				m_completedLineTicks = 0;
-			}
-			return;
-		}
-
-		if (y == 0)
-			m_currentPieceFall++;
-		if (m_currentPieceFall >= getFallingSpeed(difficulty)) {
-			m_currentPieceFall = 0;
-			if (!moveBy(0, 0, 1)) {
-				emplaceCurrentPiece();
-				genNextPiece();
-			}
-		}
-		auto didPlayMoveSucceed = moveBy(rot, x, y);
-		if (didPlayMoveSucceed && y != 0) {
-			// Prevent quick gravity fall if player wants to move faster
-			m_currentPieceFall = 0;
+	// Stalls most of the way, then spins on the TSC for the last stretch, as `Stall` only has a microsecond granularity
+	void waitUntil(UINT64 deadlineTsc, UINT64 tscFrequency) const {
+		static constexpr UINT64 spinMicroseconds = 100;
+		auto now = AsmReadTsc();
+		if (now < deadlineTsc) {
+			auto microseconds = (deadlineTsc - now) * 1000000 / tscFrequency;
+			if (microseconds > spinMicroseconds)
+				sleep(microseconds - spinMicroseconds);
 		}
+		while (AsmReadTsc() < deadlineTsc)
+			CpuPause();
 	}
 
 	void drawFieldDot(CHAR16 dot, INTN x, INTN y) {
@@ -400,29 +175,28 @@ class Tetris
 
 		// Matrix, static elements
 		{
-			bool isCompletingBlank = getCompletelineIteration() & 1;
+			bool isCompletingBlank = m_game.getCompletedLineIteration() & 1;
 			for (UINTN i = 0; i < fieldHeight; i++) {
-				auto isComplete = isLineCompleted(i);
-				for (UINTN j = 0; j < fieldWidth; j++) {
-					if (m_field[i][j] != u'\0') {
-						auto display = m_field[i][j];
-						if (isComplete)
-							display = isCompletingBlank ? ' ' : '-';
-						drawFieldDot(display, j, i);
-					}
+				auto isComplete = m_game.isLineCompleted(i);
+				for (UINTN bits = m_game.getFieldRow(i); bits != 0; bits &= bits - 1) {
+					auto j = __builtin_ctz(bits);
+					auto display = m_game.getFieldDisplay(j, i);
+					if (isComplete)
+						display = isCompletingBlank ? ' ' : '-';
+					drawFieldDot(display, j, i);
 				}
 			}
 		}
 
 		// Current piece
 		{
-			auto &currentPiece = m_pieces[m_currentPiece];
+			auto &currentPiece = m_game.getCurrentPiece();
 			auto currentPieceDisplay = currentPiece.getDisplay();
-			for (UINTN i = 0; i < Piece::height; i++)
-				for (UINTN j = 0; j < Piece::width; j++) {
-					if (currentPiece.at(m_currentPiecePosition, j, i)) {
-						drawFieldDot(currentPieceDisplay, m_currentPieceX + static_cast<INTN>(j), m_currentPieceY + static_cast<INTN>(i));
-					}
+			auto &position = currentPiece.getPosition(m_game.getCurrentPiecePosition());
+			for (UINTN i = position.top; i < position.bottom; i++)
+				for (UINTN bits = position.rows[i]; bits != 0; bits &= bits - 1) {
+					auto j = position.left + __builtin_ctz(bits);
+					drawFieldDot(currentPieceDisplay, m_game.getCurrentPieceX() + static_cast<INTN>(j), m_game.getCurrentPieceY() + static_cast<INTN>(i));
 				}
 		}
 	}
@@ -439,254 +213,290 @@ class Tetris
 		for (UINTN i = 0; i < Piece::height; i++)
 			pieceFramebuffer[i][Piece::width] = u'\0';
 
-		auto &currentPiece = m_pieces[m_nextPiece];
-		auto currentPieceDisplay = currentPiece.getDisplay();
-		for (UINTN i = 0; i < Piece::height; i++)
-			for (UINTN j = 0; j < Piece::width; j++) {
-				if (currentPiece.at(0, j, i))
-					pieceFramebuffer[i][j] = currentPieceDisplay;
-			}
+		auto &nextPiece = m_game.getNextPiece();
+		auto nextPieceDisplay = nextPiece.getDisplay();
+		auto &position = nextPiece.getPosition(0);
+		for (UINTN i = position.top; i < position.bottom; i++)
+			for (UINTN bits = position.rows[i]; bits != 0; bits &= bits - 1)
+				pieceFramebuffer[i][position.left + __builtin_ctz(bits)] = nextPieceDisplay;
 
-		blit(14, 2, uToC16(u"NEXT:"));
 		for (UINTN i = 0; i < Piece::height; i++) {
-			blit(15, 4 + i, pieceFramebuffer[i]);
+			blit(nextPieceX, nextPieceY + i, pieceFramebuffer[i]);
 		}
 	}
 
 	void drawScore(void) {
+		if (m_game.getScore() == m_drawnScore)
+			return;
+		m_drawnScore = m_game.getScore();
 		CHAR16 buffer[128];
-		UnicodeSPrint(buffer, sizeof(buffer), uToC16(u"Score: %08u"), m_score);
+		UnicodeSPrint(buffer, sizeof(buffer), uToC16(u"Score: %08u"), m_drawnScore);
 		blit(14, 10, buffer);
 	}
 
 	void drawGameOver(void) {
-		if (m_gameOver) {
+		if (m_game.isGameOver()) {
 			blit(15, 14, uToC16(u"[GAME OVER!]"));
 		}
 	}
 
-	void drawStats(UINTN frametime) {
+	void drawStats(const tetris::FramePacer::Stats &stats, UINT64 tscFrequency) {
+		if (CompareMem(&stats, &m_drawnStats, sizeof(stats)) == 0)
+			return;
+		m_drawnStats = stats;
 		CHAR16 buffer[128];
-		UnicodeSPrint(buffer, sizeof(buffer), uToC16(u"Frametime: %Lu / %Lu (nom) us"), frametime, static_cast<UINTN>(1e6) / framerate);
+		// Fixed width, so that a shorter value fully overwrites the previous one
+		UnicodeSPrint(buffer, sizeof(buffer), uToC16(u"Frame: %5Lu %5Lu %5Lu us (min mean max), %5Lu missed"),
+			stats.minDelta * 1000000 / tscFrequency, stats.meanDelta * 1000000 / tscFrequency, stats.maxDelta * 1000000 / tscFrequency,
+			stats.missedCount
+		);
 		blit(14, 0, buffer);
 	}
 
-	UINTN getTscFrequency(void) {
-		auto begin = AsmReadTsc();
-		sleep(static_cast<UINTN>(1e6));
-		auto end = AsmReadTsc();
-		return end - begin;
-	}
-
 public:
-	inline Tetris(EFI_SIMPLE_TEXT_INPUT_PROTOCOL *input, EFI_SIMPLE_TEXT_OUTPUT_PROTOCOL *output);
+	inline Tetris(EFI_SIMPLE_TEXT_INPUT_PROTOCOL *input, UINT64 tscFrequency);
+
+	const tetris::Game& getGame(void) const {
+		return m_game;
+	}
 
-	void run(void) {
-		resetGame();
-		UINTN currentTick = 0;
+	// Renderer must provide `void begin(void)` and `void present(const Tetris::Framebuffer &framebuffer)`
+	// The solver plays instead of the keyboard when `solverExecutor` isn't nullptr, and so does `replay`, ESC still
+	// quits. When `recorder` isn't nullptr, the game is seeded from it and every tick input is recorded.
+	template <typename Renderer>
+	void run(Renderer &renderer, boot::MpExecutor *solverExecutor, tetris::InputReplay *replay, tetris::InputRecorder *recorder) {
+		if (replay != nullptr)
+			m_game.reset(replay->getSeed());
+		else if (recorder != nullptr)
+			m_game.reset(recorder->getSeed());
+		else
+			m_game.reset();
+		std::optional<tetris::AutoPlayer<boot::MpExecutor>> autoPlayer;
+		if (solverExecutor != nullptr)
+			autoPlayer.emplace(m_game, *solverExecutor);
 
 		resetFramebuffer();
-		m_output.clear();
-		auto tscFreq = getTscFrequency();
-		UINTN avgFrametime = 0;
-		UINTN frametimeAcc = 0;
-		UINTN frametimeCount = 0;
+		renderer.begin();
+		auto tscFreq = m_tscFrequency;
+		tetris::FramePacer pacer(tscFreq, framerate, AsmReadTsc());
+		tetris::FramePacer::Stats stats {};
 
 		bool isDone = false;
 		while (!isDone) {
-			auto beginTsc = AsmReadTsc();
+			waitUntil(pacer.getNextDeadline(), tscFreq);
 
-			UINTN keyCount = 0;
-			INTN x = 0, y = 0, rot = 0;
+			// Sampled right before simulating, as late as possible before the frame gets presented
+			tetris::TickInput keyInput;
 			while (auto key = m_input.readKey()) {
-				keyCount++;
 				if (key->ScanCode == SCAN_ESC) {
 					isDone = true;
 				}
 				if (key->ScanCode == SCAN_LEFT)
-					x--;
+					keyInput.x--;
 				if (key->ScanCode == SCAN_RIGHT)
-					x++;
+					keyInput.x++;
 				if (key->ScanCode == SCAN_DOWN)
-					y++;
+					keyInput.y++;
 				if (key->UnicodeChar == u'z' || key->UnicodeChar == u'Z')
-					rot--;
+					keyInput.rot--;
 				if (key->UnicodeChar == u'x' || key->UnicodeChar == u'X')
-					rot++;
+					keyInput.rot++;
 			}
 
-			processTick(currentTick, x, y, rot);
+			// A late frame catches up on the ticks it missed, the keys only apply to the first of them
+			auto tickCount = pacer.beginFrame(AsmReadTsc());
+			for (UINTN i = 0; i < tickCount; i++) {
+				auto input = i == 0 ? keyInput : tetris::TickInput();
+				if (autoPlayer)
+					input = autoPlayer->next(m_game.getTick());
+				if (replay != nullptr)
+					input = replay->next(m_game.getTick());
+				if (recorder != nullptr)
+					recorder->record(input);
+				m_game.tick(input);
+			}
 
-			resetFramebuffer();
+			static constexpr UINTN statsPeriod = framerate / 4;
+			if (pacer.getStatsFrameCount() >= statsPeriod)
+				stats = pacer.takeStats();
+
+			clearField();
 			drawField();
 			drawNext();
 			drawScore();
 			drawGameOver();
-			drawStats(avgFrametime);
+			drawStats(stats, tscFreq);
 
-			for (UINTN i = 0; i < framebufferHeight; i++) {
-				m_output.locate(0, i);
-				m_output.print(m_framebuffer[i]);
-			}
+			renderer.present(m_framebuffer);
+		}
+	}
+};
 
-			auto endTsc = AsmReadTsc();
-			auto tscDelta = endTsc - beginTsc;
+Tetris::Tetris(EFI_SIMPLE_TEXT_INPUT_PROTOCOL *input, UINT64 tscFrequency) :
+	m_input(input),
+	m_tscFrequency(tscFrequency),
+	m_game(AsmReadTsc())
+{
+}
 
-			INTN microsecondsDelta = static_cast<UINTN>(1e6) * tscDelta / tscFreq;
-			frametimeAcc += microsecondsDelta;
-			frametimeCount++;
+// Prints the frame through the firmware text console
+// The frame shown on screen is kept around: only runs of changed cells are sent, as each console call is slow.
+class TextRenderer
+{
+	// Unchanged gaps up to this length are printed again rather than splitting the run, as a `locate` costs about as much
+	static inline constexpr UINTN maxRunGap = 4;
+	// Never found in a frame, forces the first frame to be printed entirely
+	static inline constexpr CHAR16 invalidCell = 0xFFFF;
 
-			static constexpr UINTN frametimePeriod = framerate / 4;
-			if (frametimeCount > frametimePeriod) {
-				avgFrametime = frametimeAcc / frametimeCount;
-				frametimeAcc = 0;
-				frametimeCount = 0;
-			}
+	Output m_output;
+	Tetris::Framebuffer m_shown;
 
-			INTN toSleep = static_cast<UINTN>(1e6) / framerate - avgFrametime;
-			if (toSleep > 0)
-				sleep(toSleep);
-			currentTick++;
+public:
+	TextRenderer(EFI_SIMPLE_TEXT_OUTPUT_PROTOCOL *output) :
+		m_output(output)
+	{
+	}
+
+	void begin(void) {
+		m_output.clear();
+		SetMem16(m_shown, sizeof(m_shown), invalidCell);
+	}
+
+	void present(const Tetris::Framebuffer &framebuffer) {
+		for (UINTN i = 0; i < Tetris::framebufferHeight; i++) {
+			auto &row = framebuffer[i];
+			auto &shownRow = m_shown[i];
+			for (UINTN j = 0; j < Tetris::framebufferWidth - 1;) {
+				if (row[j] == shownRow[j]) {
+					j++;
+					continue;
+				}
+
+				// Extend the run until more than `maxRunGap` unchanged cells follow
+				auto runBegin = j;
+				auto runEnd = j + 1;
+				for (auto k = runEnd; k < Tetris::framebufferWidth - 1 && k <= runEnd + maxRunGap; k++)
+					if (row[k] != shownRow[k])
+						runEnd = k + 1;
+
+				CHAR16 run[Tetris::framebufferWidth];
+				CopyMem(run, &row[runBegin], (runEnd - runBegin) * sizeof(CHAR16));
+				run[runEnd - runBegin] = u'\0';
+				CopyMem(&shownRow[runBegin], run, (runEnd - runBegin) * sizeof(CHAR16));
+
+				m_output.locate(runBegin, i);
+				m_output.print(uToC16(u"%s"), run);
+				j = runEnd;
+			}
 		}
 	}
 };
 
-Tetris::Tetris(EFI_SIMPLE_TEXT_INPUT_PROTOCOL *input, EFI_SIMPLE_TEXT_OUTPUT_PROTOCOL *output) :
-	m_input(input),
-	m_output(output),
-	m_pieces{
-		Piece::build<1>(u'@', {
-			{
-				{false, true, true, false},
-				{false, true, true, false},
-				{false, false, false, false},
-				{false, false, false, false}
-			}
-		}),
-		Piece::build<2>(u'H', {
-			{
-				{false, false, false, false},
-				{true, true, true, true},
-				{false, false, false, false},
-				{false, false, false, false}
-			},
-			{
-				{false, true, false, false},
-				{false, true, false, false},
-				{false, true, false, false},
-				{false, true, false, false}
-			}
-		}),
-		Piece::build<2>(u'W', {
-			{
-				{false, true, true, false},
-				{true, true, false, false},
-				{false, false, false, false},
-				{false, false, false, false}
-			},
-			{
-				{false, true, false, false},
-				{false, true, true, false},
-				{false, false, true, false},
-				{false, false, false, false}
-			}
-		}),
-		Piece::build<2>(u'Z', {
-			{
-				{false, true, true, false},
-				{false, false, true, true},
-				{false, false, false, false},
-				{false, false, false, false}
-			},
-			{
-				{false, false, true, false},
-				{false, true, true, false},
-				{false, true, false, false},
-				{false, false, false, false}
-			}
-		}),
-		Piece::build<4>(u'L', {
-			{
-				{false, true, true, true},
-				{false, false, false, true},
-				{false, false, false, false},
-				{false, false, false, false}
-			},
-			{
-				{false, false, true, false},
-				{false, false, true, false},
-				{false, true, true, false},
-				{false, false, false, false}
-			},
-			{
-				{false, true, false, false},
-				{false, true, true, true},
-				{false, false, false, false},
-				{false, false, false, false}
-			},
-			{
-				{false, true, true, false},
-				{false, true, false, false},
-				{false, true, false, false},
-				{false, false, false, false}
-			}
-		}),
-		Piece::build<4>(u'T', {
-			{
-				{true, true, true, false},
-				{true, false, false, false},
-				{false, false, false, false},
-				{false, false, false, false}
-			},
-			{
-				{false, true, true, false},
-				{false, false, true, false},
-				{false, false, true, false},
-				{false, false, false, false}
-			},
-			{
-				{false, false, true, false},
-				{true, true, true, false},
-				{false, false, false, false},
-				{false, false, false, false}
-			},
-			{
-				{false, true, false, false},
-				{false, true, false, false},
-				{false, true, true, false},
-				{false, false, false, false}
+// Draws the frame into a `bare::GraphicsOutput` backbuffer: blocks as colored cells, everything else with the bare font
+// Only the cells that changed since the last frame are drawn, so that `present` only copies a few small rectangles.
+class GraphicsRenderer
+{
+	struct BlockColor {
+		CHAR16 display;
+		UINT8 r, g, b;
+	};
+
+	static inline constexpr BlockColor blockColors[] {
+		{ u'@', 0xF0, 0xD0, 0x20 },
+		{ u'H', 0x20, 0xD0, 0xF0 },
+		{ u'W', 0x40, 0xD0, 0x40 },
+		{ u'Z', 0xE0, 0x30, 0x30 },
+		{ u'L', 0xF0, 0x90, 0x20 },
+		{ u'T', 0x30, 0x50, 0xE0 },
+		{ u'X', 0xA0, 0x40, 0xE0 },
+		{ u'#', 0x60, 0x60, 0x60 },
+		{ u'-', 0xF0, 0xF0, 0xF0 }
+	};
+	static inline constexpr UINTN blockColorCount = sizeof(blockColors) / sizeof(blockColors[0]);
+	// Never found in a frame, forces the first frame to be drawn entirely
+	static inline constexpr CHAR16 invalidCell = 0xFFFF;
+
+	bare::GraphicsOutputBase &m_graphicsOutput;
+	UINTN m_scale;
+	UINTN m_cellWidth;
+	UINTN m_cellHeight;
+	UINTN m_originX;
+	UINTN m_originY;
+	UINT32 m_background;
+	UINT32 m_foreground;
+	UINT32 m_blockPixels[blockColorCount];
+	Tetris::Framebuffer m_shown;
+	UINT64 m_presentedByteCount = 0;
+	UINTN m_presentCount = 0;
+
+	void drawCell(UINTN x, UINTN y, CHAR16 c) {
+		auto left = m_originX + x * m_cellWidth;
+		auto top = m_originY + y * m_cellHeight;
+		if (Tetris::isBlockCell(x, y)) {
+			for (UINTN i = 0; i < blockColorCount; i++) {
+				if (blockColors[i].display != c)
+					continue;
+				m_graphicsOutput.fillRect(left, top, m_cellWidth, m_cellHeight, m_background);
+				m_graphicsOutput.fillRect(left + m_scale, top + m_scale, m_cellWidth - 2 * m_scale, m_cellHeight - 2 * m_scale, m_blockPixels[i]);
+				return;
 			}
+		}
+		bare::font::drawChar(m_graphicsOutput, left, top, m_scale, c == u'\0' ? u' ' : c, m_foreground, m_background);
+	}
 
-		}),
-		Piece::build<4>(u'X', {
-			{
-				{false, false, false, false},
-				{true, true, true, false},
-				{false, true, false, false},
-				{false, false, false, false}
-			},
-			{
-				{false, true, false, false},
-				{true, true, false, false},
-				{false, true, false, false},
-				{false, false, false, false}
-			},
-			{
-				{false, true, false, false},
-				{true, true, true, false},
-				{false, false, false, false},
-				{false, false, false, false}
-			},
-			{
-				{false, true, false, false},
-				{false, true, true, false},
-				{false, true, false, false},
-				{false, false, false, false}
+public:
+	GraphicsRenderer(bare::AnyGraphicsOutput &anyGraphicsOutput) :
+		m_graphicsOutput(anyGraphicsOutput.getBase())
+	{
+		// Largest integer scale fitting the whole text grid, centered on screen
+		auto scaleX = m_graphicsOutput.getWidth() / (Tetris::framebufferWidth * bare::font::cellWidth);
+		auto scaleY = m_graphicsOutput.getHeight() / (Tetris::framebufferHeight * bare::font::cellHeight);
+		m_scale = scaleX < scaleY ? scaleX : scaleY;
+		if (m_scale == 0)
+			m_scale = 1;
+		m_cellWidth = bare::font::cellWidth * m_scale;
+		m_cellHeight = bare::font::cellHeight * m_scale;
+		auto gridWidth = Tetris::framebufferWidth * m_cellWidth;
+		auto gridHeight = Tetris::framebufferHeight * m_cellHeight;
+		m_originX = gridWidth < m_graphicsOutput.getWidth() ? (m_graphicsOutput.getWidth() - gridWidth) / 2 : 0;
+		m_originY = gridHeight < m_graphicsOutput.getHeight() ? (m_graphicsOutput.getHeight() - gridHeight) / 2 : 0;
+
+		anyGraphicsOutput.visit([this](auto &graphicsOutput) {
+			m_background = graphicsOutput.packPixel(0x10, 0x10, 0x18);
+			m_foreground = graphicsOutput.packPixel(0xE0, 0xE0, 0xE0);
+			for (UINTN i = 0; i < blockColorCount; i++)
+				m_blockPixels[i] = graphicsOutput.packPixel(blockColors[i].r, blockColors[i].g, blockColors[i].b);
+		});
+	}
+
+	void begin(void) {
+		m_graphicsOutput.fillRect(0, 0, m_graphicsOutput.getWidth(), m_graphicsOutput.getHeight(), m_background);
+		SetMem16(m_shown, sizeof(m_shown), invalidCell);
+		m_graphicsOutput.present();
+	}
+
+	void present(const Tetris::Framebuffer &framebuffer) {
+		for (UINTN i = 0; i < Tetris::framebufferHeight; i++)
+			for (UINTN j = 0; j < Tetris::framebufferWidth - 1; j++) {
+				if (framebuffer[i][j] == m_shown[i][j])
+					continue;
+				drawCell(j, i, framebuffer[i][j]);
+				m_shown[i][j] = framebuffer[i][j];
 			}
-		})
+		m_graphicsOutput.present();
+		m_presentedByteCount += m_graphicsOutput.getPresentedByteCount();
+		m_presentCount++;
 	}
-{
-}
+
+	// Bytes copied onto the display by frames presented so far, the first full one of `begin` left out
+	UINT64 getPresentedBytesPerFrame(void) const {
+		return m_presentCount > 0 ? m_presentedByteCount / m_presentCount : 0;
+	}
+
+	UINTN getFullFrameByteCount(void) const {
+		return m_graphicsOutput.getDisplayFramebufferSize();
+	}
+};
 
 /**
 	as the real entry point for the application.
@@ -701,8 +511,97 @@ EFI_STATUS EFIAPI UefiMain(IN EFI_HANDLE ImageHandle, IN EFI_SYSTEM_TABLE *Syste
 {
 	efiAssert(ShellInitialize());
 
-	auto tetris = Tetris(SystemTable->ConIn, SystemTable->ConOut);
-	tetris.run();
+	auto input = Input(SystemTable->ConIn);
+	auto tscCalibration = boot::TscCalibrator::calibrate();
+	auto tscFrequency = tscCalibration.frequency;
+	tscCalibration.print();
+	auto mpExecutor = boot::MpExecutor(boot::MpServices::query());
+	Print(uToC16(u"Press A to let the solver play, B to benchmark it, any other key to play yourself..\n"));
+	Print(uToC16(u"Press R to replay the last recorded game, F to fast-forward through it without rendering..\n"));
+	auto mode = input.waitKey().UnicodeChar;
+	if (mode == u'b' || mode == u'B') {
+		static constexpr UINTN benchmarkPieceCount = 200;
+		Print(uToC16(u"Solving %Lu pieces on 1 to %Lu cores..\n"), benchmarkPieceCount, mpExecutor.getWorkerCount());
+		UINT64 singleCoreNodesPerSecond = 0;
+		tetris::benchmarkSolver(mpExecutor, AsmReadTsc, 1, benchmarkPieceCount, [&](UINTN workerCount, UINT64 nodeCount, UINT64 cycles, UINTN score) {
+			auto nodesPerSecond = nodeCount * tscFrequency / cycles;
+			if (workerCount == 1)
+				singleCoreNodesPerSecond = nodesPerSecond;
+			Print(uToC16(u"%Lu core(s): %Lu nodes/s, speedup x%Lu.%02Lu (score %Lu)\n"), workerCount, nodesPerSecond,
+				nodesPerSecond / singleCoreNodesPerSecond, nodesPerSecond * 100 / singleCoreNodesPerSecond % 100, score
+			);
+		});
+		return EFI_SUCCESS;
+	}
+	auto solverExecutor = mode == u'a' || mode == u'A' ? &mpExecutor : nullptr;
+
+	// Games are recorded to the volume tetris was loaded from, a few bytes per change of input
+	static constexpr auto replayPath = u"\\tetris.rpl";
+	static constexpr UINTN replayBufferSize = 1 << 20;
+	EFI_PHYSICAL_ADDRESS replayBuffer;
+	efiAssert(gBS->AllocatePages(AllocateAnyPages, EfiLoaderData, EFI_SIZE_TO_PAGES(replayBufferSize), &replayBuffer));
+	std::optional<tetris::InputReplay> replay;
+	std::optional<tetris::InputRecorder> recorder;
+	if (mode == u'r' || mode == u'R' || mode == u'f' || mode == u'F') {
+		UINTN replaySize = replayBufferSize;
+		auto res = boot::readVolumeFile(uToC16(replayPath), reinterpret_cast<void*>(replayBuffer), replaySize);
+		if (res != EFI_SUCCESS) {
+			if (res == EFI_NOT_FOUND)
+				Print(uToC16(u"No recorded game found\n"));
+			else
+				Print(uToC16(u"No recording: %s could not be read (%r)\n"), uToC16(replayPath), res);
+			return EFI_SUCCESS;
+		}
+		replay.emplace(reinterpret_cast<const void*>(replayBuffer), replaySize);
+		if (!replay->isValid()) {
+			Print(uToC16(u"The recorded game is corrupted or from another version\n"));
+			return EFI_SUCCESS;
+		}
+	} else {
+		recorder.emplace(reinterpret_cast<void*>(replayBuffer), replayBufferSize, AsmReadTsc());
+	}
+
+	// Uncapped playback, a deterministic performance test of the whole simulation
+	if (mode == u'f' || mode == u'F') {
+		Print(uToC16(u"Fast-forwarding through %Lu ticks..\n"), replay->getTickCount());
+		tetris::Game game(replay->getSeed());
+		auto begin = AsmReadTsc();
+		game.run(*replay, replay->getTickCount());
+		auto cycles = AsmReadTsc() - begin;
+		Print(uToC16(u"%Lu ticks in %Lu us: %Lu ticks/s, %Lu ns/tick\n"), game.getTick(), cycles * 1000000 / tscFrequency,
+			cycles > 0 ? game.getTick() * tscFrequency / cycles : 0, game.getTick() > 0 ? cycles * 1000000000 / tscFrequency / game.getTick() : 0
+		);
+		Print(uToC16(u"Score %Lu, recorded score %Lu\n"), game.getScore(), replay->getScore());
+		return EFI_SUCCESS;
+	}
+
+	Print(uToC16(u"Press G to render through the graphics output, any other key to render through the text console..\n"));
+	auto key = input.waitKey();
+
+	auto tetris = Tetris(SystemTable->ConIn, tscFrequency);
+	if (key.UnicodeChar == u'g' || key.UnicodeChar == u'G') {
+		static constexpr UINTN backbufferSize = 1 << 24;
+		EFI_PHYSICAL_ADDRESS backbuffer;
+		efiAssert(gBS->AllocatePages(AllocateAnyPages, EfiLoaderData, EFI_SIZE_TO_PAGES(backbufferSize), &backbuffer));
+		auto anyGraphicsOutput = boot::GraphicsOutputProtocol::query().toBareGraphics(backbufferSize, reinterpret_cast<void*>(backbuffer));
+		auto renderer = GraphicsRenderer(anyGraphicsOutput);
+		tetris.run(renderer, solverExecutor, replay ? &*replay : nullptr, recorder ? &*recorder : nullptr);
+		Print(uToC16(u"%,Lu bytes presented per frame on average, out of %,Lu for a full frame\n"),
+			renderer.getPresentedBytesPerFrame(), renderer.getFullFrameByteCount()
+		);
+	} else {
+		auto renderer = TextRenderer(SystemTable->ConOut);
+		tetris.run(renderer, solverExecutor, replay ? &*replay : nullptr, recorder ? &*recorder : nullptr);
+	}
+
+	if (recorder) {
+		auto size = recorder->finish(tetris.getGame().getScore());
+		auto res = boot::writeVolumeFile(uToC16(replayPath), reinterpret_cast<const void*>(replayBuffer), size);
+		if (res == EFI_SUCCESS)
+			Print(uToC16(u"Game recorded to %s (%Lu bytes)\n"), uToC16(replayPath), size);
+		else
+			Print(uToC16(u"Recording not saved: %s could not be written (%r)\n"), uToC16(replayPath), res);
+	}
 
 	return EFI_SUCCESS;
 }
\ No newline at end of file
@@ -0,0 +1,101 @@
+#pragma once
+
+#include "core.hpp"
+
+namespace tetris {
+
+// Fixed timestep scheduling on absolute deadlines of a free-running counter, the TSC on target
+// Tick k is due at `origin + k * frequency / tickRate`: deadlines never depend on how long previous frames took, so
+// that neither rounding nor late frames accumulate into drift. A late frame simulates every tick it missed instead.
+class FramePacer
+{
+public:
+	// Beyond that many ticks in a single frame (debugger, firmware hiccup), the backlog is dropped and the schedule
+	// restarts from the current frame, rather than fast-forwarding the game
+	static inline constexpr UINTN maxCatchUpTicks = 8;
+
+	// Frame deltas are in counter units, between the beginnings of consecutive frames
+	struct Stats {
+		UINT64 minDelta;
+		UINT64 meanDelta;
+		UINT64 maxDelta;
+		// Deadlines that passed while the previous frame was still running, since the pacer was created
+		UINTN missedCount;
+	};
+
+private:
+	UINT64 m_frequency;
+	UINT64 m_tickRate;
+	UINT64 m_origin;
+	UINT64 m_nextTick = 0;
+
+	UINT64 m_lastFrameBegin = 0;
+	UINT64 m_minDelta = ~static_cast<UINT64>(0);
+	UINT64 m_maxDelta = 0;
+	UINT64 m_deltaSum = 0;
+	UINTN m_deltaCount = 0;
+	UINTN m_missedCount = 0;
+
+	UINT64 getDeadline(UINT64 tick) const {
+		return m_origin + tick * m_frequency / m_tickRate;
+	}
+
+public:
+	// `frequency` is the counter frequency, the first tick is due at `now`
+	FramePacer(UINT64 frequency, UINT64 tickRate, UINT64 now) :
+		m_frequency(frequency),
+		m_tickRate(tickRate),
+		m_origin(now)
+	{
+	}
+
+	// Wait until then before calling `beginFrame`
+	UINT64 getNextDeadline(void) const {
+		return getDeadline(m_nextTick);
+	}
+
+	// Returns the number of ticks to simulate in this frame, at least one
+	UINTN beginFrame(UINT64 now) {
+		auto dueTick = now < m_origin ? 0 : (now - m_origin) * m_tickRate / m_frequency + 1;
+		UINTN count = dueTick > m_nextTick ? dueTick - m_nextTick : 1;
+		m_missedCount += count - 1;
+		if (count > maxCatchUpTicks) {
+			count = maxCatchUpTicks;
+			// The last tick of this frame becomes due right now
+			m_origin = now - (m_nextTick + count - 1) * m_frequency / m_tickRate;
+		}
+		m_nextTick += count;
+
+		if (m_lastFrameBegin != 0) {
+			auto delta = now - m_lastFrameBegin;
+			m_minDelta = delta < m_minDelta ? delta : m_minDelta;
+			m_maxDelta = delta > m_maxDelta ? delta : m_maxDelta;
+			m_deltaSum += delta;
+			m_deltaCount++;
+		}
+		m_lastFrameBegin = now;
+		return count;
+	}
+
+	// Frames measured since the last call, if any
+	UINTN getStatsFrameCount(void) const {
+		return m_deltaCount;
+	}
+
+	// Stats of the frames since the last call, then starts measuring again
+	Stats takeStats(void) {
+		Stats res {
+			.minDelta = m_deltaCount > 0 ? m_minDelta : 0,
+			.meanDelta = m_deltaCount > 0 ? m_deltaSum / m_deltaCount : 0,
+			.maxDelta = m_maxDelta,
+			.missedCount = m_missedCount
+		};
+		m_minDelta = ~static_cast<UINT64>(0);
+		m_maxDelta = 0;
+		m_deltaSum = 0;
+		m_deltaCount = 0;
+		return res;
+	}
+};
+
+}
\ No newline at end of file
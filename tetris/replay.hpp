@@ -0,0 +1,152 @@
+#pragma once
+
+#include "core.hpp"
+
+namespace tetris {
+
+// A recording is this header followed by runs of identical tick inputs
+// Each run takes `replayRunSize` bytes: x, y and rot as INT8, then the number of ticks of the run minus one.
+struct ReplayHeader
+{
+	UINT32 magic;
+	UINT32 version;
+	UINT64 seed;
+	UINT64 tickCount;
+	// Score at the end of the recording, replays must reach it again
+	UINT64 score;
+};
+
+static inline constexpr UINT32 replayMagic = 0x4C505254;	// "TRPL"
+static inline constexpr UINT32 replayVersion = 1;
+static inline constexpr UINTN replayRunSize = 4;
+static inline constexpr UINTN replayMaxRunLength = 256;
+
+// Records the input of every tick into a caller-provided buffer
+// A game seeded with the same seed and fed back these inputs plays exactly the same, see `Game::reset(UINT64)`.
+class InputRecorder
+{
+	UINT8 *m_buffer;
+	UINTN m_capacity;
+	UINTN m_size;
+	ReplayHeader m_header;
+	INT8 m_run[3];
+	UINTN m_runLength = 0;
+	bool m_isFull = false;
+
+	static INT8 clampInput(INTN value) {
+		return static_cast<INT8>(value < -128 ? -128 : value > 127 ? 127 : value);
+	}
+
+	bool flushRun(void) {
+		if (m_runLength == 0)
+			return true;
+		if (m_size + replayRunSize > m_capacity)
+			return false;
+		CopyMem(&m_buffer[m_size], m_run, sizeof(m_run));
+		m_buffer[m_size + 3] = static_cast<UINT8>(m_runLength - 1);
+		m_size += replayRunSize;
+		m_runLength = 0;
+		return true;
+	}
+
+public:
+	// `capacity` must at least fit a `ReplayHeader`
+	InputRecorder(void *buffer, UINTN capacity, UINT64 seed) :
+		m_buffer(reinterpret_cast<UINT8*>(buffer)),
+		m_capacity(capacity),
+		m_size(sizeof(ReplayHeader)),
+		m_header { replayMagic, replayVersion, seed, 0, 0 }
+	{
+	}
+
+	UINT64 getSeed(void) const {
+		return m_header.seed;
+	}
+
+	// Returns false once the buffer is full, the ticks after that are not recorded
+	bool record(const TickInput &input) {
+		if (m_isFull)
+			return false;
+		INT8 run[3] { clampInput(input.x), clampInput(input.y), clampInput(input.rot) };
+		if (m_runLength == replayMaxRunLength || (m_runLength > 0 && CompareMem(run, m_run, sizeof(run)) != 0)) {
+			if (!flushRun()) {
+				m_isFull = true;
+				return false;
+			}
+		}
+		CopyMem(m_run, run, sizeof(run));
+		m_runLength++;
+		m_header.tickCount++;
+		return true;
+	}
+
+	// Writes the last run and the header, returns the size of the recording in the buffer
+	UINTN finish(UINTN score) {
+		// Without room for the last run, its ticks are dropped from the recording
+		if (!flushRun())
+			m_header.tickCount -= m_runLength;
+		m_header.score = score;
+		CopyMem(m_buffer, &m_header, sizeof(m_header));
+		return m_size;
+	}
+};
+
+// Input source playing a recording back, then idling
+class InputReplay
+{
+	const UINT8 *m_runs;
+	UINTN m_runCount;
+	ReplayHeader m_header;
+	// Sum of the run lengths, which `tickCount` may not exceed
+	UINT64 m_runTickCount = 0;
+	UINTN m_nextRun = 0;
+	UINTN m_runTicksLeft = 0;
+	TickInput m_input;
+
+public:
+	InputReplay(const void *data, UINTN size) :
+		m_runs(reinterpret_cast<const UINT8*>(data) + sizeof(ReplayHeader)),
+		m_runCount(size >= sizeof(ReplayHeader) ? (size - sizeof(ReplayHeader)) / replayRunSize : 0),
+		m_header {}
+	{
+		if (size >= sizeof(ReplayHeader))
+			CopyMem(&m_header, data, sizeof(m_header));
+		for (UINTN i = 0; i < m_runCount; i++)
+			m_runTickCount += m_runs[i * replayRunSize + 3] + 1;
+	}
+
+	// False when the data isn't a recording of this version, or its tick count is 0 or more than its runs hold
+	bool isValid(void) const {
+		return m_header.magic == replayMagic && m_header.version == replayVersion && m_header.tickCount > 0 && m_header.tickCount <= m_runTickCount;
+	}
+
+	UINT64 getSeed(void) const {
+		return m_header.seed;
+	}
+
+	UINT64 getTickCount(void) const {
+		return m_header.tickCount;
+	}
+
+	UINT64 getScore(void) const {
+		return m_header.score;
+	}
+
+	// Ticks are played in order, the argument only matches the interface of other input sources
+	TickInput next(UINTN) {
+		if (m_runTicksLeft == 0) {
+			if (m_nextRun == m_runCount)
+				return TickInput();
+			auto run = &m_runs[m_nextRun * replayRunSize];
+			m_input.x = static_cast<INT8>(run[0]);
+			m_input.y = static_cast<INT8>(run[1]);
+			m_input.rot = static_cast<INT8>(run[2]);
+			m_runTicksLeft = run[3] + 1;
+			m_nextRun++;
+		}
+		m_runTicksLeft--;
+		return m_input;
+	}
+};
+
+}
\ No newline at end of file
@@ -10,6 +10,8 @@ extern "C" {
 
 }
 
+#include "raster.hpp"
+
 #define bareEfiAssert(code) { auto runtimeEfiAssert__res = code; if (runtimeEfiAssert__res != EFI_SUCCESS) { bare::fatalError(); } }
 
 namespace bare {
@@ -20,40 +22,502 @@ namespace bare {
 	}
 }
 
-[[maybe_unused]] static void sleep(UINTN tscFrequency, UINTN microseconds) {
-	auto begin = AsmReadTsc();
+// Monotonic time read from the TSC, deadlines are absolute TSC values
+// Conversions only multiply by factors computed once in 32.32 fixed point, no division nor floating point per call.
+class Clock
+{
+	UINT64 m_tscFrequency;
+	UINT64 m_cyclesPerMicrosecond;
+	UINT64 m_microsecondsPerCycle;
 
-	auto tscFullSleepDelay = microseconds * tscFrequency / 1e6;
+	static UINT64 multiplyFixed(UINT64 value, UINT64 factor) {
+		// A single `mul`, the product only overflows after centuries of cycles
+		return static_cast<UINT64>((static_cast<unsigned __int128>(value) * factor) >> 32);
+	}
 
-	while (true) {
-		auto cur = AsmReadTsc();
-		if (cur - begin > tscFullSleepDelay)
-			break;
+	// (numerator << 32) / denominator, without overflowing for numerators up to 2^64 / 1e6
+	static UINT64 divideFixed(UINT64 numerator, UINT64 denominator) {
+		return ((numerator / denominator) << 32) + ((numerator % denominator) << 32) / denominator;
+	}
+
+public:
+	Clock(UINT64 tscFrequency) :
+		m_tscFrequency(tscFrequency),
+		m_cyclesPerMicrosecond(divideFixed(tscFrequency, 1000000)),
+		m_microsecondsPerCycle(divideFixed(1000000, tscFrequency))
+	{
+	}
+
+	UINT64 getTscFrequency(void) const {
+		return m_tscFrequency;
+	}
+
+	UINT64 now(void) const {
+		return AsmReadTsc();
+	}
+
+	UINT64 toCycles(UINT64 microseconds) const {
+		return multiplyFixed(microseconds, m_cyclesPerMicrosecond);
+	}
+
+	UINT64 toMicroseconds(UINT64 cycles) const {
+		return multiplyFixed(cycles, m_microsecondsPerCycle);
+	}
+
+	UINT64 getDeadlineIn(UINT64 microseconds) const {
+		return now() + toCycles(microseconds);
+	}
+
+	bool hasPassed(UINT64 deadline) const {
+		return now() >= deadline;
+	}
+
+	// Busy waits at full power, see `DeadlineTimer` for low-power waits
+	void spinUntil(UINT64 deadline) const {
+		while (!hasPassed(deadline))
+			CpuPause();
+	}
+
+	void spin(UINT64 microseconds) const {
+		spinUntil(getDeadlineIn(microseconds));
+	}
+};
+
+// Test and test-and-set lock, for the slow paths shared between CPUs
+class SpinLock
+{
+	bool m_isLocked = false;
+
+public:
+	void lock(void) {
+		while (__atomic_exchange_n(&m_isLocked, true, __ATOMIC_ACQUIRE))
+			while (__atomic_load_n(&m_isLocked, __ATOMIC_RELAXED))
+				CpuPause();
+	}
+
+	void unlock(void) {
+		__atomic_store_n(&m_isLocked, false, __ATOMIC_RELEASE);
+	}
+};
+
+// Carves memory out of a range, nothing is ever freed
+class BumpAllocator
+{
+	UINTN m_current;
+	UINTN m_end;
+
+public:
+	BumpAllocator(UINTN base, UINTN size) :
+		m_current(base),
+		m_end(base + size)
+	{
+	}
+
+	// `alignment` must be a power of two
+	void* allocate(UINTN size, UINTN alignment) {
+		auto aligned = (m_current + alignment - 1) & ~(alignment - 1);
+		if (aligned < m_current || size > m_end - aligned)
+			fatalError();
+		m_current = aligned + size;
+		return reinterpret_cast<void*>(aligned);
+	}
+
+	template <typename T>
+	T* allocateArray(UINTN count) {
+		return reinterpret_cast<T*>(allocate(count * sizeof(T), alignof(T)));
+	}
+
+	UINTN getRemainingSize(void) const {
+		return m_end - m_current;
+	}
+};
+
+// Framebuffer copy strategies used by `GraphicsOutput::present`
+// The display framebuffer is usually mapped write-combining or uncached, so that the fastest strategy
+// depends a lot on the platform: `PresentBackend::calibrate` times each of them against the real thing.
+namespace present {
+
+static void copyMem(void *dst, const void *src, UINTN size) {
+	CopyMem(dst, src, size);
+}
+
+static void repMovsb(void *dst, const void *src, UINTN size) {
+	asm volatile("rep movsb" : "+D"(dst), "+S"(src), "+c"(size) : : "memory");
+}
+
+__attribute__((target("sse2"))) static void streamSse2(void *dst, const void *src, UINTN size) {
+	auto d = reinterpret_cast<UINT8*>(dst);
+	auto s = reinterpret_cast<const UINT8*>(src);
+
+	UINTN head = (16 - (reinterpret_cast<UINTN>(d) & 0xF)) & 0xF;
+	if (head > size)
+		head = size;
+	repMovsb(d, s, head);
+	d += head;
+	s += head;
+	size -= head;
+
+	for (; size >= 64; size -= 64, d += 64, s += 64) {
+		auto a = _mm_loadu_si128(reinterpret_cast<const __m128i*>(s));
+		auto b = _mm_loadu_si128(reinterpret_cast<const __m128i*>(s + 16));
+		auto c = _mm_loadu_si128(reinterpret_cast<const __m128i*>(s + 32));
+		auto e = _mm_loadu_si128(reinterpret_cast<const __m128i*>(s + 48));
+		_mm_stream_si128(reinterpret_cast<__m128i*>(d), a);
+		_mm_stream_si128(reinterpret_cast<__m128i*>(d + 16), b);
+		_mm_stream_si128(reinterpret_cast<__m128i*>(d + 32), c);
+		_mm_stream_si128(reinterpret_cast<__m128i*>(d + 48), e);
+	}
+	for (; size >= 16; size -= 16, d += 16, s += 16)
+		_mm_stream_si128(reinterpret_cast<__m128i*>(d), _mm_loadu_si128(reinterpret_cast<const __m128i*>(s)));
+	// Streaming stores are weakly ordered, make them globally visible before anything else
+	_mm_sfence();
+	repMovsb(d, s, size);
+}
+
+__attribute__((target("avx2"))) static void streamAvx2(void *dst, const void *src, UINTN size) {
+	auto d = reinterpret_cast<UINT8*>(dst);
+	auto s = reinterpret_cast<const UINT8*>(src);
+
+	UINTN head = (32 - (reinterpret_cast<UINTN>(d) & 0x1F)) & 0x1F;
+	if (head > size)
+		head = size;
+	repMovsb(d, s, head);
+	d += head;
+	s += head;
+	size -= head;
+
+	for (; size >= 128; size -= 128, d += 128, s += 128) {
+		auto a = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(s));
+		auto b = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(s + 32));
+		auto c = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(s + 64));
+		auto e = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(s + 96));
+		_mm256_stream_si256(reinterpret_cast<__m256i*>(d), a);
+		_mm256_stream_si256(reinterpret_cast<__m256i*>(d + 32), b);
+		_mm256_stream_si256(reinterpret_cast<__m256i*>(d + 64), c);
+		_mm256_stream_si256(reinterpret_cast<__m256i*>(d + 96), e);
+	}
+	for (; size >= 32; size -= 32, d += 32, s += 32)
+		_mm256_stream_si256(reinterpret_cast<__m256i*>(d), _mm256_loadu_si256(reinterpret_cast<const __m256i*>(s)));
+	_mm_sfence();
+	repMovsb(d, s, size);
+}
+
+struct Strategy
+{
+	const char16_t *name;
+	void (*copy)(void *dst, const void *src, UINTN size);
+	bool (*isSupported)(const CpuFeatures &features);
+};
+
+static inline constexpr Strategy strategies[] {
+	{
+		.name = u"CopyMem",
+		.copy = copyMem,
+		.isSupported = [](const CpuFeatures&) { return true; }
+	},
+	{
+		.name = u"rep movsb (ERMS)",
+		.copy = repMovsb,
+		.isSupported = [](const CpuFeatures &features) { return features.erms; }
+	},
+	{
+		.name = u"SSE2 non-temporal",
+		.copy = streamSse2,
+		.isSupported = [](const CpuFeatures &features) { return features.sse2; }
+	},
+	{
+		.name = u"AVX2 non-temporal",
+		.copy = streamAvx2,
+		.isSupported = [](const CpuFeatures &features) { return features.avx2; }
+	}
+};
+
+static inline constexpr UINTN strategyCount = sizeof(strategies) / sizeof(strategies[0]);
+
+}
+
+class PresentBackend
+{
+	const present::Strategy *m_strategy = &present::strategies[0];
+	// Measured bandwidth of each strategy in MB/s, zero when unsupported or not calibrated yet
+	UINTN m_bandwidths[present::strategyCount] {};
+
+public:
+	void copy(void *dst, const void *src, UINTN size) const {
+		m_strategy->copy(dst, src, size);
+	}
+
+	// Times every supported strategy copying `size` bytes from `src` to `dst`, then keeps the fastest one
+	// Each strategy gets a warmup copy, then the best of a few runs is kept to filter out SMIs and the like.
+	void calibrate(const CpuFeatures &features, void *dst, const void *src, UINTN size, UINTN tscFrequency) {
+		static constexpr UINTN runCount = 4;
+
+		UINTN bestBandwidth = 0;
+		for (UINTN i = 0; i < present::strategyCount; i++) {
+			auto &strategy = present::strategies[i];
+			m_bandwidths[i] = 0;
+			if (!strategy.isSupported(features))
+				continue;
+
+			strategy.copy(dst, src, size);
+			UINT64 bestCycles = MAX_UINT64;
+			for (UINTN j = 0; j < runCount; j++) {
+				auto begin = AsmReadTsc();
+				strategy.copy(dst, src, size);
+				auto cycles = AsmReadTsc() - begin;
+				if (cycles < bestCycles)
+					bestCycles = cycles;
+			}
+			if (bestCycles == 0)
+				bestCycles = 1;
+
+			m_bandwidths[i] = size * tscFrequency / bestCycles / 1000000;
+			if (m_bandwidths[i] > bestBandwidth) {
+				bestBandwidth = m_bandwidths[i];
+				m_strategy = &strategy;
+			}
+		}
+	}
+
+	const CHAR16* getStrategyName(void) const {
+		return reinterpret_cast<const CHAR16*>(m_strategy->name);
+	}
+
+	// In MB/s, as measured by `calibrate`
+	UINTN getBandwidth(void) const {
+		return m_bandwidths[m_strategy - present::strategies];
+	}
+
+	// Fn is a `void (const CHAR16 *strategyName, UINTN bandwidth)`, called for every calibrated strategy
+	template <typename Fn>
+	void iterateBandwidths(Fn &&fn) const {
+		for (UINTN i = 0; i < present::strategyCount; i++)
+			if (m_bandwidths[i] != 0)
+				fn(reinterpret_cast<const CHAR16*>(present::strategies[i].name), m_bandwidths[i]);
+	}
+};
+
+// Half-open pixel rectangle [left, right) x [top, bottom)
+struct Rect
+{
+	UINTN left, top, right, bottom;
+
+	UINTN getArea(void) const {
+		return (right - left) * (bottom - top);
+	}
+
+	Rect getUnion(const Rect &other) const {
+		return Rect {
+			.left = left < other.left ? left : other.left,
+			.top = top < other.top ? top : other.top,
+			.right = right > other.right ? right : other.right,
+			.bottom = bottom > other.bottom ? bottom : other.bottom
+		};
+	}
+};
+
+// Small set of rectangles covering every damaged pixel since the last `clear`
+// Rectangles are merged eagerly whenever their union doesn't cover more pixels than both of them do,
+// and forcibly with the cheapest candidate once the list is full.
+class DamageList
+{
+public:
+	static inline constexpr UINTN maxRectCount = 16;
+
+private:
+	Rect m_rects[maxRectCount];
+	UINTN m_rectCount = 0;
+
+	void remove(UINTN index) {
+		m_rects[index] = m_rects[m_rectCount - 1];
+		m_rectCount--;
+	}
+
+public:
+	UINTN getRectCount(void) const {
+		return m_rectCount;
+	}
+
+	const Rect& getRect(UINTN index) const {
+		return m_rects[index];
+	}
+
+	void clear(void) {
+		m_rectCount = 0;
+	}
+
+	void add(Rect rect) {
+		if (rect.left >= rect.right || rect.top >= rect.bottom)
+			return;
+
+		// Merging may enable further merges, loop until nothing changes
+		bool merged = true;
+		while (merged) {
+			merged = false;
+			for (UINTN i = 0; i < m_rectCount; i++) {
+				auto u = rect.getUnion(m_rects[i]);
+				if (u.getArea() <= rect.getArea() + m_rects[i].getArea()) {
+					rect = u;
+					remove(i);
+					merged = true;
+					break;
+				}
+			}
+		}
+
+		if (m_rectCount == maxRectCount) {
+			UINTN best = 0;
+			UINTN bestGrowth = MAX_UINTN;
+			for (UINTN i = 0; i < m_rectCount; i++) {
+				auto growth = rect.getUnion(m_rects[i]).getArea() - m_rects[i].getArea();
+				if (growth < bestGrowth) {
+					best = i;
+					bestGrowth = growth;
+				}
+			}
+			rect = rect.getUnion(m_rects[best]);
+			remove(best);
+			// The grown rectangle may now swallow other ones
+			add(rect);
+			return;
+		}
+
+		m_rects[m_rectCount++] = rect;
+	}
+};
+
+// Pixel formats, each packs 8-bit components into the native 32-bit pixel of the framebuffer
+namespace pixel {
+
+struct Rgb
+{
+	static inline constexpr EFI_GRAPHICS_PIXEL_FORMAT format = PixelRedGreenBlueReserved8BitPerColor;
+
+	static constexpr UINT32 pack(UINT8 r, UINT8 g, UINT8 b) {
+		return r | (g << 8) | (b << 16);
+	}
+};
+
+struct Bgr
+{
+	static inline constexpr EFI_GRAPHICS_PIXEL_FORMAT format = PixelBlueGreenRedReserved8BitPerColor;
+
+	static constexpr UINT32 pack(UINT8 r, UINT8 g, UINT8 b) {
+		return b | (g << 8) | (r << 16);
+	}
+};
+
+// Arbitrary component masks, each component value is looked up in a table precomputed at mode set time
+class BitMask
+{
+	UINT32 m_red[256];
+	UINT32 m_green[256];
+	UINT32 m_blue[256];
+
+	static void buildTable(UINT32 (&table)[256], UINT32 mask) {
+		UINTN shift = 0;
+		while (shift < 32 && ((mask >> shift) & 1) == 0)
+			shift++;
+		UINTN precision = 0;
+		while (shift + precision < 32 && ((mask >> (shift + precision)) & 1) == 1)
+			precision++;
+
+		for (UINTN i = 0; i < 256; i++) {
+			UINT32 value = precision <= 8 ? i >> (8 - precision) : i << (precision - 8);
+			table[i] = (value << shift) & mask;
+		}
 	}
+
+public:
+	static inline constexpr EFI_GRAPHICS_PIXEL_FORMAT format = PixelBitMask;
+
+	BitMask(const EFI_PIXEL_BITMASK &masks) {
+		buildTable(m_red, masks.RedMask);
+		buildTable(m_green, masks.GreenMask);
+		buildTable(m_blue, masks.BlueMask);
+	}
+
+	// Only 32-bit pixels with contiguous, non overlapping masks are supported
+	static bool isSupported(const EFI_PIXEL_BITMASK &masks) {
+		UINT32 all = masks.RedMask | masks.GreenMask | masks.BlueMask | masks.ReservedMask;
+		if ((all >> 24) == 0)
+			return false;
+		UINT32 components[] { masks.RedMask, masks.GreenMask, masks.BlueMask };
+		UINT32 seen = 0;
+		for (auto mask : components) {
+			if (mask == 0 || (mask & seen) != 0)
+				return false;
+			// Contiguous iff adding the lowest set bit clears every bit of the mask
+			if (((mask + (mask & -mask)) & mask) != 0)
+				return false;
+			seen |= mask;
+		}
+		return true;
+	}
+
+	UINT32 pack(UINT8 r, UINT8 g, UINT8 b) const {
+		return m_red[r] | m_green[g] | m_blue[b];
+	}
+};
+
 }
 
-class GraphicsOutput
+// Format-independent part of `GraphicsOutput`, everything here works on native 32-bit pixels
+class GraphicsOutputBase
 {
 	EFI_GRAPHICS_OUTPUT_MODE_INFORMATION m_modeInfo;
 	void *m_displayFramebuffer;
 	void *m_drawFramebuffer;
 	UINTN m_lineStride;
+	CpuFeatures m_cpuFeatures;
+	const raster::Kernels *m_kernels;
+	PresentBackend m_presentBackend;
+	DamageList m_damage;
+	UINTN m_presentedByteCount = 0;
 
 public:
 	static inline constexpr UINTN pixelStride = 4;
 
-	// `modeInfo.PixelFormat` must be `PixelRedGreenBlueReserved8BitPerColor` or `PixelBlueGreenRedReserved8BitPerColor`
 	// displayFramebuffer is the actual matrix that will display the picture to the user when updated
 	// drawFramebuffer is optional, if not `nullptr` it will be used for rendering. The picture will be
 	// made visible only after a call to the `present` method.
-	GraphicsOutput(EFI_GRAPHICS_OUTPUT_MODE_INFORMATION modeInfo, void *displayFramebuffer, void *drawFramebuffer) :
+	// Only the regions damaged by the drawing methods (or declared with `markDirty`) are copied by `present`.
+	GraphicsOutputBase(const EFI_GRAPHICS_OUTPUT_MODE_INFORMATION &modeInfo, void *displayFramebuffer, void *drawFramebuffer) :
 		m_modeInfo(modeInfo),
 		m_displayFramebuffer(displayFramebuffer),
-		m_drawFramebuffer(drawFramebuffer),
-		m_lineStride(modeInfo.PixelsPerScanLine * pixelStride)
+		m_drawFramebuffer(drawFramebuffer != nullptr ? drawFramebuffer : displayFramebuffer),
+		m_lineStride(modeInfo.PixelsPerScanLine * pixelStride),
+		m_cpuFeatures(CpuFeatures::query()),
+		m_kernels(&raster::Kernels::select(m_cpuFeatures))
 	{
 	}
 
+	// Name of the span kernels picked from CPUID, for logging
+	const CHAR16* getKernelsName(void) const {
+		return reinterpret_cast<const CHAR16*>(m_kernels->name);
+	}
+
+	// Picks the fastest present copy strategy by timing full frame copies against the display framebuffer
+	// The draw framebuffer contents become visible in the process.
+	void calibratePresent(UINTN tscFrequency) {
+		if (m_drawFramebuffer == m_displayFramebuffer)
+			return;
+		m_presentBackend.calibrate(m_cpuFeatures, m_displayFramebuffer, m_drawFramebuffer, m_lineStride * getHeight(), tscFrequency);
+	}
+
+	const PresentBackend& getPresentBackend(void) const {
+		return m_presentBackend;
+	}
+
+	void* getDisplayFramebuffer(void) const {
+		return m_displayFramebuffer;
+	}
+
+	// Bytes of the display framebuffer that are ever written to
+	UINTN getDisplayFramebufferSize(void) const {
+		return m_lineStride * getHeight();
+	}
+
 	UINTN getWidth(void) const {
 		return m_modeInfo.HorizontalResolution;
 	}
@@ -62,15 +526,6 @@ public:
 		return m_modeInfo.VerticalResolution;
 	}
 
-	union Pixel {
-		struct {
-			UINT8 r, g, b;
-		} comps;
-		struct {
-			UINT8 values[3];
-		} vector;
-	};
-
 	EFI_GRAPHICS_PIXEL_FORMAT getPixelFormat(void) const {
 		return m_modeInfo.PixelFormat;
 	}
@@ -80,15 +535,200 @@ public:
 		return scanline + x * pixelStride;
 	}
 
-	// pixel must be in the ordering defined by `modeInfo.PixelFormat`
-	void draw(UINTN x, UINTN y, UINT8 pixel[3]) {
-		auto offset = getPixelOffset(x, y);
-		for (UINTN k = 0; k < 3; k++)
-			offset[k] = pixel[k];
+	// pixel is a native pixel, see `GraphicsOutput::packPixel`
+	void draw(UINTN x, UINTN y, UINT32 pixel) {
+		getScanline(y)[x] = pixel;
+		markDirty(x, y, 1, 1);
 	}
 
+	// Writing through this pointer is not tracked, call `markDirty` on the written region
+	UINT32* getScanline(UINTN y) {
+		return reinterpret_cast<UINT32*>(getPixelOffset(0, y));
+	}
+
+	void markDirty(UINTN x, UINTN y, UINTN width, UINTN height) {
+		if (y >= getHeight() || x >= getWidth())
+			return;
+		if (width > getWidth() - x)
+			width = getWidth() - x;
+		if (height > getHeight() - y)
+			height = getHeight() - y;
+		m_damage.add(Rect {
+			.left = x,
+			.top = y,
+			.right = x + width,
+			.bottom = y + height
+		});
+	}
+
+	void markAllDirty(void) {
+		markDirty(0, 0, getWidth(), getHeight());
+	}
+
+	// Span methods clip against the screen, so that sprites and rectangles may lie partially out of it
+
+	void fillSpan(UINTN x, UINTN y, UINTN width, UINT32 color) {
+		if (y >= getHeight() || x >= getWidth())
+			return;
+		if (width > getWidth() - x)
+			width = getWidth() - x;
+		m_kernels->fillSpan(getScanline(y) + x, width, color);
+		markDirty(x, y, width, 1);
+	}
+
+	void fillRect(UINTN x, UINTN y, UINTN width, UINTN height, UINT32 color) {
+		if (y >= getHeight() || x >= getWidth())
+			return;
+		if (width > getWidth() - x)
+			width = getWidth() - x;
+		if (height > getHeight() - y)
+			height = getHeight() - y;
+		for (UINTN i = 0; i < height; i++)
+			m_kernels->fillSpan(getScanline(y + i) + x, width, color);
+		markDirty(x, y, width, height);
+	}
+
+	// `sprite` is `height` rows of `spriteStride` pixels, pixels equal to `colorKey` are transparent
+	void blit(UINTN x, UINTN y, UINTN width, UINTN height, const UINT32 *sprite, UINTN spriteStride, UINT32 colorKey) {
+		if (y >= getHeight() || x >= getWidth())
+			return;
+		if (width > getWidth() - x)
+			width = getWidth() - x;
+		if (height > getHeight() - y)
+			height = getHeight() - y;
+		for (UINTN i = 0; i < height; i++)
+			m_kernels->blitKeyed(getScanline(y + i) + x, sprite + i * spriteStride, width, colorKey);
+		markDirty(x, y, width, height);
+	}
+
+	// Duplicates the full scanline `srcY` onto `dstY`
+	void copyRow(UINTN dstY, UINTN srcY) {
+		if (dstY == srcY || dstY >= getHeight() || srcY >= getHeight())
+			return;
+		m_kernels->copyRow(getScanline(dstY), getScanline(srcY), getWidth());
+		markDirty(0, dstY, getWidth(), 1);
+	}
+
+	// Copies the damaged regions onto the display framebuffer
 	void present(void) {
-		CopyMem(m_displayFramebuffer, m_drawFramebuffer, m_lineStride * m_modeInfo.VerticalResolution);
+		m_presentedByteCount = 0;
+		if (m_drawFramebuffer == m_displayFramebuffer) {
+			m_damage.clear();
+			return;
+		}
+
+		for (UINTN i = 0; i < m_damage.getRectCount(); i++) {
+			auto &rect = m_damage.getRect(i);
+			auto offset = rect.top * m_lineStride + rect.left * pixelStride;
+			auto dst = reinterpret_cast<UINT8*>(m_displayFramebuffer) + offset;
+			auto src = reinterpret_cast<const UINT8*>(m_drawFramebuffer) + offset;
+
+			if (rect.left == 0 && rect.right == getWidth()) {
+				// Full scanlines are contiguous, stride padding included
+				auto size = (rect.bottom - rect.top) * m_lineStride;
+				m_presentBackend.copy(dst, src, size);
+				m_presentedByteCount += size;
+			} else {
+				auto rowSize = (rect.right - rect.left) * pixelStride;
+				for (UINTN y = rect.top; y < rect.bottom; y++) {
+					m_presentBackend.copy(dst, src, rowSize);
+					dst += m_lineStride;
+					src += m_lineStride;
+				}
+				m_presentedByteCount += rowSize * (rect.bottom - rect.top);
+			}
+		}
+		m_damage.clear();
+	}
+
+	// Bytes copied onto the display framebuffer by the last `present` call
+	UINTN getPresentedByteCount(void) const {
+		return m_presentedByteCount;
+	}
+};
+
+
+// Specialization over a pixel format (see `pixel`), so that pixel packing carries no per-pixel format logic
+template <typename PixelFormat>
+class GraphicsOutput : public GraphicsOutputBase
+{
+	PixelFormat m_pixelFormat;
+
+public:
+	GraphicsOutput(const EFI_GRAPHICS_OUTPUT_MODE_INFORMATION &modeInfo, void *displayFramebuffer, void *drawFramebuffer, const PixelFormat &pixelFormat) :
+		GraphicsOutputBase(modeInfo, displayFramebuffer, drawFramebuffer),
+		m_pixelFormat(pixelFormat)
+	{
+	}
+
+	// Native 32-bit pixel, to use with the drawing methods
+	UINT32 packPixel(UINT8 r, UINT8 g, UINT8 b) const {
+		return m_pixelFormat.pack(r, g, b);
+	}
+};
+
+// Holds the `GraphicsOutput` specialization matching the current video mode
+// The pixel format is dispatched once through `visit`, every code path inside of it is format-specific.
+class AnyGraphicsOutput
+{
+	EFI_GRAPHICS_PIXEL_FORMAT m_pixelFormat;
+	union {
+		GraphicsOutput<pixel::Rgb> m_rgb;
+		GraphicsOutput<pixel::Bgr> m_bgr;
+		GraphicsOutput<pixel::BitMask> m_bitMask;
+	};
+
+	AnyGraphicsOutput(const GraphicsOutput<pixel::Rgb> &graphicsOutput) :
+		m_pixelFormat(pixel::Rgb::format),
+		m_rgb(graphicsOutput)
+	{
+	}
+
+	AnyGraphicsOutput(const GraphicsOutput<pixel::Bgr> &graphicsOutput) :
+		m_pixelFormat(pixel::Bgr::format),
+		m_bgr(graphicsOutput)
+	{
+	}
+
+	AnyGraphicsOutput(const GraphicsOutput<pixel::BitMask> &graphicsOutput) :
+		m_pixelFormat(pixel::BitMask::format),
+		m_bitMask(graphicsOutput)
+	{
+	}
+
+public:
+	static bool isSupported(const EFI_GRAPHICS_OUTPUT_MODE_INFORMATION &modeInfo) {
+		return modeInfo.PixelFormat == PixelRedGreenBlueReserved8BitPerColor ||
+			modeInfo.PixelFormat == PixelBlueGreenRedReserved8BitPerColor ||
+			(modeInfo.PixelFormat == PixelBitMask && pixel::BitMask::isSupported(modeInfo.PixelInformation));
+	}
+
+	// `modeInfo` must be supported, see `isSupported`
+	static AnyGraphicsOutput create(const EFI_GRAPHICS_OUTPUT_MODE_INFORMATION &modeInfo, void *displayFramebuffer, void *drawFramebuffer) {
+		if (modeInfo.PixelFormat == PixelRedGreenBlueReserved8BitPerColor)
+			return AnyGraphicsOutput(GraphicsOutput(modeInfo, displayFramebuffer, drawFramebuffer, pixel::Rgb()));
+		else if (modeInfo.PixelFormat == PixelBlueGreenRedReserved8BitPerColor)
+			return AnyGraphicsOutput(GraphicsOutput(modeInfo, displayFramebuffer, drawFramebuffer, pixel::Bgr()));
+		else
+			return AnyGraphicsOutput(GraphicsOutput(modeInfo, displayFramebuffer, drawFramebuffer, pixel::BitMask(modeInfo.PixelInformation)));
+	}
+
+	// Fn is a `void (GraphicsOutput<PixelFormat> &graphicsOutput)`, generic over `PixelFormat`
+	template <typename Fn>
+	decltype(auto) visit(Fn &&fn) {
+		if (m_pixelFormat == pixel::Rgb::format)
+			return fn(m_rgb);
+		else if (m_pixelFormat == pixel::Bgr::format)
+			return fn(m_bgr);
+		else
+			return fn(m_bitMask);
+	}
+
+	// For format-independent operations
+	GraphicsOutputBase& getBase(void) {
+		return visit([](GraphicsOutputBase &base) -> GraphicsOutputBase& {
+			return base;
+		});
 	}
 };
 
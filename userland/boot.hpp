@@ -11,10 +11,16 @@ extern "C" {
 #include <Uefi/UefiSpec.h>
 #include <Library/UefiBootServicesTableLib.h>
 #include <Protocol/GraphicsOutput.h>
+#include <Protocol/LoadedImage.h>
+#include <Protocol/SimpleFileSystem.h>
+#include <Guid/FileInfo.h>
 
 }
 
 #include "bare.hpp"
+#include "frames.hpp"
+#include "paging.hpp"
+#include "elf.hpp"
 #include <optional>
 
 #define bootUToC16(uStr) reinterpret_cast<const CHAR16*>(uStr)
@@ -29,7 +35,8 @@ namespace boot {
 	}
 }
 
-[[maybe_unused]] static void printControlRegisters(void) {
+// Also reports how `framebuffer` is cached when not nullptr
+[[maybe_unused]] static void printControlRegisters(const void *framebuffer = nullptr) {
 		static constexpr UINT32 msrEferAddr = 0xC0000080;
 
 		auto cr0 = AsmReadCr0();
@@ -38,87 +45,322 @@ namespace boot {
 		auto cr4 = AsmReadCr4();
 		auto efer = AsmReadMsr64(msrEferAddr);
 		Print(bootUToC16(u"CR0 = 0x%Lx, CR2 = 0x%Lx, CR3 = 0x%Lx, CR4 = 0x%Lx, EFER = 0x%Lx\n"), cr0, cr2, cr3, cr4, efer);
+		if (framebuffer == nullptr)
+			return;
+		auto caching = bare::MemoryCaching::query(reinterpret_cast<UINTN>(framebuffer));
+		Print(bootUToC16(u"PAT = 0x%Lx, framebuffer at 0x%p cached %s (PAT %s, MTRR %s) by 0x%Lx-byte pages\n"),
+			AsmReadMsr64(bare::MemoryCaching::msrPat), framebuffer, bare::memoryType::getName(caching.effectiveType),
+			bare::memoryType::getName(caching.patType), bare::memoryType::getName(caching.mtrrType), caching.pageSize
+		);
 }
 
-[[maybe_unused]] static UINTN getMemoryMapKey(void) {
-	UINTN memoryMapSize = 0, mapKey, descriptorSize;
-	UINT32 descriptorVersion;
-	auto res = gBS->GetMemoryMap(&memoryMapSize, nullptr, &mapKey, &descriptorSize, &descriptorVersion);
-	if (res != EFI_BUFFER_TOO_SMALL)
-		bootEfiAssert(res);
-	return mapKey;
-}
+// The UEFI memory map captured once, sorted by address, with neighbors of the same type and attributes merged
+// Storage is allocated before the map is read: calling `capture` again right before `ExitBootServices` refreshes it in
+// place, and `getMapKey` stays valid for as long as nothing else is allocated. Lookups by address and free range
+// queries are binary searches, page totals per type are counted once per capture.
+class MemoryMapSnapshot
+{
+public:
+	struct Range {
+		UINTN begin;
+		UINTN end;
+		UINT64 attribute;
+		UINT32 type;
+
+		UINTN getPageCount(void) const {
+			return (end - begin) >> EFI_PAGE_SHIFT;
+		}
+	};
+	// Ranges are converted in place over the descriptors they come from
+	static_assert(sizeof(Range) <= sizeof(EFI_MEMORY_DESCRIPTOR));
+
+private:
+	// Descriptors to make room for beyond the current map, as allocating the storage may split some
+	static inline constexpr UINTN slackDescriptorCount = 16;
+
+	void *m_storage = nullptr;
+	UINTN m_capacity = 0;
+	UINTN m_descriptorSize = 0;
+	UINTN m_mapKey = 0;
+	UINTN m_descriptorCount = 0;
+	Range *m_ranges = nullptr;
+	UINTN m_rangeCount = 0;
+	// Indices of the `EfiConventionalMemory` ranges, by increasing size
+	UINTN *m_freeRanges = nullptr;
+	UINTN m_freeRangeCount = 0;
+	UINTN m_typePageCounts[EfiMaxMemoryType] {};
+
+	void reserve(UINTN descriptorCount, UINTN descriptorSize) {
+		if (m_storage != nullptr)
+			bootEfiAssert(gBS->FreePool(m_storage));
+		m_capacity = descriptorCount + slackDescriptorCount;
+		m_descriptorSize = descriptorSize;
+		bootEfiAssert(gBS->AllocatePool(EfiLoaderData, m_capacity * (descriptorSize + sizeof(UINTN)), &m_storage));
+		m_ranges = reinterpret_cast<Range*>(m_storage);
+		m_freeRanges = reinterpret_cast<UINTN*>(reinterpret_cast<UINT8*>(m_storage) + m_capacity * descriptorSize);
+	}
 
-// Fn is a `void (const EFI_MEMORY_DESCRIPTOR &currentMemoryDescriptor)`
-template <typename Fn>
-static UINTN iterateMemoryMap(Fn &&fn) {
-	UINTN memoryMapSize = 0, mapKey, descriptorSize;
-	UINT32 descriptorVersion;
-	{
-		auto res = gBS->GetMemoryMap(&memoryMapSize, nullptr, &mapKey, &descriptorSize, &descriptorVersion);
-		if (res != EFI_BUFFER_TOO_SMALL)
-			bootEfiAssert(res);
+	// Insertion sorts: the firmware usually hands the map out sorted already, which makes them linear
+	template <typename T, typename Less>
+	static void sort(T *values, UINTN count, Less &&less) {
+		for (UINTN i = 1; i < count; i++) {
+			auto value = values[i];
+			auto j = i;
+			for (; j > 0 && less(value, values[j - 1]); j--)
+				values[j] = values[j - 1];
+			values[j] = value;
+		}
+	}
+
+public:
+	MemoryMapSnapshot(void) {
+		capture();
+	}
+
+	MemoryMapSnapshot(const MemoryMapSnapshot&) = delete;
+	MemoryMapSnapshot& operator=(const MemoryMapSnapshot&) = delete;
+
+	void capture(void) {
+		UINTN mapSize;
+		UINTN descriptorSize;
+		UINT32 descriptorVersion;
+		while (true) {
+			mapSize = m_capacity * m_descriptorSize;
+			auto res = gBS->GetMemoryMap(&mapSize, reinterpret_cast<EFI_MEMORY_DESCRIPTOR*>(m_storage), &m_mapKey, &descriptorSize, &descriptorVersion);
+			if (res == EFI_SUCCESS)
+				break;
+			if (res != EFI_BUFFER_TOO_SMALL)
+				bootEfiAssert(res);
+			reserve(mapSize / descriptorSize, descriptorSize);
+		}
+		if (descriptorVersion != EFI_MEMORY_DESCRIPTOR_VERSION)
+			fatalError(bootUToC16(u"GetMemoryMap.descriptorVersion was expected to be EFI_MEMORY_DESCRIPTOR_VERSION"), descriptorVersion);
+
+		// Range i never reaches past descriptor i, so each descriptor is read before being overwritten
+		m_descriptorCount = mapSize / descriptorSize;
+		for (UINTN i = 0; i < m_descriptorCount; i++) {
+			auto descriptor = *reinterpret_cast<const EFI_MEMORY_DESCRIPTOR*>(reinterpret_cast<const UINT8*>(m_storage) + i * descriptorSize);
+			m_ranges[i] = Range {
+				.begin = static_cast<UINTN>(descriptor.PhysicalStart),
+				.end = static_cast<UINTN>(descriptor.PhysicalStart + descriptor.NumberOfPages * EFI_PAGE_SIZE),
+				.attribute = descriptor.Attribute,
+				.type = descriptor.Type
+			};
+		}
+		sort(m_ranges, m_descriptorCount, [](const Range &a, const Range &b) {
+			return a.begin < b.begin;
+		});
+
+		m_rangeCount = 0;
+		for (UINTN i = 0; i < m_descriptorCount; i++) {
+			auto &range = m_ranges[i];
+			if (m_rangeCount > 0) {
+				auto &last = m_ranges[m_rangeCount - 1];
+				if (last.end == range.begin && last.type == range.type && last.attribute == range.attribute) {
+					last.end = range.end;
+					continue;
+				}
+			}
+			m_ranges[m_rangeCount++] = range;
+		}
+
+		m_freeRangeCount = 0;
+		SetMem(m_typePageCounts, sizeof(m_typePageCounts), 0);
+		for (UINTN i = 0; i < m_rangeCount; i++) {
+			auto &range = m_ranges[i];
+			if (range.type < EfiMaxMemoryType)
+				m_typePageCounts[range.type] += range.getPageCount();
+			if (range.type == EfiConventionalMemory)
+				m_freeRanges[m_freeRangeCount++] = i;
+		}
+		sort(m_freeRanges, m_freeRangeCount, [this](UINTN a, UINTN b) {
+			return m_ranges[a].getPageCount() < m_ranges[b].getPageCount();
+		});
 	}
-	//Print(bootUToC16(u"Memory map size: 0x%Lx bytes, mapKey = 0x%Lx, descriptorSize = 0x%Lx, descriptorVersion = 0x%Lx\n"), memoryMapSize, mapKey, descriptorSize, descriptorVersion);
 
-	if (descriptorVersion != EFI_MEMORY_DESCRIPTOR_VERSION)
-		fatalError(bootUToC16(u"GetMemoryMap.descriptorVersion was expected to be EFI_MEMORY_DESCRIPTOR_VERSION"), descriptorVersion);
+	// Key of the map as of the last `capture`, for `ExitBootServices`
+	UINTN getMapKey(void) const {
+		return m_mapKey;
+	}
 
-	UINT8 memoryMapBytes[memoryMapSize];
-	bootEfiAssert(gBS->GetMemoryMap(&memoryMapSize, reinterpret_cast<EFI_MEMORY_DESCRIPTOR*>(memoryMapBytes), &mapKey, &descriptorSize, &descriptorVersion));
+	// Descriptors reported by the firmware, before merging
+	UINTN getDescriptorCount(void) const {
+		return m_descriptorCount;
+	}
 
-	UINTN descriptorCount = memoryMapSize / descriptorSize;
-	for (UINTN i = 0; i < descriptorCount; i++) {
-		auto &curDescriptor = *reinterpret_cast<const EFI_MEMORY_DESCRIPTOR*>(memoryMapBytes + i * descriptorSize);
-		fn(curDescriptor);
+	UINTN getRangeCount(void) const {
+		return m_rangeCount;
 	}
-	return descriptorCount;
-}
 
-[[maybe_unused]] static EFI_MEMORY_DESCRIPTOR findConventionalMemory(void) {
-	std::optional<EFI_MEMORY_DESCRIPTOR> res;
+	const Range& getRange(UINTN index) const {
+		return m_ranges[index];
+	}
 
-	auto descriptorCount = iterateMemoryMap([&res](const EFI_MEMORY_DESCRIPTOR &curDescriptor) {
-		if (curDescriptor.Type != EfiConventionalMemory)
-			return;
+	UINTN getTypePageCount(UINTN type) const {
+		return type < EfiMaxMemoryType ? m_typePageCounts[type] : 0;
+	}
 
-		if (!res || curDescriptor.NumberOfPages > res->NumberOfPages)
-			res = curDescriptor;
-	});
-	if (!res)
-		fatalError(bootUToC16(u"findConventionalMemory: no mapping found of type EfiConventionalMemory (code is memory descriptor count)"), descriptorCount);
-	return *res;
+	// Range holding `address`, nullptr when the map doesn't describe it
+	const Range* find(UINTN address) const {
+		// First range beginning past `address`, the one before may hold it
+		UINTN low = 0, high = m_rangeCount;
+		while (low < high) {
+			auto middle = (low + high) / 2;
+			if (m_ranges[middle].begin <= address)
+				low = middle + 1;
+			else
+				high = middle;
+		}
+		if (low == 0 || address >= m_ranges[low - 1].end)
+			return nullptr;
+		return &m_ranges[low - 1];
+	}
+
+	// Fn is a `void (const Range &range)`, called in address order on the ranges overlapping [begin, end)
+	// with a type in [typeBegin, typeEnd)
+	template <typename Fn>
+	void iterate(UINTN begin, UINTN end, UINT32 typeBegin, UINT32 typeEnd, Fn &&fn) const {
+		UINTN low = 0, high = m_rangeCount;
+		while (low < high) {
+			auto middle = (low + high) / 2;
+			if (m_ranges[middle].end <= begin)
+				low = middle + 1;
+			else
+				high = middle;
+		}
+		for (auto i = low; i < m_rangeCount && m_ranges[i].begin < end; i++)
+			if (m_ranges[i].type >= typeBegin && m_ranges[i].type < typeEnd)
+				fn(m_ranges[i]);
+	}
+
+	template <typename Fn>
+	void iterate(UINT32 typeBegin, UINT32 typeEnd, Fn &&fn) const {
+		iterate(0, ~static_cast<UINTN>(0), typeBegin, typeEnd, fn);
+	}
+
+	// Smallest free range of at least `pageCount` pages, nullptr when none is large enough
+	const Range* findFreeRange(UINTN pageCount) const {
+		UINTN low = 0, high = m_freeRangeCount;
+		while (low < high) {
+			auto middle = (low + high) / 2;
+			if (m_ranges[m_freeRanges[middle]].getPageCount() < pageCount)
+				low = middle + 1;
+			else
+				high = middle;
+		}
+		return low < m_freeRangeCount ? &m_ranges[m_freeRanges[low]] : nullptr;
+	}
+
+	// End of the highest range
+	UINTN getEnd(void) const {
+		return m_rangeCount > 0 ? m_ranges[m_rangeCount - 1].end : 0;
+	}
+
+	const Range* getLargestFreeRange(void) const {
+		return m_freeRangeCount > 0 ? &m_ranges[m_freeRanges[m_freeRangeCount - 1]] : nullptr;
+	}
+};
+
+// Memory that is ours once `ExitBootServices` returned
+[[maybe_unused]] static bool isReclaimableMemory(UINT32 type) {
+	return type == EfiConventionalMemory || type == EfiBootServicesCode || type == EfiBootServicesData;
 }
 
-[[maybe_unused]] static void printMemoryTotals(void) {
-	UINTN totalPages[EfiMaxMemoryType] {};
+// Allocates the frame states of `bare::PageFrameAllocator` up to the end of reclaimable memory
+// Capture `memoryMap` again and call `capturePageFrames` on the plan last thing before `ExitBootServices`.
+[[maybe_unused]] static bare::PageFrameAllocator::Plan planPageFrames(const MemoryMapSnapshot &memoryMap) {
+	bare::PageFrameAllocator::Plan plan {};
+	for (UINTN i = 0; i < memoryMap.getRangeCount(); i++) {
+		auto &range = memoryMap.getRange(i);
+		if (isReclaimableMemory(range.type) && (range.end >> EFI_PAGE_SHIFT) > plan.frameCount)
+			plan.frameCount = range.end >> EFI_PAGE_SHIFT;
+	}
 
-	auto descriptorCount = iterateMemoryMap([&totalPages](const EFI_MEMORY_DESCRIPTOR &curDescriptor) {
-		totalPages[curDescriptor.Type] += curDescriptor.NumberOfPages;
-	});
+	EFI_PHYSICAL_ADDRESS frameStates;
+	bootEfiAssert(gBS->AllocatePages(AllocateAnyPages, EfiLoaderData, EFI_SIZE_TO_PAGES(plan.frameCount), &frameStates));
+	plan.frameStates = reinterpret_cast<UINT8*>(frameStates);
+	return plan;
+}
+
+// Marks the page tables in use as reserved, one level at a time down from `table`
+[[maybe_unused]] static void reservePageTables(bare::PageFrameAllocator::Plan &plan, UINTN table, UINTN level) {
+	static constexpr UINT64 present = 1;
+	static constexpr UINT64 largePage = 1 << 7;
+	static constexpr UINT64 addressMask = 0x000FFFFFFFFFF000;
+
+	auto frame = table >> EFI_PAGE_SHIFT;
+	if (frame < plan.frameCount)
+		plan.frameStates[frame] = bare::PageFrameAllocator::stateReserved;
+	if (level == 1)
+		return;
+	auto entries = reinterpret_cast<const UINT64*>(table);
+	for (UINTN i = 0; i < 512; i++) {
+		// Large pages only exist in PDPTs and PDs
+		if ((entries[i] & present) == 0 || (level <= 3 && (entries[i] & largePage)))
+			continue;
+		reservePageTables(plan, entries[i] & addressMask, level - 1);
+	}
+}
+
+// Fills the usable ranges of `plan` from `memoryMap`, to call last thing before `ExitBootServices`
+// Boot services memory is reclaimed too, except what the code running after `ExitBootServices` still relies on: the
+// range holding the stack and the pages of the firmware page tables. The firmware GDT and IDT are not kept, so
+// `bare::DescriptorTables::load` must replace them before any frame is handed out.
+[[maybe_unused]] static void capturePageFrames(bare::PageFrameAllocator::Plan &plan, const MemoryMapSnapshot &memoryMap) {
+	static constexpr UINT64 cr4La57 = 1 << 12;
+
+	SetMem(plan.frameStates, plan.frameCount, bare::PageFrameAllocator::stateUsed);
+	reservePageTables(plan, AsmReadCr3() & ~static_cast<UINTN>(0xFFF), AsmReadCr4() & cr4La57 ? 5 : 4);
+
+	UINT8 stackMarker;
+	UINTN stackAddress = reinterpret_cast<UINTN>(&stackMarker);
+
+	plan.rangeCount = 0;
+	plan.droppedPageCount = 0;
+	for (UINTN i = 0; i < memoryMap.getRangeCount(); i++) {
+		auto &range = memoryMap.getRange(i);
+		if (!isReclaimableMemory(range.type))
+			continue;
+		if (range.type != EfiConventionalMemory && stackAddress >= range.begin && stackAddress < range.end)
+			continue;
+
+		// Reclaimable ranges of different types next to each other become one
+		if (plan.rangeCount > 0) {
+			auto &last = plan.ranges[plan.rangeCount - 1];
+			if (last.base + last.pageCount * EFI_PAGE_SIZE == range.begin) {
+				last.pageCount += range.getPageCount();
+				continue;
+			}
+		}
+		if (plan.rangeCount == bare::PageFrameAllocator::Plan::maxRangeCount) {
+			plan.droppedPageCount += range.getPageCount();
+			continue;
+		}
+		plan.ranges[plan.rangeCount++] = { range.begin, range.getPageCount() };
+	}
+}
 
-	Print(bootUToC16(u"Enumerating memory type totals, 0x%Lx descriptors:\n"), descriptorCount);
+[[maybe_unused]] static void printMemoryTotals(const MemoryMapSnapshot &memoryMap) {
+	Print(bootUToC16(u"Enumerating memory type totals, 0x%Lx descriptors merged into 0x%Lx ranges:\n"), memoryMap.getDescriptorCount(), memoryMap.getRangeCount());
 	for (UINTN i = 0; i < EfiMaxMemoryType; i++) {
-		Print(bootUToC16(u"Type 0x%Lx: %,Ld bytes (0x%Lx pages)\n"), i, totalPages[i] * static_cast<UINTN>(1 << 12), totalPages[i]);
+		auto pageCount = memoryMap.getTypePageCount(i);
+		Print(bootUToC16(u"Type 0x%Lx: %,Ld bytes (0x%Lx pages)\n"), i, pageCount * static_cast<UINTN>(1 << 12), pageCount);
 	}
 }
 
-[[maybe_unused]] static void printMemoryTypeDescriptors(EFI_MEMORY_TYPE memoryTypeBegin, EFI_MEMORY_TYPE memoryTypeEnd, UINTN minPageCount) {
+[[maybe_unused]] static void printMemoryTypeDescriptors(const MemoryMapSnapshot &memoryMap, EFI_MEMORY_TYPE memoryTypeBegin, EFI_MEMORY_TYPE memoryTypeEnd, UINTN minPageCount) {
 	UINTN smallPageCount = 0;
 
 	UINTN i = 0;
-	Print(bootUToC16(u"Enumerating memory descriptors from type 0x%Lx to 0x%Lx (non inclusive):\n"), static_cast<UINTN>(memoryTypeBegin), static_cast<UINTN>(memoryTypeEnd));
-	iterateMemoryMap([&i, memoryTypeBegin, memoryTypeEnd, minPageCount, &smallPageCount](const EFI_MEMORY_DESCRIPTOR &curDescriptor) {
-		if (!(curDescriptor.Type >= memoryTypeBegin && curDescriptor.Type < memoryTypeEnd))
-			return;
-		if (curDescriptor.NumberOfPages < minPageCount) {
+	Print(bootUToC16(u"Enumerating memory ranges from type 0x%Lx to 0x%Lx (non inclusive):\n"), static_cast<UINTN>(memoryTypeBegin), static_cast<UINTN>(memoryTypeEnd));
+	memoryMap.iterate(memoryTypeBegin, memoryTypeEnd, [&i, minPageCount, &smallPageCount](const MemoryMapSnapshot::Range &range) {
+		if (range.getPageCount() < minPageCount) {
 			smallPageCount++;
 			return;
 		}
 
 		Print(bootUToC16(u"#%Ld at [0x%Lx, 0x%Lx): %,Ld bytes (0x%Lx pages), attr = 0x%Lx\n"), i,
-			curDescriptor.PhysicalStart, curDescriptor.PhysicalStart + curDescriptor.NumberOfPages * static_cast<UINTN>(1 << 12),
-			curDescriptor.NumberOfPages * static_cast<UINTN>(1 << 12), curDescriptor.NumberOfPages, curDescriptor.Attribute
+			range.begin, range.end, range.end - range.begin, range.getPageCount(), range.attribute
 		);
 		i++;
 
@@ -128,14 +370,7 @@ static UINTN iterateMemoryMap(Fn &&fn) {
 		}
 	});
 	if (minPageCount > 0)
-		Print(bootUToC16(u"0x%Lx memory descriptors of less than 0x%Lx pages were omitted\n"), smallPageCount, minPageCount);
-}
-
-[[maybe_unused]] static UINTN estimateTscFrequency(void) {
-	auto begin = AsmReadTsc();
-	bootEfiAssert(gBS->Stall(static_cast<UINTN>(1e6)));
-	auto end = AsmReadTsc();
-	return end - begin;
+		Print(bootUToC16(u"0x%Lx memory ranges of less than 0x%Lx pages were omitted\n"), smallPageCount, minPageCount);
 }
 
 [[maybe_unused]] static void printGuid(const GUID &guid) {
@@ -165,6 +400,131 @@ static void iterateHandles(EFI_LOCATE_SEARCH_TYPE searchType, EFI_GUID *protocol
 	}
 }
 
+// Root directory of the volume this image was loaded from, usually the ESP
+// Fails when the image came from a device without a file system.
+[[maybe_unused]] static EFI_STATUS openImageVolume(EFI_FILE_PROTOCOL *&root) {
+	EFI_LOADED_IMAGE_PROTOCOL *loadedImage;
+	auto res = gBS->OpenProtocol(gImageHandle, &gEfiLoadedImageProtocolGuid, reinterpret_cast<void**>(&loadedImage), gImageHandle, nullptr, EFI_OPEN_PROTOCOL_GET_PROTOCOL);
+	if (res != EFI_SUCCESS)
+		return res;
+	EFI_SIMPLE_FILE_SYSTEM_PROTOCOL *fileSystem;
+	res = gBS->OpenProtocol(loadedImage->DeviceHandle, &gEfiSimpleFileSystemProtocolGuid, reinterpret_cast<void**>(&fileSystem), gImageHandle, nullptr, EFI_OPEN_PROTOCOL_GET_PROTOCOL);
+	if (res != EFI_SUCCESS)
+		return res;
+	return fileSystem->OpenVolume(fileSystem, &root);
+}
+
+// Reads up to `size` bytes of the file at `path` on the image volume, `size` is then the number of bytes read
+// Returns `EFI_NOT_FOUND` when there is no such file.
+[[maybe_unused]] static EFI_STATUS readVolumeFile(const CHAR16 *path, void *buffer, UINTN &size) {
+	EFI_FILE_PROTOCOL *root;
+	auto res = openImageVolume(root);
+	if (res != EFI_SUCCESS)
+		return res;
+	EFI_FILE_PROTOCOL *file;
+	res = root->Open(root, &file, const_cast<CHAR16*>(path), EFI_FILE_MODE_READ, 0);
+	if (res == EFI_SUCCESS) {
+		res = file->Read(file, &size, buffer);
+		file->Close(file);
+	}
+	root->Close(root);
+	return res;
+}
+
+// Replaces the file at `path` on the image volume with `size` bytes of `buffer`
+// Fails on read-only or full volumes, where the previous file may be gone already.
+[[maybe_unused]] static EFI_STATUS writeVolumeFile(const CHAR16 *path, const void *buffer, UINTN size) {
+	EFI_FILE_PROTOCOL *root;
+	auto res = openImageVolume(root);
+	if (res != EFI_SUCCESS)
+		return res;
+	EFI_FILE_PROTOCOL *file;
+	// Opening an existing file for writing keeps its content past what is written: delete it first
+	if (root->Open(root, &file, const_cast<CHAR16*>(path), EFI_FILE_MODE_READ | EFI_FILE_MODE_WRITE, 0) == EFI_SUCCESS)
+		res = file->Delete(file);
+	if (res == EFI_SUCCESS)
+		res = root->Open(root, &file, const_cast<CHAR16*>(path), EFI_FILE_MODE_READ | EFI_FILE_MODE_WRITE | EFI_FILE_MODE_CREATE, 0);
+	if (res == EFI_SUCCESS) {
+		res = file->Write(file, &size, const_cast<void*>(buffer));
+		auto closeRes = file->Close(file);
+		// Data may only be flushed on close
+		res = res == EFI_SUCCESS ? closeRes : res;
+	}
+	root->Close(root);
+	return res;
+}
+
+// Reads every `*.elf` file of `directory` on the image volume, up to `bare::ElfImage::Plan::maxProgramCount`
+// Files land in pages allocated as `EfiLoaderData`, which page frames reclaimed after `ExitBootServices` never overlap,
+// so that their segments can be mapped in place afterwards. No program is found when the volume or the directory is
+// missing, and files that fail to read are skipped.
+[[maybe_unused]] static bare::ElfImage::Plan planPrograms(const CHAR16 *directory) {
+	bare::ElfImage::Plan plan {};
+	auto begin = AsmReadTsc();
+	EFI_FILE_PROTOCOL *root;
+	if (openImageVolume(root) != EFI_SUCCESS)
+		return plan;
+	EFI_FILE_PROTOCOL *dir;
+	if (root->Open(root, &dir, const_cast<CHAR16*>(directory), EFI_FILE_MODE_READ, 0) != EFI_SUCCESS) {
+		root->Close(root);
+		return plan;
+	}
+
+	auto isElfName = [](const CHAR16 *name) {
+		UINTN length = 0;
+		while (name[length] != 0)
+			length++;
+		static constexpr CHAR16 suffix[] { '.', 'e', 'l', 'f' };
+		if (length < 4)
+			return false;
+		for (UINTN i = 0; i < 4; i++) {
+			auto c = name[length - 4 + i];
+			if ((c >= 'A' && c <= 'Z' ? c - 'A' + 'a' : c) != suffix[i])
+				return false;
+		}
+		return true;
+	};
+
+	// Directory reads return one entry at a time
+	alignas(8) UINT8 infoBuffer[SIZE_OF_EFI_FILE_INFO + 256 * sizeof(CHAR16)];
+	while (plan.programCount < bare::ElfImage::Plan::maxProgramCount) {
+		UINTN infoSize = sizeof(infoBuffer);
+		if (dir->Read(dir, &infoSize, infoBuffer) != EFI_SUCCESS || infoSize == 0)
+			break;
+		auto &info = *reinterpret_cast<const EFI_FILE_INFO*>(infoBuffer);
+		if ((info.Attribute & EFI_FILE_DIRECTORY) || info.FileSize == 0 || !isElfName(info.FileName))
+			continue;
+
+		EFI_FILE_PROTOCOL *file;
+		if (dir->Open(dir, &file, const_cast<CHAR16*>(info.FileName), EFI_FILE_MODE_READ, 0) != EFI_SUCCESS)
+			continue;
+		EFI_PHYSICAL_ADDRESS data;
+		UINTN size = info.FileSize;
+		auto res = gBS->AllocatePages(AllocateAnyPages, EfiLoaderData, EFI_SIZE_TO_PAGES(info.FileSize), &data);
+		if (res == EFI_SUCCESS) {
+			res = file->Read(file, &size, reinterpret_cast<void*>(data));
+			if (res != EFI_SUCCESS)
+				gBS->FreePages(data, EFI_SIZE_TO_PAGES(info.FileSize));
+		}
+		file->Close(file);
+		if (res != EFI_SUCCESS)
+			continue;
+
+		auto &program = plan.programs[plan.programCount++];
+		UINTN i = 0;
+		for (; i + 1 < bare::ElfImage::Plan::maxNameLength && info.FileName[i] != 0; i++)
+			program.name[i] = info.FileName[i];
+		program.name[i] = 0;
+		program.data = reinterpret_cast<const UINT8*>(data);
+		program.size = size;
+		plan.byteCount += size;
+	}
+	dir->Close(dir);
+	root->Close(root);
+	plan.readCycles = AsmReadTsc() - begin;
+	return plan;
+}
+
 class GraphicsOutputProtocol
 {
 	EFI_GRAPHICS_OUTPUT_PROTOCOL *m_graphicsOutputProtocol;
@@ -193,7 +553,7 @@ public:
 	// drawFramebuffer is optional, pass a buffer to enable double buffering
 	// Note that a too small non-zero drawFramebuffer may not be compatible with any video mode.
 	// A framebuffer of at least 16MiB is recommended to support Full HD with plenty of margin
-	bare::GraphicsOutput toBareGraphics(UINTN drawFramebufferSize, void *drawFramebuffer) {
+	bare::AnyGraphicsOutput toBareGraphics(UINTN drawFramebufferSize, void *drawFramebuffer) {
 		UINTN notFittingCount = 0;
 		struct Best {
 			UINT32 modeNumber;
@@ -206,9 +566,9 @@ public:
 				modeInfo.HorizontalResolution, modeInfo.VerticalResolution, modeInfo.PixelFormat, modeInfo.PixelsPerScanLine,
 				modeInfo.PixelInformation.RedMask, modeInfo.PixelInformation.GreenMask, modeInfo.PixelInformation.BlueMask
 			);*/
-			if (!(modeInfo.PixelFormat == PixelRedGreenBlueReserved8BitPerColor || modeInfo.PixelFormat == PixelBlueGreenRedReserved8BitPerColor))
+			if (!bare::AnyGraphicsOutput::isSupported(modeInfo))
 				return;
-			if (modeInfo.VerticalResolution * modeInfo.PixelsPerScanLine * bare::GraphicsOutput::pixelStride > drawFramebufferSize) {
+			if (modeInfo.VerticalResolution * modeInfo.PixelsPerScanLine * bare::GraphicsOutputBase::pixelStride > drawFramebufferSize) {
 				notFittingCount++;
 				return;
 			}
@@ -224,7 +584,7 @@ public:
 			boot::fatalError(bootUToC16(u"boot::GraphicsOutputProtocol::toBareGraphics: no compatible mode found (code is the number of modes not fitting in supplied framebuffer)"), notFittingCount);
 
 		setMode(best->modeNumber);
-		return bare::GraphicsOutput(*m_graphicsOutputProtocol->Mode->Info, reinterpret_cast<void*>(m_graphicsOutputProtocol->Mode->FrameBufferBase), drawFramebuffer);
+		return bare::AnyGraphicsOutput::create(*m_graphicsOutputProtocol->Mode->Info, reinterpret_cast<void*>(m_graphicsOutputProtocol->Mode->FrameBufferBase), drawFramebuffer);
 	}
 
 	static GraphicsOutputProtocol query(void) {
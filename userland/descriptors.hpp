@@ -0,0 +1,156 @@
+#pragma once
+
+extern "C" {
+
+#include <Uefi.h>
+#include <Library/BaseLib.h>
+
+}
+
+// Interrupt entry points of `bare::DescriptorTables`
+// Exceptions halt the CPU for good. Every other vector acknowledges the local APIC and returns: the timer only has to
+// wake the CPU out of `hlt`, and a stray interrupt left over by the firmware must not take it down.
+asm(R"(
+	.pushsection .text
+	.global bareInterruptFault
+	.global bareInterruptAcknowledge
+bareInterruptFault:
+	cli
+1:
+	hlt
+	jmp 1b
+
+bareInterruptAcknowledge:
+	pushq %rax
+	pushq %rcx
+	pushq %rdx
+	movq bareApicEoiAddress(%rip), %rax
+	testq %rax, %rax
+	jz 1f
+	movl $0, (%rax)
+	jmp 2f
+1:
+	movl $0x80B, %ecx
+	xorl %eax, %eax
+	xorl %edx, %edx
+	wrmsr
+2:
+	popq %rdx
+	popq %rcx
+	popq %rax
+	iretq
+	.popsection
+
+	.pushsection .data
+	.balign 8
+	.global bareApicEoiAddress
+bareApicEoiAddress:
+	.quad 0
+	.popsection
+)");
+
+extern "C" const UINT8 bareInterruptFault[];
+extern "C" const UINT8 bareInterruptAcknowledge[];
+// Address of the EOI register of the local APIC, 0 in x2APIC mode where it is an MSR
+extern "C" UINT64 bareApicEoiAddress;
+
+namespace bare {
+
+struct InterruptGate {
+	UINT16 offsetLow;
+	UINT16 selector;
+	UINT8 ist;
+	UINT8 attributes;
+	UINT16 offsetMiddle;
+	UINT32 offsetHigh;
+	UINT32 reserved;
+
+	// 64-bit interrupt gate, interrupts stay disabled within the handler
+	// `privilegeLevel` is the least privileged level allowed to raise it with `int`.
+	static InterruptGate make(const UINT8 *handler, UINT16 selector, UINT8 privilegeLevel = 0) {
+		auto offset = reinterpret_cast<UINTN>(handler);
+		return InterruptGate {
+			.offsetLow = static_cast<UINT16>(offset),
+			.selector = selector,
+			.ist = 0,
+			.attributes = static_cast<UINT8>(0x8E | (privilegeLevel << 5)),
+			.offsetMiddle = static_cast<UINT16>(offset >> 16),
+			.offsetHigh = static_cast<UINT32>(offset >> 32),
+			.reserved = 0
+		};
+	}
+
+	bool isPresent(void) const {
+		return attributes & 0x80;
+	}
+};
+static_assert(sizeof(InterruptGate) == 16);
+
+// GDT and IDT of bare code, to load on the BSP right after `ExitBootServices` and on every AP
+// The firmware tables and the handlers they point to sit in boot services memory, which the page frame allocator hands
+// out: `load` must come before it. Both tables live in the image, which is never reclaimed. The GDT has the layout of
+// the AP trampoline, so that one IDT fits every CPU.
+class DescriptorTables
+{
+public:
+	static inline constexpr UINT16 kernelCode = 0x08;
+	static inline constexpr UINT16 kernelData = 0x10;
+	static inline constexpr UINTN gateCount = 256;
+	static inline constexpr UINTN exceptionCount = 32;
+
+private:
+	// Accessed bits are preset, so that the CPU never writes to the table
+	static inline UINT64 s_gdt[3] { 0, 0x00AF9B000000FFFF, 0x00CF93000000FFFF };
+	alignas(16) static inline InterruptGate s_idt[gateCount];
+
+public:
+	// Exceptions go to `bareInterruptFault`, any other vector to `bareInterruptAcknowledge`
+	static void fillGates(InterruptGate *gates) {
+		for (UINTN i = 0; i < gateCount; i++)
+			gates[i] = InterruptGate::make(i < exceptionCount ? bareInterruptFault : bareInterruptAcknowledge, kernelCode);
+	}
+
+	// Loads `gdt` and reloads CS, DS, ES and SS from it, with code at `kernelCode` and data at `kernelData`
+	// FS and GS are left alone, loading them would drop the GS base `thisCpu` relies on.
+	static void loadGdt(const UINT64 *gdt, UINTN count) {
+		IA32_DESCRIPTOR gdtr;
+		gdtr.Base = reinterpret_cast<UINTN>(gdt);
+		gdtr.Limit = static_cast<UINT16>(count * sizeof(UINT64) - 1);
+		AsmWriteGdtr(&gdtr);
+		asm volatile(
+			"pushq %[code]\n"
+			"leaq 1f(%%rip), %%rax\n"
+			"pushq %%rax\n"
+			"lretq\n"
+			"1:\n"
+			"movl %[data], %%eax\n"
+			"movl %%eax, %%ds\n"
+			"movl %%eax, %%es\n"
+			"movl %%eax, %%ss\n"
+			: : [code] "i"(kernelCode), [data] "i"(kernelData) : "rax", "memory"
+		);
+	}
+
+	static IA32_DESCRIPTOR getIdtr(void) {
+		IA32_DESCRIPTOR res;
+		res.Base = reinterpret_cast<UINTN>(s_idt);
+		res.Limit = static_cast<UINT16>(sizeof(s_idt) - 1);
+		return res;
+	}
+
+	// On the BSP, with interrupts disabled for good
+	static void load(void) {
+		DisableInterrupts();
+		fillGates(s_idt);
+		loadGdt(s_gdt, sizeof(s_gdt) / sizeof(*s_gdt));
+		loadIdt();
+	}
+
+	// On APs, which run on the GDT of the trampoline
+	static void loadIdt(void) {
+		auto idtr = getIdtr();
+		AsmWriteIdtr(&idtr);
+	}
+};
+
+}
\ No newline at end of file
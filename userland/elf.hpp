@@ -0,0 +1,215 @@
+#pragma once
+
+extern "C" {
+
+#include <Uefi.h>
+#include <Library/BaseLib.h>
+#include <Library/BaseMemoryLib.h>
+
+}
+
+#include "bare.hpp"
+#include "frames.hpp"
+#include "paging.hpp"
+
+namespace bare {
+
+// Static ELF64 executable for ring 3, mapped in place out of the page-aligned buffer it was read into
+// Whole pages of PT_LOAD segments are mapped straight onto the buffer, only pages that a segment shares with its
+// neighbours in the file or with its zero-filled tail are copied into fresh frames. Segments must lie within
+// `AddressSpace::base` and the stack below its end, e.g. linked with `-static -nostdlib -mcmodel=large
+// -Wl,-Ttext-segment=0x7F8000000000`. Writable segments write into the buffer: map an image once only.
+class ElfImage
+{
+public:
+	// Gathered before `ExitBootServices`, see `boot::planPrograms`
+	struct Plan {
+		static inline constexpr UINTN maxProgramCount = 8;
+		static inline constexpr UINTN maxNameLength = 32;
+
+		struct Program {
+			CHAR16 name[maxNameLength];
+			// Allocated as `EfiLoaderData`
+			const UINT8 *data;
+			UINTN size;
+		};
+
+		UINTN programCount;
+		Program programs[maxProgramCount];
+		UINTN byteCount;
+		// TSC cycles spent opening and reading the files
+		UINT64 readCycles;
+	};
+
+	static inline constexpr UINTN stackSize = 64 * 1024;
+	static inline constexpr UINTN stackTop = AddressSpace::base + AddressSpace::size;
+
+private:
+	static inline constexpr UINT16 typeExecutable = 2;
+	static inline constexpr UINT16 machineX64 = 62;
+	static inline constexpr UINT32 segmentLoad = 1;
+	static inline constexpr UINT32 segmentExecutable = 1;
+	static inline constexpr UINT32 segmentWritable = 2;
+	static inline constexpr UINT32 msrEfer = 0xC0000080;
+	static inline constexpr UINT64 eferNoExecute = 1 << 11;
+
+	struct Header {
+		UINT8 ident[16];
+		UINT16 type;
+		UINT16 machine;
+		UINT32 version;
+		UINT64 entry;
+		UINT64 programHeaderOffset;
+		UINT64 sectionHeaderOffset;
+		UINT32 flags;
+		UINT16 headerSize;
+		UINT16 programHeaderSize;
+		UINT16 programHeaderCount;
+		UINT16 sectionHeaderSize;
+		UINT16 sectionHeaderCount;
+		UINT16 sectionNameIndex;
+	};
+	static_assert(sizeof(Header) == 64);
+
+	struct ProgramHeader {
+		UINT32 type;
+		UINT32 flags;
+		UINT64 offset;
+		UINT64 address;
+		UINT64 physicalAddress;
+		UINT64 fileSize;
+		UINT64 memorySize;
+		UINT64 alignment;
+	};
+	static_assert(sizeof(ProgramHeader) == 56);
+
+	const UINT8 *m_data;
+	UINTN m_size;
+	bool m_isValid = false;
+	UINTN m_inPlacePageCount = 0;
+	UINTN m_copiedPageCount = 0;
+
+	const Header& getHeader(void) const {
+		return *reinterpret_cast<const Header*>(m_data);
+	}
+
+	const ProgramHeader& getProgramHeader(UINTN index) const {
+		auto &header = getHeader();
+		return *reinterpret_cast<const ProgramHeader*>(m_data + header.programHeaderOffset + index * header.programHeaderSize);
+	}
+
+	bool validate(void) const {
+		static constexpr UINT8 ident[] { 0x7F, 'E', 'L', 'F', 2, 1, 1 };
+		if (m_size < sizeof(Header) || (reinterpret_cast<UINTN>(m_data) & EFI_PAGE_MASK) != 0 || CompareMem(m_data, ident, sizeof(ident)) != 0)
+			return false;
+		auto &header = getHeader();
+		if (header.type != typeExecutable || header.machine != machineX64 || header.programHeaderSize < sizeof(ProgramHeader))
+			return false;
+		if (header.programHeaderOffset > m_size || header.programHeaderCount > (m_size - header.programHeaderOffset) / header.programHeaderSize)
+			return false;
+
+		// Segments come sorted by address, and may not share pages as they get mapped with permissions of their own
+		UINTN previousEnd = AddressSpace::base;
+		UINTN segmentCount = 0;
+		for (UINTN i = 0; i < header.programHeaderCount; i++) {
+			auto &segment = getProgramHeader(i);
+			if (segment.type != segmentLoad || segment.memorySize == 0)
+				continue;
+			if (segment.fileSize > segment.memorySize || segment.offset > m_size || segment.fileSize > m_size - segment.offset)
+				return false;
+			if (((segment.address ^ segment.offset) & EFI_PAGE_MASK) != 0)
+				return false;
+			auto begin = segment.address & ~static_cast<UINT64>(EFI_PAGE_MASK);
+			if (begin < previousEnd || segment.address > stackTop - stackSize || segment.memorySize > stackTop - stackSize - segment.address)
+				return false;
+			previousEnd = (segment.address + segment.memorySize + EFI_PAGE_MASK) & ~static_cast<UINT64>(EFI_PAGE_MASK);
+			segmentCount++;
+		}
+		return segmentCount > 0 && header.entry >= AddressSpace::base && header.entry < previousEnd;
+	}
+
+public:
+	ElfImage(const void *data, UINTN size) :
+		m_data(reinterpret_cast<const UINT8*>(data)),
+		m_size(size)
+	{
+		m_isValid = validate();
+	}
+
+	bool isValid(void) const {
+		return m_isValid;
+	}
+
+	UINTN getEntry(void) const {
+		return getHeader().entry;
+	}
+
+	// Pages of the buffer mapped by `map`, and pages it had to copy or zero
+	UINTN getInPlacePageCount(void) const {
+		return m_inPlacePageCount;
+	}
+
+	UINTN getCopiedPageCount(void) const {
+		return m_copiedPageCount;
+	}
+
+	// Maps the segments into `space` with their permissions, no-execute only when EFER.NXE is set, and a stack of
+	// `stackSize` bytes ending at `stackTop`. Returns false once page frames ran out.
+	bool map(AddressSpace &space, SharedPageFrames &pageFrames) {
+		if (!m_isValid)
+			return false;
+		auto &tables = space.getTables();
+		auto noExecute = AsmReadMsr64(msrEfer) & eferNoExecute ? PageTables::noExecute : 0;
+		auto &header = getHeader();
+		for (UINTN i = 0; i < header.programHeaderCount; i++) {
+			auto &segment = getProgramHeader(i);
+			if (segment.type != segmentLoad || segment.memorySize == 0)
+				continue;
+			auto flags = PageTables::user | (segment.flags & segmentWritable ? PageTables::writable : 0) | (segment.flags & segmentExecutable ? 0 : noExecute);
+			auto fileBegin = segment.address;
+			auto fileEnd = segment.address + segment.fileSize;
+			auto end = (segment.address + segment.memorySize + EFI_PAGE_MASK) & ~static_cast<UINTN>(EFI_PAGE_MASK);
+
+			// Runs of whole pages go in one call, so that tables get changed and flushed once per run
+			UINTN runBegin = 0;
+			UINTN runEnd = 0;
+			auto flushRun = [&]() {
+				if (runEnd > runBegin)
+					tables.map(runBegin, reinterpret_cast<UINTN>(m_data) + segment.offset + (runBegin - segment.address), runEnd - runBegin, flags);
+				m_inPlacePageCount += (runEnd - runBegin) / EFI_PAGE_SIZE;
+				runBegin = runEnd = 0;
+			};
+			for (auto page = segment.address & ~static_cast<UINTN>(EFI_PAGE_MASK); page < end; page += EFI_PAGE_SIZE) {
+				if (page >= fileBegin && page + EFI_PAGE_SIZE <= fileEnd) {
+					if (runEnd != page) {
+						flushRun();
+						runBegin = page;
+					}
+					runEnd = page + EFI_PAGE_SIZE;
+					continue;
+				}
+				flushRun();
+				auto frame = reinterpret_cast<UINT8*>(pageFrames.allocate(0));
+				if (frame == nullptr)
+					return false;
+				SetMem(frame, EFI_PAGE_SIZE, 0);
+				auto copyBegin = page > fileBegin ? page : fileBegin;
+				auto copyEnd = page + EFI_PAGE_SIZE < fileEnd ? page + EFI_PAGE_SIZE : fileEnd;
+				if (copyEnd > copyBegin)
+					CopyMem(frame + (copyBegin - page), m_data + segment.offset + (copyBegin - segment.address), copyEnd - copyBegin);
+				tables.map(page, reinterpret_cast<UINTN>(frame), EFI_PAGE_SIZE, flags);
+				m_copiedPageCount++;
+			}
+			flushRun();
+		}
+
+		auto stack = pageFrames.allocate(PageFrameAllocator::getOrder(stackSize));
+		if (stack == nullptr)
+			return false;
+		SetMem(stack, stackSize, 0);
+		tables.map(stackTop - stackSize, reinterpret_cast<UINTN>(stack), stackSize, PageTables::user | PageTables::writable | noExecute);
+		return true;
+	}
+};
+
+}
\ No newline at end of file
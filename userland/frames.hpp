@@ -0,0 +1,271 @@
+#pragma once
+
+extern "C" {
+
+#include <Uefi.h>
+#include <Library/BaseLib.h>
+#include <Library/BaseMemoryLib.h>
+
+}
+
+#include "bare.hpp"
+
+namespace bare {
+
+// Binary buddy allocator of physical page frames, from single 4KiB pages up to 1GiB blocks
+// Blocks are naturally aligned on their size, so that order `order2MiB` and `order1GiB` blocks can back huge pages.
+// Free blocks are linked through their own first bytes, which relies on physical memory being identity-mapped, and one
+// byte of state per frame tells whether the buddy of a freed block is free as well: allocate and free are O(log n).
+class PageFrameAllocator
+{
+public:
+	static inline constexpr UINTN pageShift = 12;
+	static inline constexpr UINTN maxOrder = 18;
+	static inline constexpr UINTN order2MiB = 9;
+	static inline constexpr UINTN order1GiB = 18;
+
+	// Gathered before `ExitBootServices`, see `boot::planPageFrames` and `boot::capturePageFrames`
+	struct Plan {
+		static inline constexpr UINTN maxRangeCount = 256;
+
+		struct Range {
+			UINTN base;
+			UINTN pageCount;
+		};
+
+		// One state byte per frame below `frameCount`, allocated as `EfiLoaderData`
+		UINT8 *frameStates;
+		UINTN frameCount;
+		// Usable ranges, frames still in use by the firmware were already marked reserved in `frameStates`
+		UINTN rangeCount;
+		Range ranges[maxRangeCount];
+		// Pages of descriptors that didn't fit in `ranges`, and are lost
+		UINTN droppedPageCount;
+	};
+
+	static inline constexpr UINT8 stateUsed = 0x00;
+	static inline constexpr UINT8 stateAllocatedHead = 0x40;
+	static inline constexpr UINT8 stateFreeHead = 0x80;
+	static inline constexpr UINT8 stateReserved = 0xFF;
+
+private:
+	struct FreeBlock {
+		FreeBlock *next;
+		FreeBlock *prev;
+	};
+
+	UINT8 *m_frameStates;
+	UINTN m_frameCount;
+	// Circular lists with a sentinel each, so that unlinking never checks for ends
+	FreeBlock m_freeLists[maxOrder + 1];
+	// Bit n is set when `m_freeLists[n]` isn't empty
+	UINT32 m_nonEmptyOrders = 0;
+	UINTN m_freePageCount = 0;
+
+	UINTN getFrame(const void *block) const {
+		return reinterpret_cast<UINTN>(block) >> pageShift;
+	}
+
+	FreeBlock* getBlock(UINTN frame) const {
+		return reinterpret_cast<FreeBlock*>(frame << pageShift);
+	}
+
+	void pushFree(UINTN frame, UINTN order) {
+		auto &list = m_freeLists[order];
+		auto block = getBlock(frame);
+		block->next = list.next;
+		block->prev = &list;
+		list.next->prev = block;
+		list.next = block;
+		m_nonEmptyOrders |= 1 << order;
+		m_frameStates[frame] = stateFreeHead | order;
+		m_freePageCount += static_cast<UINTN>(1) << order;
+	}
+
+	void unlinkFree(UINTN frame, UINTN order) {
+		auto block = getBlock(frame);
+		block->prev->next = block->next;
+		block->next->prev = block->prev;
+		if (m_freeLists[order].next == &m_freeLists[order])
+			m_nonEmptyOrders &= ~(1 << order);
+		m_frameStates[frame] = stateUsed;
+		m_freePageCount -= static_cast<UINTN>(1) << order;
+	}
+
+	// Merges with free buddies for as long as there are some
+	void freeBlock(UINTN frame, UINTN order) {
+		while (order < maxOrder) {
+			auto buddy = frame ^ (static_cast<UINTN>(1) << order);
+			if (buddy + (static_cast<UINTN>(1) << order) > m_frameCount || m_frameStates[buddy] != (stateFreeHead | order))
+				break;
+			unlinkFree(buddy, order);
+			frame &= ~(static_cast<UINTN>(1) << order);
+			order++;
+		}
+		pushFree(frame, order);
+	}
+
+	// Hands frames [frame, frame + count) over as the largest aligned blocks fitting
+	void addFrames(UINTN frame, UINTN count) {
+		while (count > 0) {
+			UINTN order = frame == 0 ? maxOrder : __builtin_ctzll(frame);
+			if (order > maxOrder)
+				order = maxOrder;
+			while ((static_cast<UINTN>(1) << order) > count)
+				order--;
+			freeBlock(frame, order);
+			frame += static_cast<UINTN>(1) << order;
+			count -= static_cast<UINTN>(1) << order;
+		}
+	}
+
+public:
+	// Takes every usable frame of `plan` but frame 0, whose address would read as nullptr
+	PageFrameAllocator(const Plan &plan) :
+		m_frameStates(plan.frameStates),
+		m_frameCount(plan.frameCount)
+	{
+		for (auto &list : m_freeLists)
+			list.next = list.prev = &list;
+
+		for (UINTN i = 0; i < plan.rangeCount; i++) {
+			auto begin = plan.ranges[i].base >> pageShift;
+			auto end = begin + plan.ranges[i].pageCount;
+			if (begin == 0)
+				begin = 1;
+			if (end > m_frameCount)
+				end = m_frameCount;
+			// Reserved frames are few: page tables of the firmware, split the range around them
+			for (auto frame = begin; frame < end;) {
+				if (m_frameStates[frame] == stateReserved) {
+					frame++;
+					continue;
+				}
+				auto runEnd = frame;
+				while (runEnd < end && m_frameStates[runEnd] != stateReserved)
+					runEnd++;
+				addFrames(frame, runEnd - frame);
+				frame = runEnd;
+			}
+		}
+	}
+
+	// Returns a block of `4KiB << order` bytes aligned on its size, or nullptr when none is left
+	void* allocate(UINTN order) {
+		if (order > maxOrder)
+			return nullptr;
+		auto candidates = m_nonEmptyOrders & ~((static_cast<UINT32>(1) << order) - 1);
+		if (candidates == 0)
+			return nullptr;
+		UINTN current = __builtin_ctz(candidates);
+		auto frame = getFrame(m_freeLists[current].next);
+		unlinkFree(frame, current);
+		// Hands the upper halves back until the block has the right size
+		while (current > order) {
+			current--;
+			pushFree(frame + (static_cast<UINTN>(1) << current), current);
+		}
+		m_frameStates[frame] = stateAllocatedHead | order;
+		return getBlock(frame);
+	}
+
+	// Smallest order holding `size` bytes
+	static UINTN getOrder(UINTN size) {
+		UINTN order = 0;
+		while ((static_cast<UINTN>(1) << (order + pageShift)) < size)
+			order++;
+		return order;
+	}
+
+	// `block` must come from `allocate`, its order is remembered
+	void free(void *block) {
+		auto frame = getFrame(block);
+		auto order = m_frameStates[frame] & ~stateAllocatedHead;
+		freeBlock(frame, order);
+	}
+
+	UINTN getFreePageCount(void) const {
+		return m_freePageCount;
+	}
+
+	// Number of free blocks of exactly `order`
+	UINTN getFreeBlockCount(UINTN order) const {
+		UINTN res = 0;
+		for (auto block = m_freeLists[order].next; block != &m_freeLists[order]; block = block->next)
+			res++;
+		return res;
+	}
+
+	// Allocates then frees `count` blocks of each order in `orders`, frees happen in a scrambled order so that
+	// blocks coalesce back through every level. Fn is a `void (UINTN order, UINTN count, UINT64 allocationsPerSecond,
+	// UINT64 freesPerSecond)`, `count` is lower than requested when memory ran out.
+	template <typename Fn>
+	void benchmark(const Clock &clock, const UINTN *orders, UINTN orderCount, UINTN count, Fn &&fn) {
+		auto blocksOrder = getOrder(count * sizeof(void*));
+		auto blocks = reinterpret_cast<void**>(allocate(blocksOrder));
+		if (blocks == nullptr)
+			return;
+
+		for (UINTN i = 0; i < orderCount; i++) {
+			auto begin = clock.now();
+			UINTN allocatedCount = 0;
+			for (; allocatedCount < count; allocatedCount++) {
+				blocks[allocatedCount] = allocate(orders[i]);
+				if (blocks[allocatedCount] == nullptr)
+					break;
+			}
+			auto allocationCycles = clock.now() - begin;
+
+			// Strides through the blocks with a step coprime with their count
+			auto isCoprime = [](UINTN a, UINTN b) {
+				while (b != 0) {
+					auto r = a % b;
+					a = b;
+					b = r;
+				}
+				return a == 1;
+			};
+			auto step = allocatedCount / 2 + 1;
+			while (step > 1 && !isCoprime(allocatedCount, step))
+				step--;
+			begin = clock.now();
+			for (UINTN j = 0, k = 0; j < allocatedCount; j++, k = (k + step) % allocatedCount)
+				free(blocks[k]);
+			auto freeCycles = clock.now() - begin;
+
+			auto perSecond = [&clock, allocatedCount](UINT64 cycles) {
+				return cycles > 0 ? allocatedCount * clock.getTscFrequency() / cycles : 0;
+			};
+			fn(orders[i], allocatedCount, perSecond(allocationCycles), perSecond(freeCycles));
+		}
+		free(blocks);
+	}
+};
+
+// `PageFrameAllocator` behind a lock, for allocators refilling from any CPU
+class SharedPageFrames
+{
+	PageFrameAllocator &m_pageFrames;
+	SpinLock m_lock;
+
+public:
+	SharedPageFrames(PageFrameAllocator &pageFrames) :
+		m_pageFrames(pageFrames)
+	{
+	}
+
+	void* allocate(UINTN order) {
+		m_lock.lock();
+		auto res = m_pageFrames.allocate(order);
+		m_lock.unlock();
+		return res;
+	}
+
+	void free(void *block) {
+		m_lock.lock();
+		m_pageFrames.free(block);
+		m_lock.unlock();
+	}
+};
+
+}
\ No newline at end of file
@@ -0,0 +1,282 @@
+#pragma once
+
+extern "C" {
+
+#include <Uefi.h>
+#include <Library/BaseLib.h>
+
+}
+
+#include "bare.hpp"
+#include "smp.hpp"
+#include <type_traits>
+
+namespace bare {
+
+class JobSystem;
+
+struct Job
+{
+	void (*function)(Job &job, JobSystem &jobSystem);
+	void *context;
+	UINTN argument;
+	// Decremented once `function` returned, may be nullptr
+	UINTN *pendingCount;
+};
+
+// Chase-Lev work-stealing deque, with the C11 orderings of Lê et al. and a fixed capacity
+// Only its owner pushes and pops at the bottom, any other CPU may steal from the top.
+class JobDeque
+{
+public:
+	static inline constexpr INT64 capacity = 4096;
+
+private:
+	// Stealers only write `m_top` and the owner mostly writes `m_bottom`: keep them on separate cache lines
+	alignas(64) INT64 m_top;
+	alignas(64) INT64 m_bottom;
+	Job *m_jobs[capacity];
+
+public:
+	// Deques live in raw memory from a `BumpAllocator`, only call this while nobody else uses the deque
+	void reset(void) {
+		m_top = 0;
+		m_bottom = 0;
+	}
+
+	// Returns false when the deque is full, the caller then runs the job itself
+	bool push(Job *job) {
+		auto bottom = __atomic_load_n(&m_bottom, __ATOMIC_RELAXED);
+		auto top = __atomic_load_n(&m_top, __ATOMIC_ACQUIRE);
+		if (bottom - top >= capacity)
+			return false;
+		__atomic_store_n(&m_jobs[bottom % capacity], job, __ATOMIC_RELAXED);
+		__atomic_thread_fence(__ATOMIC_RELEASE);
+		__atomic_store_n(&m_bottom, bottom + 1, __ATOMIC_RELAXED);
+		return true;
+	}
+
+	Job* pop(void) {
+		auto bottom = __atomic_load_n(&m_bottom, __ATOMIC_RELAXED) - 1;
+		__atomic_store_n(&m_bottom, bottom, __ATOMIC_RELAXED);
+		__atomic_thread_fence(__ATOMIC_SEQ_CST);
+		auto top = __atomic_load_n(&m_top, __ATOMIC_RELAXED);
+		if (top > bottom) {
+			__atomic_store_n(&m_bottom, bottom + 1, __ATOMIC_RELAXED);
+			return nullptr;
+		}
+
+		auto job = __atomic_load_n(&m_jobs[bottom % capacity], __ATOMIC_RELAXED);
+		if (top == bottom) {
+			// Last job: race the stealers for it
+			if (!__atomic_compare_exchange_n(&m_top, &top, top + 1, false, __ATOMIC_SEQ_CST, __ATOMIC_RELAXED))
+				job = nullptr;
+			__atomic_store_n(&m_bottom, bottom + 1, __ATOMIC_RELAXED);
+		}
+		return job;
+	}
+
+	Job* steal(void) {
+		auto top = __atomic_load_n(&m_top, __ATOMIC_ACQUIRE);
+		__atomic_thread_fence(__ATOMIC_SEQ_CST);
+		auto bottom = __atomic_load_n(&m_bottom, __ATOMIC_ACQUIRE);
+		if (top >= bottom)
+			return nullptr;
+
+		auto job = __atomic_load_n(&m_jobs[top % capacity], __ATOMIC_RELAXED);
+		if (!__atomic_compare_exchange_n(&m_top, &top, top + 1, false, __ATOMIC_SEQ_CST, __ATOMIC_RELAXED))
+			return nullptr;
+		return job;
+	}
+};
+
+// Work-stealing scheduler with one deque per CPU, indexed by `PerCpu::index`
+// CPU 0 (the BSP) submits work and helps while waiting, the APs run `workerLoop` forever.
+class JobSystem
+{
+	struct alignas(64) Worker {
+		JobDeque deque;
+		UINT64 randomState;
+	};
+
+	Worker *m_workers;
+	UINTN m_workerCount;
+	// Workers at or above this index neither run nor get stolen from, to measure scaling
+	UINTN m_activeCount;
+
+	static void execute(Job &job, JobSystem &jobSystem) {
+		auto pendingCount = job.pendingCount;
+		job.function(job, jobSystem);
+		if (pendingCount != nullptr)
+			__atomic_fetch_sub(pendingCount, 1, __ATOMIC_RELEASE);
+	}
+
+	Job* stealFrom(Worker &self, UINTN activeCount) {
+		// xorshift64 victim pick, so that thieves don't all pile onto the same deque
+		auto &state = self.randomState;
+		state ^= state << 13;
+		state ^= state >> 7;
+		state ^= state << 17;
+		auto first = state % activeCount;
+		for (UINTN i = 0; i < activeCount; i++) {
+			auto &victim = m_workers[(first + i) % activeCount];
+			if (&victim == &self)
+				continue;
+			auto job = victim.deque.steal();
+			if (job != nullptr)
+				return job;
+		}
+		return nullptr;
+	}
+
+	// Returns false when no job could be found
+	bool runOne(UINTN index) {
+		auto &self = m_workers[index];
+		auto job = self.deque.pop();
+		if (job == nullptr)
+			job = stealFrom(self, __atomic_load_n(&m_activeCount, __ATOMIC_RELAXED));
+		if (job == nullptr)
+			return false;
+		execute(*job, *this);
+		return true;
+	}
+
+public:
+	// Carves one deque per CPU out of `allocator`, `workerCount` includes the BSP
+	JobSystem(UINTN workerCount, BumpAllocator &allocator) :
+		m_workers(allocator.allocateArray<Worker>(workerCount)),
+		m_workerCount(workerCount),
+		m_activeCount(1)
+	{
+		for (UINTN i = 0; i < m_workerCount; i++) {
+			m_workers[i].deque.reset();
+			m_workers[i].randomState = 0x9E3779B97F4A7C15 * (i + 1);
+		}
+	}
+
+	UINTN getWorkerCount(void) const {
+		return m_workerCount;
+	}
+
+	// Clamped to [1, getWorkerCount()], only change it while no job is pending
+	void setActiveCount(UINTN activeCount) {
+		if (activeCount < 1)
+			activeCount = 1;
+		if (activeCount > m_workerCount)
+			activeCount = m_workerCount;
+		__atomic_store_n(&m_activeCount, activeCount, __ATOMIC_RELAXED);
+	}
+
+	// Entry point of the APs, see `Smp::start`
+	[[noreturn]] static void workerLoop(PerCpu &cpu, void *context) {
+		auto &self = *reinterpret_cast<JobSystem*>(context);
+		while (true) {
+			if (cpu.index >= __atomic_load_n(&self.m_activeCount, __ATOMIC_RELAXED) || !self.runOne(cpu.index))
+				CpuPause();
+		}
+	}
+
+	// `job` must stay alive until its pending count drops, it runs right away when the deque of this CPU is full
+	void submit(Job &job) {
+		if (!m_workers[thisCpu().index].deque.push(&job))
+			execute(job, *this);
+	}
+
+	// Runs jobs of this CPU or steals some until `pendingCount` drops to zero
+	void wait(const UINTN &pendingCount) {
+		auto index = thisCpu().index;
+		while (__atomic_load_n(&pendingCount, __ATOMIC_ACQUIRE) != 0)
+			if (!runOne(index))
+				CpuPause();
+	}
+
+	// Calls `fn(i)` for every i in [0, count), in batches of `grain` iterations spread across the active CPUs
+	template <typename Fn>
+	void parallelFor(UINTN count, UINTN grain, Fn &&fn) {
+		static constexpr UINTN maxBatchCount = 256;
+		auto batchCount = (count + grain - 1) / grain;
+		if (batchCount > maxBatchCount) {
+			batchCount = maxBatchCount;
+			grain = (count + batchCount - 1) / batchCount;
+			batchCount = (count + grain - 1) / grain;
+		}
+
+		struct Range {
+			std::remove_reference_t<Fn> *fn;
+			UINTN count;
+			UINTN grain;
+		} range { &fn, count, grain };
+		Job jobs[maxBatchCount];
+		UINTN pendingCount = batchCount;
+		for (UINTN i = 0; i < batchCount; i++) {
+			jobs[i] = Job {
+				.function = [](Job &job, JobSystem&) {
+					auto &range = *reinterpret_cast<Range*>(job.context);
+					auto begin = job.argument * range.grain;
+					auto end = begin + range.grain < range.count ? begin + range.grain : range.count;
+					for (auto j = begin; j < end; j++)
+						(*range.fn)(j);
+				},
+				.context = &range,
+				.argument = i,
+				.pendingCount = &pendingCount
+			};
+			submit(jobs[i]);
+		}
+		wait(pendingCount);
+	}
+
+	// Runs an implicit fork-join binary tree of `2 * leafCount - 1` tiny jobs on 1 to `maxCpuCount` CPUs
+	// `maxCpuCount` is usually `Smp::getOnlineCount`. Fn is a `void (UINTN cpuCount, UINTN jobsPerSecond)`, called
+	// after each run. Must be called from the BSP.
+	template <typename Fn>
+	void benchmark(UINTN tscFrequency, UINTN maxCpuCount, UINTN leafCount, Fn &&fn) {
+		// Node i has children 2i + 1 and 2i + 2, the last `leafCount` nodes are leaves
+		static constexpr auto forkJoinNode = [](Job &job, JobSystem &jobSystem) {
+			auto leafCount = *reinterpret_cast<const UINTN*>(job.context);
+			if (job.argument >= leafCount - 1) {
+				UINT64 state = job.argument + 1;
+				for (UINTN i = 0; i < 64; i++) {
+					state ^= state << 13;
+					state ^= state >> 7;
+					state ^= state << 17;
+				}
+				asm volatile("" : : "r"(state));
+				return;
+			}
+
+			UINTN pendingCount = 2;
+			Job children[2];
+			for (UINTN i = 0; i < 2; i++)
+				children[i] = Job {
+					.function = job.function,
+					.context = job.context,
+					.argument = job.argument * 2 + 1 + i,
+					.pendingCount = &pendingCount
+				};
+			jobSystem.submit(children[1]);
+			execute(children[0], jobSystem);
+			jobSystem.wait(pendingCount);
+		};
+
+		if (maxCpuCount > m_workerCount)
+			maxCpuCount = m_workerCount;
+		for (UINTN cpuCount = 1; cpuCount <= maxCpuCount; cpuCount++) {
+			setActiveCount(cpuCount);
+
+			Job root {
+				.function = forkJoinNode,
+				.context = &leafCount,
+				.argument = 0,
+				.pendingCount = nullptr
+			};
+			auto begin = AsmReadTsc();
+			execute(root, *this);
+			auto cycles = AsmReadTsc() - begin;
+			fn(cpuCount, (2 * leafCount - 1) * tscFrequency / cycles);
+		}
+		setActiveCount(m_workerCount);
+	}
+};
+
+}
\ No newline at end of file
@@ -1,5 +1,16 @@
 #include "boot.hpp"
 #include "bare.hpp"
+#include "mp.hpp"
+#include "terminal.hpp"
+#include "jobs.hpp"
+#include "descriptors.hpp"
+#include "timer.hpp"
+#include "slab.hpp"
+#include "tsc.hpp"
+#include "usermode.hpp"
+#include "rings.hpp"
+#include "timepage.hpp"
+#include "elf.hpp"
 
 extern "C" {
 
@@ -21,84 +32,319 @@ EFI_STATUS EFIAPI UefiMain(IN EFI_HANDLE ImageHandle, IN EFI_SYSTEM_TABLE *Syste
 {
 	bootEfiAssert(ShellInitialize());
 
-	boot::printControlRegisters();
-	auto conventionalMemory = boot::findConventionalMemory();
-	Print(bootUToC16(u"Conventional memory found at 0x%Lx: %,Ld bytes, attributes = 0x%Lx\n"),
-		conventionalMemory.PhysicalStart, conventionalMemory.NumberOfPages * static_cast<UINTN>(1 << 12), conventionalMemory.Attribute
-	);
+	auto smpPlan = boot::planSmp(boot::MpServices::query());
+	Print(bootUToC16(u"%Lu AP(s) to start after ExitBootServices, trampoline at 0x%Lx\n"), smpPlan.apCount, smpPlan.trampolinePage);
+	// Allocated rather than carved out of free memory, so that page frames reclaimed after ExitBootServices can't overlap it
+	EFI_PHYSICAL_ADDRESS backbuffer;
+	bootEfiAssert(gBS->AllocatePages(AllocateAnyPages, EfiLoaderData, EFI_SIZE_TO_PAGES(1 << 24), &backbuffer));
+	auto memoryMap = boot::MemoryMapSnapshot();
+	auto pageFramePlan = boot::planPageFrames(memoryMap);
+	Print(bootUToC16(u"Backbuffer at 0x%Lx, page frame states for %,Lu frames at 0x%p\n"), backbuffer, pageFramePlan.frameCount, pageFramePlan.frameStates);
+	if (auto largestFreeRange = memoryMap.getLargestFreeRange())
+		Print(bootUToC16(u"Largest free range at 0x%Lx: %,Lu bytes\n"), largestFreeRange->begin, largestFreeRange->end - largestFreeRange->begin);
 
-	boot::printMemoryTotals();
+	boot::printMemoryTotals(memoryMap);
 
 	//Print(bootUToC16(u"Press any key to show conventional memory descriptors..\n"));
 	//ShellPromptForResponse(ShellPromptResponseTypeAnyKeyContinue, nullptr, nullptr);
 	// Pruning less than 1MiB descriptors
-	//bootPrintMemoryTypeDescriptors(EfiConventionalMemory, static_cast<EFI_MEMORY_TYPE>(EfiConventionalMemory + 1), 0xFF);
+	//boot::printMemoryTypeDescriptors(memoryMap, EfiConventionalMemory, static_cast<EFI_MEMORY_TYPE>(EfiConventionalMemory + 1), 0xFF);
+
+	//boot::printMemoryTypeDescriptors(memoryMap, static_cast<EFI_MEMORY_TYPE>(0), EfiMaxMemoryType, 0x04);
 
-	//bootPrintMemoryTypeDescriptors(static_cast<EFI_MEMORY_TYPE>(0), EfiMaxMemoryType, 0x04);
+	auto tscCalibration = boot::TscCalibrator::calibrate();
+	auto tscFreq = tscCalibration.frequency;
+	tscCalibration.print();
 
-	auto tscFreq = boot::estimateTscFrequency();
+	auto programPlan = boot::planPrograms(bootUToC16(u"programs"));
+	Print(bootUToC16(u"%Lu ring 3 program(s) read from \\programs, %,Lu bytes in %,Lu us (%,Lu us/MiB)\n"),
+		programPlan.programCount, programPlan.byteCount, programPlan.readCycles * 1000000 / tscFreq,
+		programPlan.byteCount > 0 ? programPlan.readCycles * 1000000 / tscFreq * (1 << 20) / programPlan.byteCount : 0
+	);
 
 	Print(bootUToC16(u"Press any key to move ahead with graphical setup..\n"));
 	ShellPromptForResponse(ShellPromptResponseTypeAnyKeyContinue, nullptr, nullptr);
 
-	auto graphicsOutput = boot::GraphicsOutputProtocol::query().toBareGraphics(1 << 24, reinterpret_cast<void*>(conventionalMemory.PhysicalStart));
+	auto anyGraphicsOutput = boot::GraphicsOutputProtocol::query().toBareGraphics(1 << 24, reinterpret_cast<void*>(backbuffer));
+	{
+		auto &graphicsOutput = anyGraphicsOutput.getBase();
+		Print(bootUToC16(u"Rendering with %s span kernels\n"), graphicsOutput.getKernelsName());
+		boot::printControlRegisters(graphicsOutput.getDisplayFramebuffer());
+
+		// Zero is black in every supported pixel format
+		graphicsOutput.fillRect(0, 0, graphicsOutput.getWidth(), graphicsOutput.getHeight(), 0);
+		graphicsOutput.calibratePresent(tscFreq);
+		graphicsOutput.getPresentBackend().iterateBandwidths([](const CHAR16 *strategyName, UINTN bandwidth) {
+			Print(bootUToC16(u"Present strategy %s: %,Lu MB/s\n"), strategyName, bandwidth);
+		});
+		Print(bootUToC16(u"Presenting with %s (%,Lu MB/s)\n"), graphicsOutput.getPresentBackend().getStrategyName(), graphicsOutput.getPresentBackend().getBandwidth());
+	}
 
-	Print(bootUToC16(u"Done! Press any key to test out runtime rendering, then shut down your machine in 15 seconds..\n"));
+	Print(bootUToC16(u"Press any key to benchmark multi-core tiled rendering..\n"));
 	ShellPromptForResponse(ShellPromptResponseTypeAnyKeyContinue, nullptr, nullptr);
 
-	bootEfiAssert(SystemTable->BootServices->ExitBootServices(ImageHandle, boot::getMemoryMapKey()));
-
-	for (UINTN it = 0; it < 60 * 15; it++) {
-
-		union Pixel {
-			struct {
-				UINT8 r, g, b;
-			} comps;
-			struct {
-				UINT8 values[3];
-			} vector;
-		};
-
-		auto getPixel = [](UINTN it, UINTN x, UINTN y) -> Pixel {
-			return (((x + it) / 8) ^ ((y + it * 3) / 16)) & 1 ?
-				Pixel{
-					.comps{
-						.r = 0xFF,
-						.g = static_cast<UINT8>((x + it) & 0xFF),
-						.b = 0xFF
+	{
+		auto tiledRenderer = boot::TiledRenderer(boot::MpServices::query());
+		Print(bootUToC16(u"Rendering 60 frames on 1 to %Lu cores..\n"), tiledRenderer.getCpuCount());
+		anyGraphicsOutput.visit([&tiledRenderer, tscFreq](auto &graphicsOutput) {
+			tiledRenderer.benchmark(graphicsOutput, tscFreq, 60, [&graphicsOutput](UINTN it, UINTN top, UINTN bottom) {
+				for (UINTN i = top; i < bottom; i++) {
+					auto scanline = graphicsOutput.getScanline(i);
+					for (UINTN j = 0; j < graphicsOutput.getWidth(); j++) {
+						scanline[j] = (((j + it) / 8) ^ ((i + it * 3) / 16)) & 1 ?
+							graphicsOutput.packPixel(0xFF, static_cast<UINT8>((j + it) & 0xFF), 0xFF) :
+							graphicsOutput.packPixel(0x80, static_cast<UINT8>(0x80 + (i + it * 3) / 64), 0xFF);
 					}
-				} : Pixel{
-					.comps{
-						.r = 0x80,
-						.g = static_cast<UINT8>(0x80 + (y + it * 3) / 64),
-						.b = 0xFF
-					}
-				};
-		};
-
-		if (graphicsOutput.getPixelFormat() == PixelRedGreenBlueReserved8BitPerColor) {
-			for (UINTN i = 0; i < graphicsOutput.getHeight(); i++) {
-				auto scanline = graphicsOutput.getPixelOffset(0, i);
-				for (UINTN j = 0; j < graphicsOutput.getWidth(); j++) {
-					auto pixel = getPixel(it, j, i);
-					for (UINTN k = 0; k < 3; k++)
-						scanline[j * 4 + k] = pixel.vector.values[k];
 				}
+			});
+		});
+	}
+
+	Print(bootUToC16(u"Done! Press any key to start the APs and benchmark the job system, then test out runtime rendering and shut down your machine..\n"));
+	ShellPromptForResponse(ShellPromptResponseTypeAnyKeyContinue, nullptr, nullptr);
+
+	// Nothing may be allocated from here on, or the map key goes stale
+	memoryMap.capture();
+	boot::capturePageFrames(pageFramePlan, memoryMap);
+	auto physicalEnd = memoryMap.getEnd();
+	bootEfiAssert(SystemTable->BootServices->ExitBootServices(ImageHandle, memoryMap.getMapKey()));
+
+	anyGraphicsOutput.visit([&smpPlan, &pageFramePlan, &programPlan, physicalEnd, tscFreq](auto &graphicsOutput) {
+		auto terminal = bare::Terminal(graphicsOutput, graphicsOutput.packPixel(0xFF, 0xFF, 0xFF), 0);
+		auto clock = bare::Clock(tscFreq);
+		// Before any page frame is handed out, as the firmware tables point into boot services memory
+		bare::DescriptorTables::load();
+
+		// The firmware page tables may map boot services code read-only, yet free blocks get linked through their first bytes
+		static constexpr UINTN cr0WriteProtect = 1 << 16;
+		AsmWriteCr0(AsmReadCr0() & ~cr0WriteProtect);
+		auto pageFrames = bare::PageFrameAllocator(pageFramePlan);
+		terminal.print(bootUToC16(u"%,Lu MiB of page frames reclaimed, %,Lu MiB lost to a full range table\n"),
+			pageFrames.getFreePageCount() >> 8, pageFramePlan.droppedPageCount >> 8
+		);
+		{
+			static constexpr UINTN orders[] { 0, bare::PageFrameAllocator::order2MiB, bare::PageFrameAllocator::order1GiB };
+			pageFrames.benchmark(clock, orders, sizeof(orders) / sizeof(*orders), 4096, [&terminal](UINTN order, UINTN count, UINT64 allocationsPerSecond, UINT64 freesPerSecond) {
+				terminal.print(bootUToC16(u"%,Lu blocks of %,Lu KiB: %,Lu allocations/s, %,Lu frees/s\n"), count, static_cast<UINTN>(4) << order, allocationsPerSecond, freesPerSecond);
+			});
+		}
+
+		auto sharedPageFrames = bare::SharedPageFrames(pageFrames);
+		// Identity map of memory, MMIO up to 4GiB and the framebuffer, with page 0 left out to catch null pointers
+		// Caching stays up to the MTRRs everywhere but on the framebuffer, which goes write-combining. Every kernel mapping is
+		// global, so that its translations survive switches between address spaces.
+		auto framebuffer = reinterpret_cast<UINTN>(graphicsOutput.getDisplayFramebuffer());
+		auto framebufferSize = (graphicsOutput.getDisplayFramebufferSize() + EFI_PAGE_MASK) & ~static_cast<UINTN>(EFI_PAGE_MASK);
+		auto mappedEnd = physicalEnd > framebuffer + framebufferSize ? physicalEnd : framebuffer + framebufferSize;
+		mappedEnd = mappedEnd > (static_cast<UINTN>(1) << 32) ? mappedEnd : static_cast<UINTN>(1) << 32;
+		mappedEnd = (mappedEnd + bare::PageTables::largePageSize - 1) & ~(bare::PageTables::largePageSize - 1);
+
+		auto cachingBefore = bare::MemoryCaching::query(framebuffer);
+		auto bandwidthBefore = graphicsOutput.getPresentBackend().getBandwidth();
+		auto pageTables = bare::PageTables(sharedPageFrames);
+		pageTables.identityMap(0, mappedEnd, bare::PageTables::writable | bare::PageTables::global);
+		pageTables.identityMap(framebuffer & ~static_cast<UINTN>(EFI_PAGE_MASK), framebufferSize, bare::PageTables::writable | bare::PageTables::writeCombining | bare::PageTables::global);
+		pageTables.unmap(0, EFI_PAGE_SIZE);
+		pageTables.activate();
+		// Before the APs start, as they take CR4 over from the BSP
+		auto tlbFeatures = bare::PageTables::getTlbFeatures();
+		bare::PageTables::setTlbFeatures(tlbFeatures);
+		// Every kernel mapping is writable, so the read-only ones of the firmware tables no longer get in the way, and write
+		// protection only holds the kernel to read-only user pages again
+		AsmWriteCr0(AsmReadCr0() | cr0WriteProtect);
+
+		graphicsOutput.calibratePresent(tscFreq);
+		auto cachingAfter = bare::MemoryCaching::query(framebuffer);
+		terminal.print(bootUToC16(u"Kernel page tables: %Lu tables, %s pages, CR3 = 0x%Lx, PAT = 0x%Lx\n"),
+			pageTables.getTableCount(), pageTables.hasHugePages() ? bootUToC16(u"1GiB") : bootUToC16(u"2MiB"), AsmReadCr3(), AsmReadMsr64(bare::MemoryCaching::msrPat)
+		);
+		terminal.print(bootUToC16(u"Framebuffer cached %s (PAT %s, MTRR %s) before, %s (PAT %s, MTRR %s) after\n"),
+			bare::memoryType::getName(cachingBefore.effectiveType), bare::memoryType::getName(cachingBefore.patType), bare::memoryType::getName(cachingBefore.mtrrType),
+			bare::memoryType::getName(cachingAfter.effectiveType), bare::memoryType::getName(cachingAfter.patType), bare::memoryType::getName(cachingAfter.mtrrType)
+		);
+		terminal.print(bootUToC16(u"Present bandwidth: %,Lu MB/s before, %,Lu MB/s after with %s\n"),
+			bandwidthBefore, graphicsOutput.getPresentBackend().getBandwidth(), graphicsOutput.getPresentBackend().getStrategyName()
+		);
+
+		{
+			// 2 x 256 user pages and 256 kernel pages, few enough for the second-level TLB to hold them all
+			static constexpr UINTN tlbPageOrder = 8;
+			static constexpr UINTN tlbSwitchCount = 1 << 14;
+			auto kernelPages = sharedPageFrames.allocate(tlbPageOrder);
+			auto firstPages = sharedPageFrames.allocate(tlbPageOrder);
+			auto secondPages = sharedPageFrames.allocate(tlbPageOrder);
+			if (kernelPages != nullptr && firstPages != nullptr && secondPages != nullptr) {
+				// Mapped with 4KiB pages, so that kernel reads need as many translations as user ones
+				pageTables.identityMap(reinterpret_cast<UINTN>(kernelPages), EFI_PAGE_SIZE << tlbPageOrder, bare::PageTables::writable | bare::PageTables::global);
+				auto first = bare::AddressSpace(sharedPageFrames, pageTables, 1);
+				auto second = bare::AddressSpace(sharedPageFrames, pageTables, 2);
+				first.getTables().map(bare::AddressSpace::base, reinterpret_cast<UINTN>(firstPages), EFI_PAGE_SIZE << tlbPageOrder, bare::PageTables::writable | bare::PageTables::user);
+				second.getTables().map(bare::AddressSpace::base, reinterpret_cast<UINTN>(secondPages), EFI_PAGE_SIZE << tlbPageOrder, bare::PageTables::writable | bare::PageTables::user);
+
+				auto pageCount = static_cast<UINTN>(1) << tlbPageOrder;
+				bare::PageTables::setTlbFeatures(0);
+				auto nanosecondsWithout = bare::AddressSpace::benchmark(clock, first, second, reinterpret_cast<const UINT8*>(kernelPages), pageCount, tlbSwitchCount);
+				// PCIDs can only be enabled from PCID 0
+				AsmWriteCr3(pageTables.getRoot());
+				bare::PageTables::setTlbFeatures(tlbFeatures);
+				auto nanosecondsWith = bare::AddressSpace::benchmark(clock, first, second, reinterpret_cast<const UINT8*>(kernelPages), pageCount, tlbSwitchCount);
+				AsmWriteCr3(pageTables.getRoot());
+				terminal.print(bootUToC16(u"Global pages %s, PCIDs %s\n"),
+					tlbFeatures & bare::PageTables::cr4GlobalPages ? bootUToC16(u"on") : bootUToC16(u"unsupported"),
+					tlbFeatures & bare::PageTables::cr4Pcid ? bootUToC16(u"on") : bootUToC16(u"unsupported")
+				);
+				terminal.print(bootUToC16(u"Address space switch reading %Lu user and %Lu kernel pages: %,Lu ns, %,Lu ns without either\n"),
+					pageCount, pageCount, nanosecondsWith, nanosecondsWithout
+				);
+			}
+			// Page tables are never freed, only the pages they mapped
+			void *blocks[] { kernelPages, firstPages, secondPages };
+			for (auto block : blocks)
+				if (block != nullptr)
+					sharedPageFrames.free(block);
+		}
+
+		// Stacks and deques of `Smp::maxCpuCount` CPUs fit in 32MiB
+		static constexpr UINTN kernelHeapOrder = 13;
+		auto kernelHeap = sharedPageFrames.allocate(kernelHeapOrder);
+		if (kernelHeap == nullptr)
+			bare::fatalError();
+		auto allocator = bare::BumpAllocator(reinterpret_cast<UINTN>(kernelHeap), EFI_PAGE_SIZE << kernelHeapOrder);
+		auto smp = bare::Smp(smpPlan, allocator);
+		auto jobSystem = bare::JobSystem(smpPlan.apCount + 1, allocator);
+		terminal.print(bootUToC16(u"Starting %Lu AP(s)..\n"), smpPlan.apCount);
+		auto onlineCount = smp.start(smpPlan, clock, bare::JobSystem::workerLoop, &jobSystem);
+		terminal.print(bootUToC16(u"%Lu CPU(s) online, running 2^17 - 1 fork-join jobs on each count..\n"), onlineCount);
+		jobSystem.benchmark(tscFreq, onlineCount, 1 << 16, [&terminal](UINTN cpuCount, UINTN jobsPerSecond) {
+			terminal.print(bootUToC16(u"%Lu CPU(s): %,Lu jobs/s\n"), cpuCount, jobsPerSecond);
+		});
+
+		{
+			auto slabCache = bare::SlabCache(256, smpPlan.apCount + 1, sharedPageFrames, allocator);
+			terminal.print(bootUToC16(u"Allocating and freeing %Lu-byte slab objects on each CPU count..\n"), slabCache.getObjectSize());
+			slabCache.benchmark(jobSystem, clock, onlineCount, 1 << 18, [&terminal](UINTN cpuCount, UINT64 nanoseconds) {
+				terminal.print(bootUToC16(u"%Lu CPU(s): %Lu ns/op\n"), cpuCount, nanoseconds);
+			});
+
+			static constexpr UINTN scratchOrder = 8;
+			auto scratch = sharedPageFrames.allocate(scratchOrder);
+			if (scratch != nullptr) {
+				auto arena = bare::ScratchArena(scratch, EFI_PAGE_SIZE << scratchOrder);
+				terminal.print(bootUToC16(u"Scratch arena: %Lu ns/op for 256-byte objects\n"), arena.benchmark(clock, 256, 1 << 20));
+				sharedPageFrames.free(scratch);
+			}
+		}
+		auto timer = bare::DeadlineTimer(clock);
+		auto userMode = bare::UserMode(allocator);
+		{
+			auto userSpace = bare::AddressSpace(sharedPageFrames, pageTables, 1);
+			auto latency = userMode.benchmark(userSpace, sharedPageFrames, 1 << 16);
+			terminal.print(bootUToC16(u"Null syscall round trip from ring 3: %Lu cycles with SYSCALL/SYSRET, %Lu cycles through int 0x%x\n"),
+				latency.syscallCycles, latency.interruptCycles, bare::UserMode::syscallVector
+			);
+
+			auto rings = bare::SharedRings(userMode, sharedPageFrames);
+			auto throughput = rings.benchmark(userMode, userSpace, jobSystem, clock, 1 << 18);
+			terminal.print(bootUToC16(u"Null operations from ring 3: %,Lu/s with one syscall each, %,Lu/s through rings with a doorbell, %,Lu/s through rings polled by a kernel core\n"),
+				throughput.perSyscall, throughput.doorbell, throughput.polling
+			);
+
+			auto timePage = bare::TimePage(tscFreq, sharedPageFrames);
+			auto readCost = timePage.benchmark(userMode, userSpace, 1 << 18);
+			terminal.print(bootUToC16(u"Time reads from ring 3: %Lu cycles for rdtsc, %Lu cycles for nanoseconds through the time page, %s with the kernel, %s across updates\n"),
+				readCost.rdtscCycles, readCost.timeCycles, readCost.isConsistent ? bootUToC16(u"consistent") : bootUToC16(u"inconsistent"),
+				readCost.isMonotonic ? bootUToC16(u"monotonic") : bootUToC16(u"not monotonic")
+			);
+		}
+
+		// Each program gets an address space of its own, PCID 1 was for the benchmarks
+		for (UINTN i = 0; i < programPlan.programCount; i++) {
+			auto &program = programPlan.programs[i];
+			auto image = bare::ElfImage(program.data, program.size);
+			if (!image.isValid()) {
+				terminal.print(bootUToC16(u"%s: not a static ELF64 executable within the user range\n"), program.name);
+				continue;
+			}
+			auto space = bare::AddressSpace(sharedPageFrames, pageTables, static_cast<UINT16>(i + 2));
+			auto begin = clock.now();
+			if (!image.map(space, sharedPageFrames)) {
+				terminal.print(bootUToC16(u"%s: out of page frames\n"), program.name);
+				continue;
 			}
-		} else {
-			for (UINTN i = 0; i < graphicsOutput.getHeight(); i++) {
-				auto scanline = graphicsOutput.getPixelOffset(0, i);
-				for (UINTN j = 0; j < graphicsOutput.getWidth(); j++) {
-					auto pixel = getPixel(it, j, i);
-					for (UINTN k = 0; k < 3; k++)
-						scanline[j * 4 + k] = pixel.vector.values[3 - 1 - k];
+			auto mapMicroseconds = clock.toMicroseconds(clock.now() - begin);
+			terminal.print(bootUToC16(u"%s: %Lu page(s) mapped in place, %Lu copied, in %Lu us (%Lu us/MiB)\n"),
+				program.name, image.getInPlacePageCount(), image.getCopiedPageCount(), mapMicroseconds, mapMicroseconds * (1 << 20) / program.size
+			);
+			auto cr3 = AsmReadCr3();
+			space.activate();
+			auto result = userMode.run(image.getEntry(), bare::ElfImage::stackTop, 0, 0);
+			AsmWriteCr3(cr3);
+			terminal.print(bootUToC16(u"%s: exited with %Ld\n"), program.name, result);
+		}
+
+		terminal.print(bootUToC16(u"Runtime rendering in 10 seconds for 15 seconds, %s..\n"),
+			timer.isSupported() ? bootUToC16(u"halting on the TSC-deadline timer between frames") : bootUToC16(u"spinning between frames")
+		);
+		timer.sleep(10000000);
+
+		// Frames are due on absolute deadlines, so that time spent rendering doesn't add up into drift
+		auto frameCycles = clock.toCycles(1000000 / 60);
+		auto deadline = clock.now();
+		timer.takeStats();
+		static constexpr UINTN frameCount = 60 * 15;
+		UINT64 presentedByteCount = 0;
+		for (UINTN it = 0; it < frameCount; it++) {
+			auto colorA = [&graphicsOutput, it](UINTN x) {
+				return graphicsOutput.packPixel(0xFF, static_cast<UINT8>((x + it) & 0xFF), 0xFF);
+			};
+
+			// The pattern is made of horizontal bands of 16 identical rows: render the first row of each band, then duplicate it
+			for (UINTN i = 0; i < graphicsOutput.getHeight();) {
+				auto band = (i + it * 3) / 16;
+				auto bandEnd = (band + 1) * 16 - it * 3;
+				if (bandEnd > graphicsOutput.getHeight())
+					bandEnd = graphicsOutput.getHeight();
+				auto colorB = graphicsOutput.packPixel(0x80, static_cast<UINT8>(0x80 + (i + it * 3) / 64), 0xFF);
+
+				auto scanline = graphicsOutput.getScanline(i);
+				for (UINTN j = 0; j < graphicsOutput.getWidth();) {
+					auto cell = (j + it) / 8;
+					auto cellEnd = (cell + 1) * 8 - it;
+					if (cellEnd > graphicsOutput.getWidth())
+						cellEnd = graphicsOutput.getWidth();
+					if ((cell ^ band) & 1) {
+						for (; j < cellEnd; j++)
+							scanline[j] = colorA(j);
+					} else {
+						graphicsOutput.fillSpan(j, i, cellEnd - j, colorB);
+						j = cellEnd;
+					}
 				}
+
+				graphicsOutput.markDirty(0, i, graphicsOutput.getWidth(), 1);
+
+				for (UINTN k = i + 1; k < bandEnd; k++)
+					graphicsOutput.copyRow(k, i);
+				i = bandEnd;
 			}
+			graphicsOutput.present();
+			presentedByteCount += graphicsOutput.getPresentedByteCount();
+
+			deadline += frameCycles;
+			timer.waitUntil(deadline);
 		}
-		graphicsOutput.present();
 
-		bare::sleep(tscFreq, static_cast<UINTN>(1e6 / 60));
-	}
+		auto stats = timer.takeStats();
+		terminal.clear();
+		terminal.print(bootUToC16(u"%Lu frame waits: %Lu us late on average, %Lu us at worst, %Lu.%Lu%% of the time halted\n"),
+			stats.wakeCount, stats.meanLateMicroseconds, stats.maxLateMicroseconds, stats.idlePermille / 10, stats.idlePermille % 10
+		);
+		terminal.print(bootUToC16(u"%,Lu bytes presented per frame on average, out of %,Lu for a full frame\n"),
+			presentedByteCount / frameCount, graphicsOutput.getDisplayFramebufferSize()
+		);
+		terminal.print(bootUToC16(u"Shutting down in 5 seconds..\n"));
+		timer.sleep(5000000);
+	});
 	SystemTable->RuntimeServices->ResetSystem(EfiResetShutdown, EFI_SUCCESS, 0, nullptr);
 
 	return EFI_SUCCESS;
@@ -0,0 +1,248 @@
+#pragma once
+
+extern "C" {
+
+#include <Uefi.h>
+#include <Library/BaseLib.h>
+#include <Library/UefiLib.h>
+#include <Library/UefiBootServicesTableLib.h>
+#include <Protocol/MpService.h>
+
+}
+
+#include "boot.hpp"
+#include "bare.hpp"
+#include "smp.hpp"
+
+namespace boot {
+
+// Only usable before `ExitBootServices`: the APs are then owned by the firmware
+class MpServices
+{
+	EFI_MP_SERVICES_PROTOCOL *m_mpServices;
+	UINTN m_processorCount;
+	UINTN m_enabledProcessorCount;
+
+	MpServices(EFI_MP_SERVICES_PROTOCOL *mpServices) :
+		m_mpServices(mpServices),
+		m_processorCount(1),
+		m_enabledProcessorCount(1)
+	{
+		if (m_mpServices != nullptr)
+			bootEfiAssert(m_mpServices->GetNumberOfProcessors(m_mpServices, &m_processorCount, &m_enabledProcessorCount));
+	}
+
+public:
+	// Falls back to the BSP alone when the firmware doesn't expose the protocol
+	static MpServices query(void) {
+		EFI_MP_SERVICES_PROTOCOL *mpServices = nullptr;
+		auto res = gBS->LocateProtocol(&gEfiMpServiceProtocolGuid, nullptr, reinterpret_cast<void**>(&mpServices));
+		if (res != EFI_SUCCESS)
+			mpServices = nullptr;
+		return MpServices(mpServices);
+	}
+
+	// BSP included
+	UINTN getEnabledProcessorCount(void) const {
+		return m_enabledProcessorCount;
+	}
+
+	// Fn is a `void (UINTN processorNumber, const EFI_PROCESSOR_INFORMATION &info)`
+	template <typename Fn>
+	void iterateProcessors(Fn &&fn) const {
+		if (m_mpServices == nullptr)
+			return;
+		for (UINTN i = 0; i < m_processorCount; i++) {
+			EFI_PROCESSOR_INFORMATION info;
+			bootEfiAssert(m_mpServices->GetProcessorInfo(m_mpServices, i, &info));
+			fn(i, info);
+		}
+	}
+
+	// Starts `procedure` on every enabled AP and returns immediately, `waitEvent` is signaled once they all returned
+	// Returns false when there is no AP to start.
+	bool startupAllAps(EFI_AP_PROCEDURE procedure, void *argument, EFI_EVENT waitEvent) const {
+		if (m_mpServices == nullptr || m_enabledProcessorCount < 2)
+			return false;
+		auto res = m_mpServices->StartupAllAPs(m_mpServices, procedure, FALSE, waitEvent, 0, argument, nullptr);
+		if (res == EFI_NOT_STARTED)
+			return false;
+		bootEfiAssert(res);
+		return true;
+	}
+};
+
+// Gathers what `bare::Smp` needs to start the APs once the firmware is gone
+// The trampoline page is allocated below 640KiB as `EfiLoaderData`, so that it stays ours after `ExitBootServices`.
+[[maybe_unused]] static bare::Smp::Plan planSmp(const MpServices &mpServices) {
+	bare::Smp::Plan plan {};
+	mpServices.iterateProcessors([&plan](UINTN, const EFI_PROCESSOR_INFORMATION &info) {
+		if ((info.StatusFlag & PROCESSOR_AS_BSP_BIT) || !(info.StatusFlag & PROCESSOR_ENABLED_BIT))
+			return;
+		if (plan.apCount == bare::Smp::maxCpuCount - 1)
+			return;
+		plan.apApicIds[plan.apCount++] = static_cast<UINT32>(info.ProcessorId);
+	});
+
+	EFI_PHYSICAL_ADDRESS trampolinePage = 0x9FFFF;
+	bootEfiAssert(gBS->AllocatePages(AllocateMaxAddress, EfiLoaderData, 1, &trampolinePage));
+	plan.trampolinePage = trampolinePage;
+	plan.bootCr3 = AsmReadCr3();
+	return plan;
+}
+
+// Runs loops across every enabled core, the BSP included
+// Iterations are handed out dynamically from a shared counter, so that uneven iterations don't stall the others.
+// Loop bodies run on APs: they must not call any UEFI service nor use instructions beyond SSE2.
+class MpExecutor
+{
+	MpServices m_mpServices;
+	EFI_EVENT m_apsDoneEvent;
+	UINTN m_workerLimit;
+
+	struct Loop {
+		UINTN count;
+		UINTN next;
+		UINTN apSlot;
+		UINTN apLimit;
+		void *context;
+		void (*body)(void *context, UINTN i);
+	};
+
+	static void runIterations(Loop &loop) {
+		while (true) {
+			auto i = __atomic_fetch_add(&loop.next, 1, __ATOMIC_RELAXED);
+			if (i >= loop.count)
+				break;
+			loop.body(loop.context, i);
+		}
+	}
+
+	static VOID EFIAPI apProcedure(VOID *argument) {
+		auto &loop = *reinterpret_cast<Loop*>(argument);
+		// APs above the worker limit sit this loop out
+		if (__atomic_fetch_add(&loop.apSlot, 1, __ATOMIC_RELAXED) >= loop.apLimit)
+			return;
+		runIterations(loop);
+	}
+
+public:
+	MpExecutor(const MpServices &mpServices) :
+		m_mpServices(mpServices),
+		m_workerLimit(mpServices.getEnabledProcessorCount())
+	{
+		bootEfiAssert(gBS->CreateEvent(0, TPL_APPLICATION, nullptr, nullptr, &m_apsDoneEvent));
+	}
+
+	// Copies would close the event twice
+	MpExecutor(const MpExecutor&) = delete;
+	MpExecutor& operator=(const MpExecutor&) = delete;
+
+	~MpExecutor(void) {
+		gBS->CloseEvent(m_apsDoneEvent);
+	}
+
+	UINTN getWorkerCount(void) const {
+		return m_mpServices.getEnabledProcessorCount();
+	}
+
+	// Restricts loops to `workerLimit` cores (BSP included) to measure scaling, clamped to [1, getWorkerCount()]
+	void setWorkerLimit(UINTN workerLimit) {
+		if (workerLimit < 1)
+			workerLimit = 1;
+		if (workerLimit > getWorkerCount())
+			workerLimit = getWorkerCount();
+		m_workerLimit = workerLimit;
+	}
+
+	// Calls `fn(i)` for every i in [0, count) and returns once they all returned, must be called from the BSP
+	// The APs are only started when there are several iterations, as starting them costs tens of microseconds.
+	template <typename Fn>
+	void parallelFor(UINTN count, Fn &&fn) {
+		Loop loop {
+			.count = count,
+			.next = 0,
+			.apSlot = 0,
+			.apLimit = m_workerLimit - 1,
+			.context = &fn,
+			.body = [](void *context, UINTN i) {
+				(*reinterpret_cast<Fn*>(context))(i);
+			}
+		};
+
+		bool apsStarted = count > 1 && loop.apLimit > 0 && m_mpServices.startupAllAps(apProcedure, &loop, m_apsDoneEvent);
+		runIterations(loop);
+		if (apsStarted) {
+			UINTN index;
+			bootEfiAssert(gBS->WaitForEvent(1, &m_apsDoneEvent, &index));
+		}
+	}
+};
+
+// Splits the draw framebuffer into horizontal tiles rendered by every enabled core, see `MpExecutor`
+class TiledRenderer
+{
+	MpExecutor m_executor;
+
+public:
+	static inline constexpr UINTN defaultTileHeight = 16;
+
+	TiledRenderer(const MpServices &mpServices) :
+		m_executor(mpServices)
+	{
+	}
+
+	UINTN getCpuCount(void) const {
+		return m_executor.getWorkerCount();
+	}
+
+	// Restricts rendering to `cpuLimit` cores (BSP included) to measure scaling, clamped to [1, getCpuCount()]
+	void setCpuLimit(UINTN cpuLimit) {
+		m_executor.setWorkerLimit(cpuLimit);
+	}
+
+	// Fn is a `void (UINTN top, UINTN bottom)` rendering the scanlines [top, bottom) into the draw framebuffer
+	// Returns once every tile is rendered, with all of them marked dirty: the frame can be presented right away.
+	template <typename Fn>
+	void render(bare::GraphicsOutputBase &graphicsOutput, Fn &&fn, UINTN tileHeight = defaultTileHeight) {
+		auto height = graphicsOutput.getHeight();
+		m_executor.parallelFor((height + tileHeight - 1) / tileHeight, [&fn, height, tileHeight](UINTN tile) {
+			auto top = tile * tileHeight;
+			auto bottom = top + tileHeight;
+			if (bottom > height)
+				bottom = height;
+			fn(top, bottom);
+		});
+
+		graphicsOutput.markDirty(0, 0, graphicsOutput.getWidth(), graphicsOutput.getHeight());
+	}
+
+	// Renders `frameCount` frames with 1 to `getCpuCount()` cores and prints the time per frame of each run
+	// Fn is a `void (UINTN frame, UINTN top, UINTN bottom)`
+	template <typename Fn>
+	void benchmark(bare::GraphicsOutputBase &graphicsOutput, UINTN tscFrequency, UINTN frameCount, Fn &&fn) {
+		UINTN singleCoreCycles = 0;
+		for (UINTN cpuCount = 1; cpuCount <= getCpuCount(); cpuCount++) {
+			setCpuLimit(cpuCount);
+
+			auto begin = AsmReadTsc();
+			for (UINTN i = 0; i < frameCount; i++) {
+				render(graphicsOutput, [&fn, i](UINTN top, UINTN bottom) {
+					fn(i, top, bottom);
+				});
+			}
+			auto cycles = AsmReadTsc() - begin;
+			if (cpuCount == 1)
+				singleCoreCycles = cycles;
+
+			Print(bootUToC16(u"%Lu core(s): %Lu us/frame, speedup x%Lu.%02Lu\n"), cpuCount,
+				cycles * 1000000 / tscFrequency / frameCount,
+				singleCoreCycles / cycles, singleCoreCycles * 100 / cycles % 100
+			);
+		}
+		setCpuLimit(getCpuCount());
+		graphicsOutput.present();
+	}
+};
+
+}
\ No newline at end of file
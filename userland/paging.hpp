@@ -0,0 +1,478 @@
+#pragma once
+
+extern "C" {
+
+#include <Uefi.h>
+#include <Library/BaseLib.h>
+#include <Library/BaseMemoryLib.h>
+
+}
+
+#include "bare.hpp"
+#include "frames.hpp"
+
+namespace bare {
+
+// Memory types, as encoded in the PAT and the MTRRs
+namespace memoryType {
+
+static inline constexpr UINT8 uncacheable = 0;
+static inline constexpr UINT8 writeCombining = 1;
+static inline constexpr UINT8 writeThrough = 4;
+static inline constexpr UINT8 writeProtected = 5;
+static inline constexpr UINT8 writeBack = 6;
+// UC-, which the MTRRs may still turn into write-combining
+static inline constexpr UINT8 uncached = 7;
+static inline constexpr UINT8 unknown = 0xFF;
+
+[[maybe_unused]] static const CHAR16* getName(UINT8 type) {
+	switch (type) {
+	case uncacheable:
+		return reinterpret_cast<const CHAR16*>(u"UC");
+	case writeCombining:
+		return reinterpret_cast<const CHAR16*>(u"WC");
+	case writeThrough:
+		return reinterpret_cast<const CHAR16*>(u"WT");
+	case writeProtected:
+		return reinterpret_cast<const CHAR16*>(u"WP");
+	case writeBack:
+		return reinterpret_cast<const CHAR16*>(u"WB");
+	case uncached:
+		return reinterpret_cast<const CHAR16*>(u"UC-");
+	default:
+		return reinterpret_cast<const CHAR16*>(u"?");
+	}
+}
+
+}
+
+// How the CPU caches an address: the PAT entry picked by its page table entry, combined with the MTRRs
+struct MemoryCaching
+{
+	static inline constexpr UINT32 msrPat = 0x277;
+
+	UINT8 patType;
+	UINT8 mtrrType;
+	UINT8 effectiveType;
+	// Size of the page mapping the address, 0 when it isn't mapped
+	UINTN pageSize;
+
+	// Type the MTRRs give to `address`, write-back when the CPU has none
+	static UINT8 queryMtrrType(UINTN address) {
+		static constexpr UINT32 msrMtrrCap = 0xFE;
+		static constexpr UINT32 msrMtrrDefType = 0x2FF;
+		static constexpr UINT32 msrMtrrPhysBase0 = 0x200;
+		static constexpr UINT32 msrMtrrFix64K = 0x250;
+		static constexpr UINT32 msrMtrrFix16K = 0x258;
+		static constexpr UINT32 msrMtrrFix4K = 0x268;
+
+		UINT32 edx;
+		AsmCpuid(1, nullptr, nullptr, nullptr, &edx);
+		if (((edx >> 12) & 1) == 0)
+			return memoryType::writeBack;
+		auto defType = AsmReadMsr64(msrMtrrDefType);
+		if (((defType >> 11) & 1) == 0)
+			return memoryType::uncacheable;
+		auto cap = AsmReadMsr64(msrMtrrCap);
+
+		// Fixed ranges cover the first MiB with 8 types per MSR
+		if (address < 0x100000 && ((cap >> 8) & 1) && ((defType >> 10) & 1)) {
+			UINT32 msr;
+			UINTN index;
+			if (address < 0x80000) {
+				msr = msrMtrrFix64K;
+				index = address >> 16;
+			} else if (address < 0xC0000) {
+				msr = msrMtrrFix16K + static_cast<UINT32>((address - 0x80000) >> 17);
+				index = ((address - 0x80000) >> 14) & 7;
+			} else {
+				msr = msrMtrrFix4K + static_cast<UINT32>((address - 0xC0000) >> 15);
+				index = ((address - 0xC0000) >> 12) & 7;
+			}
+			return static_cast<UINT8>(AsmReadMsr64(msr) >> (index * 8));
+		}
+
+		UINT32 maxExtendedLeaf, addressSizes;
+		AsmCpuid(0x80000000, &maxExtendedLeaf, nullptr, nullptr, nullptr);
+		UINTN physicalBits = 36;
+		if (maxExtendedLeaf >= 0x80000008) {
+			AsmCpuid(0x80000008, &addressSizes, nullptr, nullptr, nullptr);
+			physicalBits = addressSizes & 0xFF;
+		}
+		auto addressMask = ((static_cast<UINT64>(1) << physicalBits) - 1) & ~static_cast<UINT64>(0xFFF);
+
+		// Overlapping ranges: UC wins, then WT over WB
+		auto res = memoryType::unknown;
+		for (UINT32 i = 0; i < (cap & 0xFF); i++) {
+			auto base = AsmReadMsr64(msrMtrrPhysBase0 + i * 2);
+			auto mask = AsmReadMsr64(msrMtrrPhysBase0 + i * 2 + 1);
+			if (((mask >> 11) & 1) == 0 || (address & mask & addressMask) != (base & mask & addressMask))
+				continue;
+			auto type = static_cast<UINT8>(base & 0xFF);
+			if (res == memoryType::unknown || type == memoryType::uncacheable || (type == memoryType::writeThrough && res == memoryType::writeBack))
+				res = type;
+		}
+		return res == memoryType::unknown ? static_cast<UINT8>(defType & 0xFF) : res;
+	}
+
+	// Intel SDM, table "Effective Page-Level Memory Types for Pentium III and More Recent Processor Families"
+	static UINT8 combine(UINT8 mtrrType, UINT8 patType) {
+		if (patType == memoryType::uncacheable || patType == memoryType::writeCombining)
+			return patType;
+		if (patType == memoryType::uncached)
+			return mtrrType == memoryType::writeCombining ? memoryType::writeCombining : memoryType::uncacheable;
+		if (mtrrType == memoryType::uncacheable)
+			return memoryType::uncacheable;
+		if (mtrrType == memoryType::writeCombining)
+			return patType == memoryType::writeBack ? memoryType::writeCombining : memoryType::uncacheable;
+		return patType == memoryType::writeBack ? mtrrType : patType;
+	}
+
+	// Walks the page tables of this CPU
+	static MemoryCaching query(UINTN address) {
+		static constexpr UINT64 present = 1;
+		static constexpr UINT64 largePage = 1 << 7;
+		static constexpr UINT64 addressMask = 0x000FFFFFFFFFF000;
+		static constexpr UINT64 cr4La57 = 1 << 12;
+
+		MemoryCaching res { memoryType::unknown, queryMtrrType(address), memoryType::unknown, 0 };
+		UINTN level = AsmReadCr4() & cr4La57 ? 5 : 4;
+		auto table = reinterpret_cast<const UINT64*>(AsmReadCr3() & addressMask);
+		while (true) {
+			auto shift = 12 + 9 * (level - 1);
+			auto entry = table[(address >> shift) & 511];
+			if ((entry & present) == 0)
+				return res;
+			if (level == 1 || (level <= 3 && (entry & largePage))) {
+				// The PAT bit moves to bit 12 in large pages, where bit 7 tells their size
+				auto patBit = level == 1 ? (entry >> 7) & 1 : (entry >> 12) & 1;
+				auto index = (patBit << 2) | (((entry >> 4) & 1) << 1) | ((entry >> 3) & 1);
+				res.patType = static_cast<UINT8>((AsmReadMsr64(msrPat) >> (index * 8)) & 7);
+				res.effectiveType = combine(res.mtrrType, res.patType);
+				res.pageSize = static_cast<UINTN>(1) << shift;
+				return res;
+			}
+			table = reinterpret_cast<const UINT64*>(entry & addressMask);
+			level--;
+		}
+	}
+};
+
+// Page tables of the kernel, built out of page frames
+// Mappings use 1GiB pages when CPUID reports them and 2MiB pages otherwise, down to 4KiB pages only where alignment
+// requires it. Large pages are split whenever a smaller mapping lands inside of them. PAT entry 1, picked by PWT alone,
+// is reprogrammed from write-through to write-combining: `writeCombining` mappings rely on `activate` for it.
+// Changes flush the whole TLB of the calling CPU, global pages and other PCIDs included, see `AddressSpace`.
+class PageTables
+{
+public:
+	static inline constexpr UINT64 present = 1;
+	static inline constexpr UINT64 writable = 1 << 1;
+	static inline constexpr UINT64 user = 1 << 2;
+	static inline constexpr UINT64 writeCombining = 1 << 3;
+	// PAT entry 3, left uncacheable
+	static inline constexpr UINT64 uncacheable = (1 << 3) | (1 << 4);
+	// Survives CR3 writes once CR4.PGE is set, for mappings every address space shares
+	static inline constexpr UINT64 global = 1 << 8;
+	static inline constexpr UINT64 noExecute = static_cast<UINT64>(1) << 63;
+
+	static inline constexpr UINTN largePageSize = 1 << 21;
+	static inline constexpr UINTN hugePageSize = 1 << 30;
+
+	static inline constexpr UINT64 cr4GlobalPages = 1 << 7;
+	static inline constexpr UINT64 cr4Pcid = 1 << 17;
+
+private:
+	static inline constexpr UINT64 largePage = 1 << 7;
+	static inline constexpr UINT64 largePat = 1 << 12;
+	static inline constexpr UINT64 smallPat = 1 << 7;
+	static inline constexpr UINT64 addressMask = 0x000FFFFFFFFFF000;
+	static inline constexpr UINT64 cr4La57 = 1 << 12;
+	// Table entries let everything through, leaves decide
+	static inline constexpr UINT64 tableFlags = present | writable | user;
+
+	SharedPageFrames &m_pageFrames;
+	UINTN m_levelCount;
+	bool m_hasHugePages;
+	UINT64 *m_root;
+	UINTN m_tableCount = 0;
+
+	static UINTN getShift(UINTN level) {
+		return 12 + 9 * (level - 1);
+	}
+
+	UINT64* allocateTable(void) {
+		auto table = reinterpret_cast<UINT64*>(m_pageFrames.allocate(0));
+		if (table == nullptr)
+			fatalError();
+		SetMem(table, EFI_PAGE_SIZE, 0);
+		m_tableCount++;
+		return table;
+	}
+
+	// Turns a large page of `level` into a table of the next level mapping the same memory the same way
+	void split(UINT64 &entry, UINTN level) {
+		auto childSize = static_cast<UINT64>(1) << getShift(level - 1);
+		auto base = entry & addressMask & ~(childSize * 512 - 1);
+		auto flags = entry & ~addressMask;
+		if (level == 2) {
+			flags &= ~largePage;
+			if (entry & largePat)
+				flags |= smallPat;
+		} else {
+			flags |= entry & largePat;
+		}
+		auto table = allocateTable();
+		for (UINTN i = 0; i < 512; i++)
+			table[i] = (base + i * childSize) | flags;
+		entry = reinterpret_cast<UINTN>(table) | tableFlags;
+	}
+
+	// Entry of `level` translating `address`, creating tables and splitting large pages on the way down
+	UINT64& getEntry(UINTN address, UINTN level) {
+		auto table = m_root;
+		for (auto current = m_levelCount; current > level; current--) {
+			auto &entry = table[(address >> getShift(current)) & 511];
+			if ((entry & present) == 0)
+				entry = reinterpret_cast<UINTN>(allocateTable()) | tableFlags;
+			else if (entry & largePage)
+				split(entry, current);
+			table = reinterpret_cast<UINT64*>(entry & addressMask);
+		}
+		return table[(address >> getShift(level)) & 511];
+	}
+
+	// Largest level a leaf may sit at for `size` bytes at `address` onto `physical`
+	UINTN getLeafLevel(UINTN address, UINTN physical, UINTN size) const {
+		auto fits = [address, physical, size](UINTN pageSize) {
+			return ((address | physical) & (pageSize - 1)) == 0 && size >= pageSize;
+		};
+		if (m_hasHugePages && fits(hugePageSize))
+			return 3;
+		return fits(largePageSize) ? 2 : 1;
+	}
+
+public:
+	// Toggling CR4.PGE drops every translation, whereas a CR3 write would keep global ones and those of other PCIDs
+	static void flushTlb(void) {
+		auto cr4 = AsmReadCr4();
+		if (cr4 & (cr4GlobalPages | cr4Pcid)) {
+			AsmWriteCr4(cr4 ^ cr4GlobalPages);
+			AsmWriteCr4(cr4);
+		} else {
+			AsmWriteCr3(AsmReadCr3());
+		}
+	}
+
+	PageTables(SharedPageFrames &pageFrames) :
+		m_pageFrames(pageFrames),
+		m_levelCount(AsmReadCr4() & cr4La57 ? 5 : 4)
+	{
+		UINT32 maxExtendedLeaf, edx = 0;
+		AsmCpuid(0x80000000, &maxExtendedLeaf, nullptr, nullptr, nullptr);
+		if (maxExtendedLeaf >= 0x80000001)
+			AsmCpuid(0x80000001, nullptr, nullptr, nullptr, &edx);
+		m_hasHugePages = (edx >> 26) & 1;
+		m_root = allocateTable();
+	}
+
+	// Shares the tables of `kernel` but for the 512GiB at `privateAddress`, which `kernel` must leave unmapped
+	// Mappings `kernel` adds later show up here as well, as long as they don't need a new entry in its root.
+	PageTables(SharedPageFrames &pageFrames, const PageTables &kernel, UINTN privateAddress) :
+		m_pageFrames(pageFrames),
+		m_levelCount(kernel.m_levelCount),
+		m_hasHugePages(kernel.m_hasHugePages)
+	{
+		m_root = allocateTable();
+		CopyMem(m_root, kernel.m_root, EFI_PAGE_SIZE);
+		// With 5 levels, the private range shares its root entry with the kernel: copies tables down to level 4
+		auto table = m_root;
+		for (auto level = m_levelCount; level > 4; level--) {
+			auto &entry = table[(privateAddress >> getShift(level)) & 511];
+			auto copy = allocateTable();
+			if (entry & present)
+				CopyMem(copy, reinterpret_cast<const void*>(entry & addressMask), EFI_PAGE_SIZE);
+			entry = reinterpret_cast<UINTN>(copy) | tableFlags;
+			table = copy;
+		}
+		if (table[(privateAddress >> getShift(4)) & 511] & present)
+			fatalError();
+	}
+
+	bool hasHugePages(void) const {
+		return m_hasHugePages;
+	}
+
+	// Tables allocated so far, the root included
+	UINTN getTableCount(void) const {
+		return m_tableCount;
+	}
+
+	UINTN getRoot(void) const {
+		return reinterpret_cast<UINTN>(m_root);
+	}
+
+	// Maps [address, address + size) onto [physical, physical + size) with `flags`, every bound page-aligned
+	// Tables already mapping part of the range are kept, and only their leaves are replaced.
+	void map(UINTN address, UINTN physical, UINTN size, UINT64 flags) {
+		while (size > 0) {
+			auto level = getLeafLevel(address, physical, size);
+			// Descends rather than dropping a table that already maps part of the range
+			auto *entry = &getEntry(address, level);
+			while (level > 1 && (*entry & present) && (*entry & largePage) == 0) {
+				level--;
+				entry = &getEntry(address, level);
+			}
+			*entry = physical | flags | present | (level > 1 ? largePage : 0);
+
+			auto pageSize = static_cast<UINTN>(1) << getShift(level);
+			address += pageSize;
+			physical += pageSize;
+			size -= pageSize;
+		}
+		flushTlb();
+	}
+
+	void identityMap(UINTN address, UINTN size, UINT64 flags) {
+		map(address, address, size, flags);
+	}
+
+	// Pages in [address, address + size) fault from then on
+	void unmap(UINTN address, UINTN size) {
+		while (size > 0) {
+			auto level = getLeafLevel(address, address, size);
+			auto *entry = &getEntry(address, level);
+			while (level > 1 && (*entry & present) && (*entry & largePage) == 0) {
+				level--;
+				entry = &getEntry(address, level);
+			}
+			*entry = 0;
+
+			auto pageSize = static_cast<UINTN>(1) << getShift(level);
+			address += pageSize;
+			size -= pageSize;
+		}
+		flushTlb();
+	}
+
+	// Value of the PAT MSR the mappings rely on: the current one with entry 1 turned write-combining
+	static UINT64 getPat(void) {
+		return (AsmReadMsr64(MemoryCaching::msrPat) & ~static_cast<UINT64>(0xFF00)) | (static_cast<UINT64>(memoryType::writeCombining) << 8);
+	}
+
+	// Switches this CPU over to these tables
+	// Caches are flushed around the PAT change, so that no line keeps a type the new mapping doesn't allow.
+	void activate(void) {
+		auto pat = getPat();
+		AsmWbinvd();
+		AsmWriteMsr64(MemoryCaching::msrPat, pat);
+		AsmWriteCr3(reinterpret_cast<UINTN>(m_root));
+		AsmWbinvd();
+	}
+
+	// CR4 bits among `cr4GlobalPages` and `cr4Pcid` that CPUID reports
+	static UINT64 getTlbFeatures(void) {
+		UINT32 ecx, edx;
+		AsmCpuid(1, nullptr, nullptr, &ecx, &edx);
+		return (((edx >> 13) & 1) ? cr4GlobalPages : 0) | (((ecx >> 17) & 1) ? cr4Pcid : 0);
+	}
+
+	// Sets exactly `features` of `cr4GlobalPages` and `cr4Pcid` on this CPU, which flushes its whole TLB
+	// CR3 must select PCID 0 when PCIDs get enabled.
+	static void setTlbFeatures(UINT64 features) {
+		AsmWriteCr4((AsmReadCr4() & ~(cr4GlobalPages | cr4Pcid)) | features);
+		flushTlb();
+	}
+};
+
+// Address space of a user program: the tables of the kernel, plus 512GiB of its own at `base`
+// Once CR4.PCIDE is set, the TLB tags its translations with its PCID, so that switching to it keeps them around as well
+// as those of the other address spaces, and global kernel translations survive either way. It is only safe because
+// `PageTables` flushes everything on changes, because the PCID gets flushed as the address space is created and
+// destroyed so that it can be reused, and as long as an address space is never active on several CPUs.
+class AddressSpace
+{
+public:
+	static inline constexpr UINTN base = 0x00007F8000000000;
+	static inline constexpr UINTN size = static_cast<UINTN>(1) << 39;
+	// PCID 0 belongs to the kernel tables
+	static inline constexpr UINT16 maxPcid = 4095;
+
+private:
+	static inline constexpr UINT64 invpcidSingleContext = 1;
+
+	PageTables m_tables;
+	UINT16 m_pcid;
+
+	// Drops the translations tagged with the PCID on this CPU, with INVPCID when there is one
+	void flushPcid(void) const {
+		if (!(AsmReadCr4() & PageTables::cr4Pcid))
+			return;
+		UINT32 ebx;
+		AsmCpuidEx(7, 0, nullptr, &ebx, nullptr, nullptr);
+		if (!((ebx >> 10) & 1)) {
+			PageTables::flushTlb();
+			return;
+		}
+		struct {
+			UINT64 pcid;
+			UINT64 address;
+		} descriptor { m_pcid, 0 };
+		asm volatile("invpcid %0, %1" : : "m"(descriptor), "r"(invpcidSingleContext) : "memory");
+	}
+
+public:
+	// `pcid` must be unique among live address spaces, from 1 to `maxPcid`
+	AddressSpace(SharedPageFrames &pageFrames, const PageTables &kernel, UINT16 pcid) :
+		m_tables(pageFrames, kernel, base),
+		m_pcid(pcid)
+	{
+		if (pcid == 0 || pcid > maxPcid)
+			fatalError();
+		flushPcid();
+	}
+
+	// The tables stay allocated, only the translations of the PCID go
+	~AddressSpace(void) {
+		flushPcid();
+	}
+
+	PageTables& getTables(void) {
+		return m_tables;
+	}
+
+	UINT16 getPcid(void) const {
+		return m_pcid;
+	}
+
+	// Switches this CPU over, without flushing the TLB when PCIDs are enabled
+	void activate(void) {
+		static constexpr UINT64 cr3NoFlush = static_cast<UINT64>(1) << 63;
+		if (AsmReadCr4() & PageTables::cr4Pcid)
+			AsmWriteCr3(m_tables.getRoot() | m_pcid | cr3NoFlush);
+		else
+			AsmWriteCr3(m_tables.getRoot());
+	}
+
+	// Switches `switchCount` times between `a` and `b`, reading one byte of each of `pageCount` pages at `base` in the
+	// address space switched to, then of as many pages at `kernelPages`, with the TLB features currently set
+	// Returns the time of one switch and its reads in nanoseconds.
+	static UINT64 benchmark(const Clock &clock, AddressSpace &a, AddressSpace &b, const UINT8 *kernelPages, UINTN pageCount, UINTN switchCount) {
+		auto touch = [pageCount](const volatile UINT8 *pages) {
+			UINTN sum = 0;
+			for (UINTN i = 0; i < pageCount; i++)
+				sum += pages[i * EFI_PAGE_SIZE];
+			asm volatile("" : : "r"(sum));
+		};
+		auto begin = clock.now();
+		for (UINTN i = 0; i < switchCount; i++) {
+			(i & 1 ? b : a).activate();
+			touch(reinterpret_cast<const UINT8*>(base));
+			touch(kernelPages);
+		}
+		auto cycles = clock.now() - begin;
+		return switchCount > 0 ? clock.toMicroseconds(cycles * 1000 / switchCount) : 0;
+	}
+};
+
+}
\ No newline at end of file
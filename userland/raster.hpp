@@ -0,0 +1,217 @@
+#pragma once
+
+extern "C" {
+
+#include <Uefi.h>
+#include <Library/BaseLib.h>
+#include <Library/BaseMemoryLib.h>
+
+}
+
+#include <immintrin.h>
+
+namespace bare {
+
+class CpuFeatures
+{
+public:
+	bool sse2 = false;
+	bool avx2 = false;
+	// Enhanced `rep movsb`/`rep stosb`
+	bool erms = false;
+
+	static CpuFeatures query(void) {
+		CpuFeatures res;
+
+		UINT32 maxLeaf, eax, ebx, ecx, edx;
+		AsmCpuid(0, &maxLeaf, nullptr, nullptr, nullptr);
+
+		AsmCpuid(1, &eax, &ebx, &ecx, &edx);
+		res.sse2 = (edx >> 26) & 1;
+		bool osxsave = (ecx >> 27) & 1;
+		bool avx = (ecx >> 28) & 1;
+
+		// AVX state must also be enabled by the OS (firmware here) in XCR0, otherwise AVX instructions fault
+		bool avxStateEnabled = false;
+		if (osxsave && avx) {
+			static constexpr UINT64 xcr0SseAvx = (1 << 1) | (1 << 2);
+			avxStateEnabled = (AsmXGetBv(0) & xcr0SseAvx) == xcr0SseAvx;
+		}
+
+		if (maxLeaf >= 7) {
+			AsmCpuidEx(7, 0, &eax, &ebx, &ecx, &edx);
+			res.avx2 = avxStateEnabled && ((ebx >> 5) & 1);
+			res.erms = (ebx >> 9) & 1;
+		}
+		return res;
+	}
+};
+
+// Span kernels operating on native 32-bit pixels, every pointer may be unaligned
+namespace raster {
+
+namespace scalar {
+
+static void fillSpan(UINT32 *dst, UINTN count, UINT32 color) {
+	for (UINTN i = 0; i < count; i++)
+		dst[i] = color;
+}
+
+static void blitKeyed(UINT32 *dst, const UINT32 *src, UINTN count, UINT32 colorKey) {
+	for (UINTN i = 0; i < count; i++)
+		if (src[i] != colorKey)
+			dst[i] = src[i];
+}
+
+static void copyRow(UINT32 *dst, const UINT32 *src, UINTN count) {
+	CopyMem(dst, src, count * sizeof(UINT32));
+}
+
+}
+
+namespace sse2 {
+
+__attribute__((target("sse2"))) static void fillSpan(UINT32 *dst, UINTN count, UINT32 color) {
+	UINTN i = 0;
+	// Align the destination so that the bulk of the stores don't straddle cache lines
+	for (; i < count && (reinterpret_cast<UINTN>(dst + i) & 0xF) != 0; i++)
+		dst[i] = color;
+
+	auto v = _mm_set1_epi32(static_cast<int>(color));
+	for (; i + 16 <= count; i += 16) {
+		_mm_store_si128(reinterpret_cast<__m128i*>(dst + i), v);
+		_mm_store_si128(reinterpret_cast<__m128i*>(dst + i + 4), v);
+		_mm_store_si128(reinterpret_cast<__m128i*>(dst + i + 8), v);
+		_mm_store_si128(reinterpret_cast<__m128i*>(dst + i + 12), v);
+	}
+	for (; i + 4 <= count; i += 4)
+		_mm_store_si128(reinterpret_cast<__m128i*>(dst + i), v);
+	for (; i < count; i++)
+		dst[i] = color;
+}
+
+__attribute__((target("sse2"))) static void blitKeyed(UINT32 *dst, const UINT32 *src, UINTN count, UINT32 colorKey) {
+	auto key = _mm_set1_epi32(static_cast<int>(colorKey));
+	UINTN i = 0;
+	for (; i + 4 <= count; i += 4) {
+		auto s = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + i));
+		auto d = _mm_loadu_si128(reinterpret_cast<const __m128i*>(dst + i));
+		auto transparent = _mm_cmpeq_epi32(s, key);
+		auto res = _mm_or_si128(_mm_and_si128(transparent, d), _mm_andnot_si128(transparent, s));
+		_mm_storeu_si128(reinterpret_cast<__m128i*>(dst + i), res);
+	}
+	scalar::blitKeyed(dst + i, src + i, count - i, colorKey);
+}
+
+__attribute__((target("sse2"))) static void copyRow(UINT32 *dst, const UINT32 *src, UINTN count) {
+	UINTN i = 0;
+	for (; i < count && (reinterpret_cast<UINTN>(dst + i) & 0xF) != 0; i++)
+		dst[i] = src[i];
+	for (; i + 16 <= count; i += 16) {
+		auto a = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + i));
+		auto b = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + i + 4));
+		auto c = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + i + 8));
+		auto d = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + i + 12));
+		_mm_store_si128(reinterpret_cast<__m128i*>(dst + i), a);
+		_mm_store_si128(reinterpret_cast<__m128i*>(dst + i + 4), b);
+		_mm_store_si128(reinterpret_cast<__m128i*>(dst + i + 8), c);
+		_mm_store_si128(reinterpret_cast<__m128i*>(dst + i + 12), d);
+	}
+	for (; i < count; i++)
+		dst[i] = src[i];
+}
+
+}
+
+namespace avx2 {
+
+__attribute__((target("avx2"))) static void fillSpan(UINT32 *dst, UINTN count, UINT32 color) {
+	UINTN i = 0;
+	for (; i < count && (reinterpret_cast<UINTN>(dst + i) & 0x1F) != 0; i++)
+		dst[i] = color;
+
+	auto v = _mm256_set1_epi32(static_cast<int>(color));
+	for (; i + 32 <= count; i += 32) {
+		_mm256_store_si256(reinterpret_cast<__m256i*>(dst + i), v);
+		_mm256_store_si256(reinterpret_cast<__m256i*>(dst + i + 8), v);
+		_mm256_store_si256(reinterpret_cast<__m256i*>(dst + i + 16), v);
+		_mm256_store_si256(reinterpret_cast<__m256i*>(dst + i + 24), v);
+	}
+	for (; i + 8 <= count; i += 8)
+		_mm256_store_si256(reinterpret_cast<__m256i*>(dst + i), v);
+	for (; i < count; i++)
+		dst[i] = color;
+}
+
+__attribute__((target("avx2"))) static void blitKeyed(UINT32 *dst, const UINT32 *src, UINTN count, UINT32 colorKey) {
+	auto key = _mm256_set1_epi32(static_cast<int>(colorKey));
+	UINTN i = 0;
+	for (; i + 8 <= count; i += 8) {
+		auto s = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(src + i));
+		auto d = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(dst + i));
+		auto transparent = _mm256_cmpeq_epi32(s, key);
+		_mm256_storeu_si256(reinterpret_cast<__m256i*>(dst + i), _mm256_blendv_epi8(s, d, transparent));
+	}
+	scalar::blitKeyed(dst + i, src + i, count - i, colorKey);
+}
+
+__attribute__((target("avx2"))) static void copyRow(UINT32 *dst, const UINT32 *src, UINTN count) {
+	UINTN i = 0;
+	for (; i < count && (reinterpret_cast<UINTN>(dst + i) & 0x1F) != 0; i++)
+		dst[i] = src[i];
+	for (; i + 32 <= count; i += 32) {
+		auto a = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(src + i));
+		auto b = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(src + i + 8));
+		auto c = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(src + i + 16));
+		auto d = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(src + i + 24));
+		_mm256_store_si256(reinterpret_cast<__m256i*>(dst + i), a);
+		_mm256_store_si256(reinterpret_cast<__m256i*>(dst + i + 8), b);
+		_mm256_store_si256(reinterpret_cast<__m256i*>(dst + i + 16), c);
+		_mm256_store_si256(reinterpret_cast<__m256i*>(dst + i + 24), d);
+	}
+	for (; i < count; i++)
+		dst[i] = src[i];
+}
+
+}
+
+struct Kernels
+{
+	const char16_t *name;
+	void (*fillSpan)(UINT32 *dst, UINTN count, UINT32 color);
+	// Pixels of `src` equal to `colorKey` are left untouched in `dst`
+	void (*blitKeyed)(UINT32 *dst, const UINT32 *src, UINTN count, UINT32 colorKey);
+	// `dst` and `src` must not overlap
+	void (*copyRow)(UINT32 *dst, const UINT32 *src, UINTN count);
+
+	static const Kernels& select(const CpuFeatures &features) {
+		static constexpr Kernels scalarKernels {
+			.name = u"scalar",
+			.fillSpan = scalar::fillSpan,
+			.blitKeyed = scalar::blitKeyed,
+			.copyRow = scalar::copyRow
+		};
+		static constexpr Kernels sse2Kernels {
+			.name = u"SSE2",
+			.fillSpan = sse2::fillSpan,
+			.blitKeyed = sse2::blitKeyed,
+			.copyRow = sse2::copyRow
+		};
+		static constexpr Kernels avx2Kernels {
+			.name = u"AVX2",
+			.fillSpan = avx2::fillSpan,
+			.blitKeyed = avx2::blitKeyed,
+			.copyRow = avx2::copyRow
+		};
+
+		if (features.avx2)
+			return avx2Kernels;
+		if (features.sse2)
+			return sse2Kernels;
+		return scalarKernels;
+	}
+};
+
+}
+
+}
\ No newline at end of file
@@ -0,0 +1,304 @@
+#pragma once
+
+extern "C" {
+
+#include <Uefi.h>
+#include <Library/BaseLib.h>
+#include <Library/BaseMemoryLib.h>
+
+}
+
+#include "bare.hpp"
+#include "paging.hpp"
+#include "jobs.hpp"
+#include "usermode.hpp"
+
+// Position-independent ring 3 programs making rsi null operations with the rings at rdi, copied into a user page by
+// `bare::SharedRings::benchmark`: one syscall each, batches of 32 handed over with the doorbell syscall, or submissions
+// only while a kernel core polls. All of them exit with the TSC cycles the operations took.
+// Offsets mirror `bare::SharedRings::Area`.
+asm(R"(
+	.pushsection .text
+	.global bareRingProgramBegin
+	.global bareRingPerSyscall
+	.global bareRingDoorbell
+	.global bareRingPolling
+	.global bareRingProgramEnd
+bareRingProgramBegin:
+bareRingPerSyscall:
+	movq %rsi, %r13
+	lfence
+	rdtsc
+	shlq $32, %rdx
+	orq %rdx, %rax
+	movq %rax, %r15
+1:
+	movl $1, %eax
+	syscall
+	decq %r13
+	jnz 1b
+	jmp bareRingProgramExit
+
+bareRingDoorbell:
+	movq %rdi, %r12
+	movq %rsi, %r13
+	lfence
+	rdtsc
+	shlq $32, %rdx
+	orq %rdx, %rax
+	movq %rax, %r15
+	movl 64(%r12), %ebx
+1:
+	movl $32, %ecx
+	cmpq %rcx, %r13
+	cmovbq %r13, %rcx
+	subq %rcx, %r13
+2:
+	movl %ebx, %eax
+	andl $63, %eax
+	shll $6, %eax
+	leaq 4096(%r12, %rax), %rax
+	movq %rbx, (%rax)
+	movq $1, 8(%rax)
+	incl %ebx
+	decq %rcx
+	jnz 2b
+	movl %ebx, 64(%r12)
+	movl $2, %eax
+	syscall
+	movl 192(%r12), %ebp
+	movl %ebp, 128(%r12)
+	testq %r13, %r13
+	jnz 1b
+	jmp bareRingProgramExit
+
+bareRingPolling:
+	movq %rdi, %r12
+	movq %rsi, %r13
+	movq %rsi, %r14
+	lfence
+	rdtsc
+	shlq $32, %rdx
+	orq %rdx, %rax
+	movq %rax, %r15
+	movl 64(%r12), %ebx
+	movl 128(%r12), %ebp
+1:
+	testq %r13, %r13
+	jz 2f
+	movl %ebx, %ecx
+	subl (%r12), %ecx
+	cmpl $64, %ecx
+	jae 2f
+	movl %ebx, %eax
+	andl $63, %eax
+	shll $6, %eax
+	leaq 4096(%r12, %rax), %rax
+	movq %rbx, (%rax)
+	movq $1, 8(%rax)
+	incl %ebx
+	movl %ebx, 64(%r12)
+	decq %r13
+	jmp 1b
+2:
+	movl 192(%r12), %eax
+	movl %eax, %ecx
+	subl %ebp, %ecx
+	subq %rcx, %r14
+	movl %eax, %ebp
+	movl %ebp, 128(%r12)
+	testq %r14, %r14
+	jz bareRingProgramExit
+	testl %ecx, %ecx
+	jnz 1b
+	pause
+	jmp 1b
+
+bareRingProgramExit:
+	lfence
+	rdtsc
+	shlq $32, %rdx
+	orq %rdx, %rax
+	subq %r15, %rax
+	movq %rax, %rdi
+	xorl %eax, %eax
+	syscall
+	ud2
+bareRingProgramEnd:
+	.popsection
+)");
+
+extern "C" const UINT8 bareRingProgramBegin[];
+extern "C" const UINT8 bareRingPerSyscall[];
+extern "C" const UINT8 bareRingDoorbell[];
+extern "C" const UINT8 bareRingPolling[];
+extern "C" const UINT8 bareRingProgramEnd[];
+
+namespace bare {
+
+// Submission and completion rings shared between a ring 3 program and the kernel, in the manner of io_uring
+// Each ring has a single producer and a single consumer, and indices only ever grow: entries sit at `index % entryCount`.
+// Submissions name a syscall and its arguments, so that the program can queue many of them and hand them all over with
+// one `syscallEnter`, or with no syscall at all while a kernel core runs `poll`. Submissions are only consumed while
+// their completion fits. Handlers then run on that core, so they must be safe from any CPU.
+class SharedRings
+{
+public:
+	static inline constexpr UINTN entryCount = 64;
+	// Consumes submissions, returns how many
+	static inline constexpr UINT64 syscallEnter = 2;
+
+	struct Submission {
+		UINT64 userData;
+		UINT64 number;
+		UINT64 args[6];
+	};
+
+	struct Completion {
+		UINT64 userData;
+		UINT64 result;
+	};
+
+	// Heads and tails on cache lines of their own, as each is written by one side only
+	struct Area {
+		// Written by the kernel
+		alignas(64) UINT32 submissionHead;
+		// Written by the program
+		alignas(64) UINT32 submissionTail;
+		alignas(64) UINT32 completionHead;
+		// Written by the kernel
+		alignas(64) UINT32 completionTail;
+		alignas(64) Completion completions[entryCount];
+		alignas(4096) Submission submissions[entryCount];
+	};
+	static_assert(OFFSET_OF(Area, submissionTail) == 64 && OFFSET_OF(Area, completionHead) == 128);
+	static_assert(OFFSET_OF(Area, completionTail) == 192 && OFFSET_OF(Area, submissions) == 4096);
+	static_assert(sizeof(Submission) == 64 && sizeof(Area) == 2 * EFI_PAGE_SIZE);
+
+	// Where `map` puts the rings in address spaces, past the pages of `UserMode::benchmark`
+	static inline constexpr UINTN userAddress = AddressSpace::base + 16 * EFI_PAGE_SIZE;
+
+	struct Throughput {
+		UINT64 perSyscall;
+		UINT64 doorbell;
+		// 0 when no kernel core could poll
+		UINT64 polling;
+	};
+
+private:
+	static inline constexpr UINTN areaOrder = 1;
+
+	static inline SharedRings *s_instance = nullptr;
+
+	SharedPageFrames &m_pageFrames;
+	Area *m_area;
+	UINT32 m_isPolling = 0;
+	UINT32 m_stopPolling = 0;
+
+	__attribute__((sysv_abi)) static UINT64 enter(UINT64, UINT64, UINT64, UINT64, UINT64, UINT64) {
+		return s_instance->drain();
+	}
+
+public:
+	// The rings take page frames of their own, and `syscallEnter` is registered with `userMode`
+	SharedRings(UserMode &userMode, SharedPageFrames &pageFrames) :
+		m_pageFrames(pageFrames),
+		m_area(reinterpret_cast<Area*>(pageFrames.allocate(areaOrder)))
+	{
+		if (m_area == nullptr)
+			fatalError();
+		SetMem(m_area, sizeof(Area), 0);
+		s_instance = this;
+		userMode.setSyscall(syscallEnter, enter);
+	}
+
+	// The kernel reaches the rings through the identity map, programs at `userAddress`
+	void map(AddressSpace &space) {
+		space.getTables().map(userAddress, reinterpret_cast<UINTN>(m_area), sizeof(Area), PageTables::user | PageTables::writable);
+	}
+
+	void unmap(AddressSpace &space) {
+		space.getTables().unmap(userAddress, sizeof(Area));
+	}
+
+	// Runs the submissions published so far, for as long as their completions fit
+	// Entries are copied out before use, as the program may scribble over them meanwhile.
+	UINTN drain(void) {
+		auto head = m_area->submissionHead;
+		auto tail = __atomic_load_n(&m_area->submissionTail, __ATOMIC_ACQUIRE);
+		auto completionTail = m_area->completionTail;
+		auto completionHead = __atomic_load_n(&m_area->completionHead, __ATOMIC_ACQUIRE);
+		UINTN count = 0;
+		for (; head != tail; head++, count++) {
+			if (completionTail - completionHead == entryCount) {
+				completionHead = __atomic_load_n(&m_area->completionHead, __ATOMIC_ACQUIRE);
+				if (completionTail - completionHead == entryCount)
+					break;
+			}
+			Submission submission;
+			CopyMem(&submission, &m_area->submissions[head % entryCount], sizeof(submission));
+			auto result = submission.number == syscallEnter ? ~static_cast<UINT64>(0) : UserMode::call(submission.number, submission.args);
+			m_area->completions[completionTail % entryCount] = Completion { submission.userData, result };
+			completionTail++;
+		}
+		__atomic_store_n(&m_area->submissionHead, head, __ATOMIC_RELEASE);
+		__atomic_store_n(&m_area->completionTail, completionTail, __ATOMIC_RELEASE);
+		return count;
+	}
+
+	// Drains the rings from a kernel core until `stopPolling`
+	void poll(void) {
+		__atomic_store_n(&m_isPolling, 1, __ATOMIC_RELEASE);
+		while (!__atomic_load_n(&m_stopPolling, __ATOMIC_ACQUIRE))
+			if (drain() == 0)
+				CpuPause();
+		drain();
+		__atomic_store_n(&m_isPolling, 0, __ATOMIC_RELEASE);
+	}
+
+	void stopPolling(void) {
+		__atomic_store_n(&m_stopPolling, 1, __ATOMIC_RELEASE);
+	}
+
+	// Makes `count` null operations from a ring 3 program in `space`: one syscall each, then through the rings with
+	// the doorbell, then through the rings polled by a worker of `jobSystem` when one picks the job up within 100ms
+	// Returns operations per second. See `UserMode::runProgram` for the pages it takes. Must be called from the BSP.
+	Throughput benchmark(UserMode &userMode, AddressSpace &space, JobSystem &jobSystem, const Clock &clock, UINTN count) {
+		Throughput res { 0, 0, 0 };
+		if (count == 0)
+			return res;
+		map(space);
+		userMode.runProgram(space, m_pageFrames, bareRingProgramBegin, bareRingProgramEnd, [&](UserMode::Program &program) {
+			auto measure = [&](const UINT8 *label) {
+				auto cycles = program.measure(label, userAddress, count);
+				return cycles > 0 ? count * clock.getTscFrequency() / cycles : 0;
+			};
+			res.perSyscall = measure(bareRingPerSyscall);
+			res.doorbell = measure(bareRingDoorbell);
+
+			UINTN pendingCount = 1;
+			auto job = Job {
+				.function = [](Job &job, JobSystem&) {
+					reinterpret_cast<SharedRings*>(job.context)->poll();
+				},
+				.context = this,
+				.argument = 0,
+				.pendingCount = &pendingCount
+			};
+			__atomic_store_n(&m_stopPolling, 0, __ATOMIC_RELAXED);
+			jobSystem.submit(job);
+			auto deadline = clock.getDeadlineIn(100000);
+			while (!__atomic_load_n(&m_isPolling, __ATOMIC_ACQUIRE) && !clock.hasPassed(deadline))
+				CpuPause();
+			if (__atomic_load_n(&m_isPolling, __ATOMIC_ACQUIRE))
+				res.polling = measure(bareRingPolling);
+			// Runs the job right away when no worker took it
+			stopPolling();
+			jobSystem.wait(pendingCount);
+		});
+		unmap(space);
+		return res;
+	}
+};
+
+}
\ No newline at end of file
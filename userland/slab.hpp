@@ -0,0 +1,289 @@
+#pragma once
+
+extern "C" {
+
+#include <Uefi.h>
+#include <Library/BaseLib.h>
+
+}
+
+#include "bare.hpp"
+#include "frames.hpp"
+#include "smp.hpp"
+#include "jobs.hpp"
+
+namespace bare {
+
+// Cache of fixed-size objects, with per-CPU magazines in the manner of Bonwick
+// Each CPU owns two magazines of object pointers, and allocations and frees only touch those for as long as one of them
+// isn't empty (resp. full): no lock nor atomic on that path. Otherwise whole magazines are exchanged with a depot shared
+// under a lock, which carves new objects out of 64KiB slabs of page frames. Objects are never handed back to the frames.
+class SlabCache
+{
+public:
+	static inline constexpr UINTN magazineCapacity = 30;
+
+private:
+	static inline constexpr UINTN slabOrder = 4;
+
+	struct Magazine {
+		Magazine *next;
+		UINTN count;
+		void *objects[magazineCapacity];
+	};
+	static_assert(sizeof(Magazine) == 256);
+
+	// On their own cache line, so that CPUs never share one on the fast path
+	struct alignas(64) CpuCache {
+		Magazine *loaded;
+		Magazine *previous;
+	};
+
+	SharedPageFrames &m_pageFrames;
+	UINTN m_objectSize;
+	CpuCache *m_cpuCaches;
+
+	SpinLock m_depotLock;
+	Magazine *m_fullMagazines = nullptr;
+	Magazine *m_emptyMagazines = nullptr;
+	// Objects freed while no empty magazine could be made, linked through their first bytes
+	void *m_looseObjects = nullptr;
+	UINTN m_slabCurrent = 0;
+	UINTN m_slabEnd = 0;
+	UINTN m_magazineCurrent = 0;
+	UINTN m_magazineEnd = 0;
+	UINTN m_slabCount = 0;
+
+	// Depot lock held
+	void* carveObject(void) {
+		if (m_looseObjects != nullptr) {
+			auto res = m_looseObjects;
+			m_looseObjects = *reinterpret_cast<void**>(res);
+			return res;
+		}
+		if (m_slabEnd - m_slabCurrent < m_objectSize) {
+			auto slab = m_pageFrames.allocate(slabOrder);
+			if (slab == nullptr)
+				return nullptr;
+			m_slabCurrent = reinterpret_cast<UINTN>(slab);
+			m_slabEnd = m_slabCurrent + (EFI_PAGE_SIZE << slabOrder);
+			m_slabCount++;
+		}
+		auto res = reinterpret_cast<void*>(m_slabCurrent);
+		m_slabCurrent += m_objectSize;
+		return res;
+	}
+
+	// Depot lock held, empty magazines are recycled first
+	Magazine* takeEmptyMagazine(void) {
+		if (m_emptyMagazines != nullptr) {
+			auto res = m_emptyMagazines;
+			m_emptyMagazines = res->next;
+			return res;
+		}
+		if (m_magazineCurrent == m_magazineEnd) {
+			auto page = m_pageFrames.allocate(0);
+			if (page == nullptr)
+				return nullptr;
+			m_magazineCurrent = reinterpret_cast<UINTN>(page);
+			m_magazineEnd = m_magazineCurrent + EFI_PAGE_SIZE;
+		}
+		auto res = reinterpret_cast<Magazine*>(m_magazineCurrent);
+		m_magazineCurrent += sizeof(Magazine);
+		res->count = 0;
+		return res;
+	}
+
+	static void pushMagazine(Magazine *&list, Magazine *magazine) {
+		magazine->next = list;
+		list = magazine;
+	}
+
+	// Both magazines of `cache` are empty: trades one for a full magazine of the depot, or fills it from slabs
+	bool refill(CpuCache &cache) {
+		m_depotLock.lock();
+		if (m_fullMagazines != nullptr) {
+			auto full = m_fullMagazines;
+			m_fullMagazines = full->next;
+			pushMagazine(m_emptyMagazines, cache.previous);
+			cache.previous = cache.loaded;
+			cache.loaded = full;
+		} else {
+			auto magazine = cache.loaded;
+			while (magazine->count < magazineCapacity) {
+				auto object = carveObject();
+				if (object == nullptr)
+					break;
+				magazine->objects[magazine->count++] = object;
+			}
+		}
+		m_depotLock.unlock();
+		return cache.loaded->count > 0;
+	}
+
+	// Both magazines of `cache` are full: hands one over to the depot against an empty one
+	void flush(CpuCache &cache, void *object) {
+		m_depotLock.lock();
+		auto empty = takeEmptyMagazine();
+		if (empty == nullptr) {
+			*reinterpret_cast<void**>(object) = m_looseObjects;
+			m_looseObjects = object;
+		} else {
+			pushMagazine(m_fullMagazines, cache.previous);
+			cache.previous = cache.loaded;
+			cache.loaded = empty;
+			empty->objects[empty->count++] = object;
+		}
+		m_depotLock.unlock();
+	}
+
+public:
+	// `objectSize` is rounded up to a multiple of 16 and may not exceed 64KiB, objects are aligned on the largest power
+	// of two dividing it. Carves the caches of `cpuCount` CPUs out of `allocator`, to index by `PerCpu::index`.
+	SlabCache(UINTN objectSize, UINTN cpuCount, SharedPageFrames &pageFrames, BumpAllocator &allocator) :
+		m_pageFrames(pageFrames),
+		m_objectSize((objectSize + 15) & ~static_cast<UINTN>(15)),
+		m_cpuCaches(allocator.allocateArray<CpuCache>(cpuCount))
+	{
+		if (m_objectSize > (EFI_PAGE_SIZE << slabOrder))
+			fatalError();
+		for (UINTN i = 0; i < cpuCount; i++) {
+			m_cpuCaches[i].loaded = takeEmptyMagazine();
+			m_cpuCaches[i].previous = takeEmptyMagazine();
+			if (m_cpuCaches[i].loaded == nullptr || m_cpuCaches[i].previous == nullptr)
+				fatalError();
+		}
+	}
+
+	UINTN getObjectSize(void) const {
+		return m_objectSize;
+	}
+
+	UINTN getSlabCount(void) const {
+		return m_slabCount;
+	}
+
+	// Returns nullptr once page frames ran out
+	void* allocate(void) {
+		auto &cache = m_cpuCaches[thisCpu().index];
+		if (cache.loaded->count == 0) {
+			if (cache.previous->count > 0) {
+				auto magazine = cache.loaded;
+				cache.loaded = cache.previous;
+				cache.previous = magazine;
+			} else if (!refill(cache)) {
+				return nullptr;
+			}
+		}
+		return cache.loaded->objects[--cache.loaded->count];
+	}
+
+	// From any CPU, not only the one `object` was allocated on
+	void free(void *object) {
+		auto &cache = m_cpuCaches[thisCpu().index];
+		if (cache.loaded->count == magazineCapacity) {
+			if (cache.previous->count < magazineCapacity) {
+				auto magazine = cache.loaded;
+				cache.loaded = cache.previous;
+				cache.previous = magazine;
+			} else {
+				flush(cache, object);
+				return;
+			}
+		}
+		cache.loaded->objects[cache.loaded->count++] = object;
+	}
+
+	// Allocates then frees batches of 64 objects on 1 to `maxCpuCount` CPUs at once, `operationCount` allocations and
+	// as many frees on each. Fn is a `void (UINTN cpuCount, UINT64 nanosecondsPerOperation)` called after each run,
+	// with the time of one operation as seen by one CPU: it stays flat for as long as CPUs don't contend.
+	// Must be called from the BSP.
+	template <typename Fn>
+	void benchmark(JobSystem &jobSystem, const Clock &clock, UINTN maxCpuCount, UINTN operationCount, Fn &&fn) {
+		static constexpr UINTN batchSize = 64;
+		auto run = [this, operationCount](UINTN) {
+			void *objects[batchSize];
+			for (UINTN i = 0; i < operationCount; i += batchSize) {
+				for (UINTN j = 0; j < batchSize; j++)
+					objects[j] = allocate();
+				for (UINTN j = 0; j < batchSize; j++)
+					if (objects[j] != nullptr)
+						free(objects[j]);
+			}
+		};
+
+		if (maxCpuCount > jobSystem.getWorkerCount())
+			maxCpuCount = jobSystem.getWorkerCount();
+		for (UINTN cpuCount = 1; cpuCount <= maxCpuCount; cpuCount++) {
+			jobSystem.setActiveCount(cpuCount);
+			// Warms the caches and carves the slabs up first
+			jobSystem.parallelFor(cpuCount, 1, run);
+			auto begin = clock.now();
+			jobSystem.parallelFor(cpuCount, 1, run);
+			auto cycles = clock.now() - begin;
+			fn(cpuCount, clock.toMicroseconds(cycles * 1000 / (2 * ((operationCount + batchSize - 1) / batchSize) * batchSize)));
+		}
+		jobSystem.setActiveCount(jobSystem.getWorkerCount());
+	}
+};
+
+// Bump allocation out of a fixed block, for scratch data dropped all at once, e.g. at the end of each frame
+// Unlike `BumpAllocator`, running out isn't fatal and `reset` makes the whole block available again in O(1).
+class ScratchArena
+{
+	UINTN m_base;
+	UINTN m_size;
+	UINTN m_offset = 0;
+	UINTN m_highWater = 0;
+
+public:
+	ScratchArena(void *base, UINTN size) :
+		m_base(reinterpret_cast<UINTN>(base)),
+		m_size(size)
+	{
+	}
+
+	// `alignment` must be a power of two, returns nullptr when the block is full
+	void* allocate(UINTN size, UINTN alignment) {
+		auto aligned = (m_base + m_offset + alignment - 1) & ~(alignment - 1);
+		auto offset = aligned - m_base;
+		if (offset > m_size || size > m_size - offset)
+			return nullptr;
+		m_offset = offset + size;
+		return reinterpret_cast<void*>(aligned);
+	}
+
+	template <typename T>
+	T* allocateArray(UINTN count) {
+		return reinterpret_cast<T*>(allocate(count * sizeof(T), alignof(T)));
+	}
+
+	void reset(void) {
+		m_highWater = m_offset > m_highWater ? m_offset : m_highWater;
+		m_offset = 0;
+	}
+
+	// Most bytes ever in use between two resets
+	UINTN getHighWater(void) const {
+		return m_offset > m_highWater ? m_offset : m_highWater;
+	}
+
+	// Allocates `operationCount` objects of `objectSize` bytes, resetting whenever the block is full
+	// Returns the time of one allocation in nanoseconds.
+	UINT64 benchmark(const Clock &clock, UINTN objectSize, UINTN operationCount) {
+		auto begin = clock.now();
+		for (UINTN i = 0; i < operationCount; i++) {
+			auto object = allocate(objectSize, 16);
+			if (object == nullptr) {
+				reset();
+				object = allocate(objectSize, 16);
+			}
+			asm volatile("" : : "r"(object) : "memory");
+		}
+		auto cycles = clock.now() - begin;
+		reset();
+		return operationCount > 0 ? clock.toMicroseconds(cycles * 1000 / operationCount) : 0;
+	}
+};
+
+}
\ No newline at end of file
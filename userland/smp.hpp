@@ -0,0 +1,364 @@
+#pragma once
+
+extern "C" {
+
+#include <Uefi.h>
+#include <Library/BaseLib.h>
+#include <Library/BaseMemoryLib.h>
+
+}
+
+#include "bare.hpp"
+#include "descriptors.hpp"
+#include "paging.hpp"
+
+// Real mode entry point of the APs, copied to a page below 1MiB whose number is the SIPI vector
+// It goes straight from real mode to long mode using the BSP control registers and page tables,
+// then picks a slot with an atomic increment and calls `entry(slot)` on the stack of that slot.
+// The data block at its end mirrors `bare::Smp::TrampolineData`, and is patched by the BSP before startup.
+asm(R"(
+	.pushsection .text
+	.global smpTrampolineBegin
+	.global smpTrampolineData
+	.global smpTrampolineEnd
+	.balign 16
+smpTrampolineBegin:
+	.code16
+	cli
+	cld
+	movw %cs, %ax
+	movw %ax, %ds
+
+	lgdtl (smpTrampolineData + 24 - smpTrampolineBegin)
+
+	movl (smpTrampolineData + 44 - smpTrampolineBegin), %eax
+	movl %eax, %cr4
+	movl (smpTrampolineData + 40 - smpTrampolineBegin), %eax
+	movl %eax, %cr3
+
+	movl $0xC0000080, %ecx
+	rdmsr
+	orl (smpTrampolineData + 48 - smpTrampolineBegin), %eax
+	wrmsr
+
+	movl (smpTrampolineData + 52 - smpTrampolineBegin), %eax
+	movl %eax, %cr0
+
+	ljmpl *(smpTrampolineData + 32 - smpTrampolineBegin)
+
+	.code64
+smpTrampolineLongMode:
+	movw $0x10, %ax
+	movw %ax, %ds
+	movw %ax, %es
+	movw %ax, %ss
+	movw %ax, %fs
+	movw %ax, %gs
+
+	movq (smpTrampolineData + 56)(%rip), %rax
+	movq %rax, %cr4
+	btq $18, %rax
+	jnc 1f
+	movq (smpTrampolineData + 64)(%rip), %rax
+	movq %rax, %rdx
+	shrq $32, %rdx
+	xorl %ecx, %ecx
+	xsetbv
+1:
+	lidt (smpTrampolineData + 72)(%rip)
+
+	movl $1, %eax
+	lock xaddl %eax, (smpTrampolineData + 112)(%rip)
+	movl %eax, %edi
+	leaq 1(%rdi), %rcx
+	movq (smpTrampolineData + 104)(%rip), %rsp
+	imulq %rcx, %rsp
+	addq (smpTrampolineData + 96)(%rip), %rsp
+	movq (smpTrampolineData + 88)(%rip), %rax
+	callq *%rax
+2:
+	cli
+	hlt
+	jmp 2b
+
+	.balign 16
+smpTrampolineData:
+	.quad 0
+	.quad 0x00AF9A000000FFFF
+	.quad 0x00CF92000000FFFF
+	.word 23
+	.long 0
+	.word 0
+	.long smpTrampolineLongMode - smpTrampolineBegin
+	.word 0x08
+	.word 0
+	.fill 80, 1, 0
+smpTrampolineEnd:
+	.popsection
+)");
+
+extern "C" const UINT8 smpTrampolineBegin[];
+extern "C" const UINT8 smpTrampolineData[];
+extern "C" const UINT8 smpTrampolineEnd[];
+
+namespace bare {
+
+class LocalApic
+{
+	static inline constexpr UINT32 msrApicBase = 0x1B;
+	static inline constexpr UINT32 msrX2ApicBase = 0x800;
+
+	UINTN m_base;
+	bool m_isX2Apic;
+
+public:
+	static inline constexpr UINTN regId = 0x20;
+	static inline constexpr UINTN regEoi = 0xB0;
+	static inline constexpr UINTN regSpuriousVector = 0xF0;
+	static inline constexpr UINTN regIcrLow = 0x300;
+	static inline constexpr UINTN regIcrHigh = 0x310;
+	static inline constexpr UINTN regLvtTimer = 0x320;
+
+	static inline constexpr UINT32 icrInit = 0x4500;
+	static inline constexpr UINT32 icrStartup = 0x4600;
+	static inline constexpr UINT32 icrDeliveryPending = 1 << 12;
+
+	LocalApic(void) {
+		auto apicBase = AsmReadMsr64(msrApicBase);
+		m_base = apicBase & ~static_cast<UINTN>(0xFFF);
+		m_isX2Apic = (apicBase >> 10) & 1;
+	}
+
+	bool isX2Apic(void) const {
+		return m_isX2Apic;
+	}
+
+	// Physical base of the xAPIC registers, meaningless in x2APIC mode
+	UINTN getBase(void) const {
+		return m_base;
+	}
+
+	UINT32 read(UINTN reg) const {
+		if (m_isX2Apic)
+			return static_cast<UINT32>(AsmReadMsr64(msrX2ApicBase + (reg >> 4)));
+		return *reinterpret_cast<volatile UINT32*>(m_base + reg);
+	}
+
+	void write(UINTN reg, UINT32 value) const {
+		if (m_isX2Apic)
+			AsmWriteMsr64(msrX2ApicBase + (reg >> 4), value);
+		else
+			*reinterpret_cast<volatile UINT32*>(m_base + reg) = value;
+	}
+
+	UINT32 getId(void) const {
+		auto id = read(regId);
+		return m_isX2Apic ? id : id >> 24;
+	}
+
+	void sendIpi(UINT32 apicId, UINT32 icrLow) const {
+		if (m_isX2Apic) {
+			// The ICR is a single 64-bit MSR in x2APIC mode, and there is no delivery status to wait for
+			AsmWriteMsr64(msrX2ApicBase + (regIcrLow >> 4), (static_cast<UINT64>(apicId) << 32) | icrLow);
+			return;
+		}
+		write(regIcrHigh, apicId << 24);
+		write(regIcrLow, icrLow);
+		while (read(regIcrLow) & icrDeliveryPending)
+			CpuPause();
+	}
+
+	void sendEoi(void) const {
+		write(regEoi, 0);
+	}
+};
+
+// Per-CPU block, its address is the GS base of its CPU
+struct PerCpu
+{
+	PerCpu *self;
+	// 0 is the BSP, APs are numbered in order of arrival
+	UINTN index;
+	UINT32 apicId;
+	UINT8 *stackBase;
+	UINTN stackSize;
+};
+
+static inline constexpr UINT32 msrGsBase = 0xC0000101;
+
+[[maybe_unused]] static PerCpu& thisCpu(void) {
+	PerCpu *res;
+	asm volatile("movq %%gs:0, %0" : "=r"(res));
+	return *res;
+}
+
+// Bare metal AP startup, to call after `ExitBootServices`
+// APs go through the firmware page tables to reach long mode, as CR3 is loaded while still in real mode, then switch
+// over to the page tables and PAT of the BSP. Global pages are only enabled then, so that no firmware translation
+// outlives the switch. APs run on the GDT of the trampoline and the IDT of `DescriptorTables`, which the BSP must have
+// loaded first.
+class Smp
+{
+public:
+	static inline constexpr UINTN maxCpuCount = 256;
+	static inline constexpr UINTN stackSize = 64 * 1024;
+
+	// Gathered before `ExitBootServices`, see `boot::planSmp`
+	struct Plan {
+		UINTN trampolinePage;
+		// Firmware page tables, identity mapped below 4GiB: they must survive until the APs are online
+		UINTN bootCr3;
+		UINTN apCount;
+		UINT32 apApicIds[maxCpuCount - 1];
+	};
+
+	// Fn is called once on each AP with its `PerCpu` block, it may never return
+	using ApMain = void (*)(PerCpu &cpu, void *context);
+
+private:
+	struct __attribute__((packed)) TrampolineData {
+		UINT64 gdt[3];
+		UINT16 gdtLimit;
+		UINT32 gdtBase;
+		UINT16 pad0;
+		UINT32 longModeOffset;
+		UINT16 longModeSelector;
+		UINT16 pad1;
+		UINT32 cr3;
+		UINT32 cr4Boot;
+		UINT32 eferLow;
+		UINT32 cr0;
+		UINT64 cr4;
+		UINT64 xcr0;
+		UINT16 idtLimit;
+		UINT64 idtBase;
+		UINT8 pad2[6];
+		UINT64 entry;
+		UINT64 stacksBase;
+		UINT64 stackSize;
+		UINT32 counter;
+		UINT32 pad3;
+	};
+	static_assert(sizeof(TrampolineData) == 120);
+
+	static inline Smp *s_instance = nullptr;
+
+	LocalApic m_apic;
+	PerCpu *m_cpus;
+	UINTN m_cpuCount = 1;
+	UINTN m_onlineCount = 1;
+	ApMain m_apMain = nullptr;
+	void *m_apMainContext = nullptr;
+	UINT64 m_cr3 = 0;
+	UINT64 m_pat = 0;
+	UINT64 m_cr4 = 0;
+
+	__attribute__((sysv_abi)) static void apEntry(UINT32 slot) {
+		auto &self = *s_instance;
+		auto &cpu = self.m_cpus[slot + 1];
+		DescriptorTables::loadIdt();
+		AsmWriteMsr64(msrGsBase, reinterpret_cast<UINT64>(&cpu));
+		AsmWriteMsr64(MemoryCaching::msrPat, self.m_pat);
+		AsmWriteCr3(self.m_cr3);
+		AsmWriteCr4(self.m_cr4);
+		cpu.apicId = self.m_apic.getId();
+
+		__atomic_fetch_add(&self.m_onlineCount, 1, __ATOMIC_RELEASE);
+		self.m_apMain(cpu, self.m_apMainContext);
+	}
+
+	void initCpu(PerCpu &cpu, UINTN index, UINT8 *stacks) {
+		cpu.self = &cpu;
+		cpu.index = index;
+		cpu.apicId = 0;
+		// The BSP keeps the firmware stack, index 0 of `stacks` belongs to the first AP
+		cpu.stackBase = index == 0 ? nullptr : stacks + (index - 1) * stackSize;
+		cpu.stackSize = index == 0 ? 0 : stackSize;
+	}
+
+public:
+	// Carves the per-CPU blocks and stacks out of `allocator`, the BSP becomes CPU 0
+	Smp(const Plan &plan, BumpAllocator &allocator) :
+		m_cpus(allocator.allocateArray<PerCpu>(plan.apCount + 1)),
+		m_cpuCount(plan.apCount + 1)
+	{
+		s_instance = this;
+		auto stacks = reinterpret_cast<UINT8*>(allocator.allocate(plan.apCount * stackSize, EFI_PAGE_SIZE));
+		for (UINTN i = 0; i < m_cpuCount; i++)
+			initCpu(m_cpus[i], i, stacks);
+
+		m_cpus[0].apicId = m_apic.getId();
+		AsmWriteMsr64(msrGsBase, reinterpret_cast<UINT64>(&m_cpus[0]));
+	}
+
+	// Sends INIT-SIPI-SIPI to every AP of the plan, then waits up to 100ms for them to come online
+	// Returns the number of CPUs online, BSP included.
+	UINTN start(const Plan &plan, const Clock &clock, ApMain apMain, void *apMainContext) {
+		if (plan.apCount == 0)
+			return 1;
+		m_apMain = apMain;
+		m_apMainContext = apMainContext;
+
+		auto page = reinterpret_cast<UINT8*>(plan.trampolinePage);
+		CopyMem(page, smpTrampolineBegin, smpTrampolineEnd - smpTrampolineBegin);
+		auto &data = *reinterpret_cast<TrampolineData*>(page + (smpTrampolineData - smpTrampolineBegin));
+
+		static constexpr UINT64 cr4Pge = 1 << 7;
+		static constexpr UINT64 cr4Pcide = 1 << 17;
+		static constexpr UINT64 cr4Osxsave = 1 << 18;
+		static constexpr UINT32 msrEfer = 0xC0000080;
+		static constexpr UINT64 eferLmeNxe = (1 << 8) | (1 << 11);
+
+		data.gdtBase = static_cast<UINT32>(reinterpret_cast<UINTN>(data.gdt));
+		data.longModeOffset += static_cast<UINT32>(plan.trampolinePage);
+		data.cr3 = static_cast<UINT32>(plan.bootCr3);
+		// PCIDE can only be set once in long mode
+		data.cr4Boot = static_cast<UINT32>(AsmReadCr4() & ~(cr4Pcide | cr4Pge));
+		data.eferLow = static_cast<UINT32>(AsmReadMsr64(msrEfer) & eferLmeNxe);
+		data.cr0 = static_cast<UINT32>(AsmReadCr0());
+		data.cr4 = AsmReadCr4() & ~cr4Pge;
+		data.xcr0 = (data.cr4 & cr4Osxsave) ? AsmXGetBv(0) : 0;
+		// Loaded as soon as in long mode, then again by `apEntry`
+		auto idtr = DescriptorTables::getIdtr();
+		data.idtLimit = idtr.Limit;
+		data.idtBase = idtr.Base;
+		data.entry = reinterpret_cast<UINT64>(&apEntry);
+		data.stacksBase = reinterpret_cast<UINT64>(m_cpus[1].stackBase);
+		data.stackSize = stackSize;
+		data.counter = 0;
+		if (plan.bootCr3 >> 32)
+			fatalError();
+		m_cr3 = AsmReadCr3();
+		m_pat = AsmReadMsr64(MemoryCaching::msrPat);
+		m_cr4 = AsmReadCr4();
+
+		for (UINTN i = 0; i < plan.apCount; i++)
+			m_apic.sendIpi(plan.apApicIds[i], LocalApic::icrInit);
+		clock.spin(10000);
+		for (UINTN k = 0; k < 2; k++) {
+			for (UINTN i = 0; i < plan.apCount; i++)
+				m_apic.sendIpi(plan.apApicIds[i], LocalApic::icrStartup | static_cast<UINT32>(plan.trampolinePage >> 12));
+			clock.spin(200);
+		}
+
+		auto deadline = clock.getDeadlineIn(100000);
+		while (__atomic_load_n(&m_onlineCount, __ATOMIC_ACQUIRE) < m_cpuCount && !clock.hasPassed(deadline))
+			CpuPause();
+		return __atomic_load_n(&m_onlineCount, __ATOMIC_ACQUIRE);
+	}
+
+	// CPUs that made it online are always the first ones
+	UINTN getOnlineCount(void) const {
+		return __atomic_load_n(&m_onlineCount, __ATOMIC_ACQUIRE);
+	}
+
+	PerCpu& getCpu(UINTN index) {
+		return m_cpus[index];
+	}
+
+	const LocalApic& getLocalApic(void) const {
+		return m_apic;
+	}
+};
+
+}
\ No newline at end of file
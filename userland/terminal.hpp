@@ -0,0 +1,94 @@
+#pragma once
+
+extern "C" {
+
+#include <Uefi.h>
+#include <Library/PrintLib.h>
+
+}
+
+#include "bare.hpp"
+#include "font.hpp"
+#include <utility>
+
+namespace bare {
+
+// Text output drawn onto the framebuffer, the only way left to display anything after `ExitBootServices`
+// Every `print` is presented right away.
+class Terminal
+{
+	GraphicsOutputBase &m_graphicsOutput;
+	UINTN m_scale;
+	UINT32 m_foreground;
+	UINT32 m_background;
+	UINTN m_columnCount;
+	UINTN m_rowCount;
+	UINTN m_column = 0;
+	UINTN m_row = 0;
+
+	UINTN getRowHeight(void) const {
+		return font::cellHeight * m_scale;
+	}
+
+	void newLine(void) {
+		m_column = 0;
+		m_row++;
+		if (m_row < m_rowCount)
+			return;
+
+		// Scroll up by one text row
+		auto rowHeight = getRowHeight();
+		auto textHeight = m_rowCount * rowHeight;
+		for (UINTN y = 0; y + rowHeight < textHeight; y++)
+			m_graphicsOutput.copyRow(y, y + rowHeight);
+		m_graphicsOutput.fillRect(0, textHeight - rowHeight, m_graphicsOutput.getWidth(), rowHeight, m_background);
+		m_row--;
+	}
+
+public:
+	// Picks a scale fitting at least 100 columns, so that text stays readable on high resolutions
+	Terminal(GraphicsOutputBase &graphicsOutput, UINT32 foreground, UINT32 background) :
+		m_graphicsOutput(graphicsOutput),
+		m_scale(graphicsOutput.getWidth() / (font::cellWidth * 100) > 0 ? graphicsOutput.getWidth() / (font::cellWidth * 100) : 1),
+		m_foreground(foreground),
+		m_background(background),
+		m_columnCount(graphicsOutput.getWidth() / (font::cellWidth * m_scale)),
+		m_rowCount(graphicsOutput.getHeight() / (font::cellHeight * m_scale))
+	{
+		clear();
+	}
+
+	void clear(void) {
+		m_graphicsOutput.fillRect(0, 0, m_graphicsOutput.getWidth(), m_graphicsOutput.getHeight(), m_background);
+		m_column = 0;
+		m_row = 0;
+		m_graphicsOutput.present();
+	}
+
+	void putChar(CHAR16 c) {
+		if (c == u'\n') {
+			newLine();
+			return;
+		}
+		if (c == u'\r') {
+			m_column = 0;
+			return;
+		}
+		if (m_column == m_columnCount)
+			newLine();
+		font::drawChar(m_graphicsOutput, m_column * font::cellWidth * m_scale, m_row * getRowHeight(), m_scale, c, m_foreground, m_background);
+		m_column++;
+	}
+
+	// Same format as `Print`, output longer than 255 characters is truncated
+	template <typename ...Args>
+	void print(const CHAR16 *format, Args &&...args) {
+		CHAR16 buffer[256];
+		UnicodeSPrint(buffer, sizeof(buffer), format, std::forward<Args>(args)...);
+		for (UINTN i = 0; buffer[i] != u'\0'; i++)
+			putChar(buffer[i]);
+		m_graphicsOutput.present();
+	}
+};
+
+}
\ No newline at end of file
@@ -0,0 +1,220 @@
+#pragma once
+
+extern "C" {
+
+#include <Uefi.h>
+#include <Library/BaseLib.h>
+#include <Library/BaseMemoryLib.h>
+
+}
+
+#include "bare.hpp"
+#include "paging.hpp"
+#include "usermode.hpp"
+
+// Ring 3 side of `bare::TimePage`, position-independent and copied into a user page by `bare::TimePage::benchmark`
+// `bareUserTimeNow` turns the TSC into nanoseconds from the time page at rdi, retrying while the kernel updates it. It
+// returns them in rax and clobbers rcx, rdx and r8. The programs around it make rsi TSC reads or time reads then exit
+// with the TSC cycles they took, or exit with one time read. Offsets mirror `bare::TimePage::Data`.
+asm(R"(
+	.pushsection .text
+	.global bareTimeProgramBegin
+	.global bareUserTimeNow
+	.global bareTimeRdtscLoop
+	.global bareTimeReadLoop
+	.global bareTimeReadOnce
+	.global bareTimeProgramEnd
+bareTimeProgramBegin:
+bareUserTimeNow:
+	movl (%rdi), %r8d
+	testl $1, %r8d
+	jnz 1f
+	rdtsc
+	shlq $32, %rdx
+	orq %rdx, %rax
+	subq 16(%rdi), %rax
+	mulq 32(%rdi)
+	shrdq $32, %rdx, %rax
+	addq 24(%rdi), %rax
+	cmpl (%rdi), %r8d
+	jne bareUserTimeNow
+	retq
+1:
+	pause
+	jmp bareUserTimeNow
+
+bareTimeRdtscLoop:
+	movq %rsi, %r13
+	lfence
+	rdtsc
+	shlq $32, %rdx
+	orq %rdx, %rax
+	movq %rax, %r15
+1:
+	rdtsc
+	decq %r13
+	jnz 1b
+	jmp bareTimeProgramExit
+
+bareTimeReadLoop:
+	movq %rdi, %r12
+	movq %rsi, %r13
+	lfence
+	rdtsc
+	shlq $32, %rdx
+	orq %rdx, %rax
+	movq %rax, %r15
+1:
+	movq %r12, %rdi
+	callq bareUserTimeNow
+	decq %r13
+	jnz 1b
+	jmp bareTimeProgramExit
+
+bareTimeReadOnce:
+	callq bareUserTimeNow
+	movq %rax, %rdi
+	xorl %eax, %eax
+	syscall
+	ud2
+
+bareTimeProgramExit:
+	lfence
+	rdtsc
+	shlq $32, %rdx
+	orq %rdx, %rax
+	subq %r15, %rax
+	movq %rax, %rdi
+	xorl %eax, %eax
+	syscall
+	ud2
+bareTimeProgramEnd:
+	.popsection
+)");
+
+extern "C" const UINT8 bareTimeProgramBegin[];
+extern "C" const UINT8 bareTimeRdtscLoop[];
+extern "C" const UINT8 bareTimeReadLoop[];
+extern "C" const UINT8 bareTimeReadOnce[];
+extern "C" const UINT8 bareTimeProgramEnd[];
+
+namespace bare {
+
+// Page the kernel publishes read-only to ring 3, so that programs read time as nanoseconds without any syscall
+// Time is `nanosecondsBase + (tsc - tscBase) * multiplier >> 32` with a 128-bit product, so that it never overflows. The
+// kernel bumps `sequence` around updates, which readers check to retry on torn reads: a seqlock.
+class TimePage
+{
+public:
+	struct Data {
+		// Odd while an update is in progress
+		UINT32 sequence;
+		UINT32 reserved;
+		UINT64 tscFrequency;
+		UINT64 tscBase;
+		UINT64 nanosecondsBase;
+		// Nanoseconds per cycle, in 32.32 fixed point
+		UINT64 multiplier;
+	};
+	static_assert(OFFSET_OF(Data, tscBase) == 16 && OFFSET_OF(Data, nanosecondsBase) == 24 && OFFSET_OF(Data, multiplier) == 32);
+
+	// Where `map` puts the page in address spaces, between the program pages and `SharedRings::userAddress`
+	static inline constexpr UINTN userAddress = AddressSpace::base + 8 * EFI_PAGE_SIZE;
+
+	struct ReadCost {
+		// TSC cycles of one read from ring 3
+		UINT64 rdtscCycles;
+		UINT64 timeCycles;
+		// Whether a read from ring 3 fell between two reads of the kernel
+		bool isConsistent;
+		// Whether reads from ring 3 kept growing across `update` calls to another frequency and back
+		bool isMonotonic;
+	};
+
+private:
+	SharedPageFrames &m_pageFrames;
+	Data *m_data;
+
+public:
+	// Time starts at 0 along with the TSC
+	TimePage(UINT64 tscFrequency, SharedPageFrames &pageFrames) :
+		m_pageFrames(pageFrames),
+		m_data(reinterpret_cast<Data*>(pageFrames.allocate(0)))
+	{
+		if (m_data == nullptr)
+			fatalError();
+		SetMem(m_data, EFI_PAGE_SIZE, 0);
+		m_data->tscFrequency = tscFrequency;
+		m_data->multiplier = (static_cast<UINT64>(1000000000) << 32) / tscFrequency;
+	}
+
+	const Data& getData(void) const {
+		return *m_data;
+	}
+
+	// Same computation as `bareUserTimeNow`
+	UINT64 now(void) const {
+		while (true) {
+			auto sequence = __atomic_load_n(&m_data->sequence, __ATOMIC_ACQUIRE);
+			if (sequence & 1) {
+				CpuPause();
+				continue;
+			}
+			auto cycles = AsmReadTsc() - m_data->tscBase;
+			auto res = m_data->nanosecondsBase + static_cast<UINT64>((static_cast<unsigned __int128>(cycles) * m_data->multiplier) >> 32);
+			__atomic_thread_fence(__ATOMIC_ACQUIRE);
+			if (__atomic_load_n(&m_data->sequence, __ATOMIC_RELAXED) == sequence)
+				return res;
+		}
+	}
+
+	// Switches over to `tscFrequency` from now on, without time jumping
+	// Only from one CPU at a time.
+	void update(UINT64 tscFrequency) {
+		auto nanoseconds = now();
+		__atomic_store_n(&m_data->sequence, m_data->sequence + 1, __ATOMIC_RELAXED);
+		__atomic_thread_fence(__ATOMIC_RELEASE);
+		m_data->tscFrequency = tscFrequency;
+		m_data->tscBase = AsmReadTsc();
+		m_data->nanosecondsBase = nanoseconds;
+		m_data->multiplier = (static_cast<UINT64>(1000000000) << 32) / tscFrequency;
+		__atomic_store_n(&m_data->sequence, m_data->sequence + 1, __ATOMIC_RELEASE);
+	}
+
+	// Read-only for ring 3
+	void map(AddressSpace &space) {
+		space.getTables().map(userAddress, reinterpret_cast<UINTN>(m_data), EFI_PAGE_SIZE, PageTables::user);
+	}
+
+	void unmap(AddressSpace &space) {
+		space.getTables().unmap(userAddress, EFI_PAGE_SIZE);
+	}
+
+	// Makes `count` bare TSC reads from a ring 3 program in `space`, then as many time reads through the page, then
+	// checks reads against the kernel and across updates. See `UserMode::runProgram` for the pages it takes.
+	ReadCost benchmark(UserMode &userMode, AddressSpace &space, UINTN count) {
+		ReadCost res { 0, 0, false, false };
+		if (count == 0)
+			return res;
+		map(space);
+		userMode.runProgram(space, m_pageFrames, bareTimeProgramBegin, bareTimeProgramEnd, [&](UserMode::Program &program) {
+			res.rdtscCycles = program.measure(bareTimeRdtscLoop, userAddress, count) / count;
+			res.timeCycles = program.measure(bareTimeReadLoop, userAddress, count) / count;
+			auto before = now();
+			auto nanoseconds = program.run(bareTimeReadOnce, userAddress, 0);
+			res.isConsistent = before <= nanoseconds && nanoseconds <= now();
+
+			// A 0.1% faster TSC, as after a recalibration, then back
+			auto tscFrequency = m_data->tscFrequency;
+			update(tscFrequency + tscFrequency / 1000);
+			auto afterFirst = program.run(bareTimeReadOnce, userAddress, 0);
+			update(tscFrequency);
+			auto afterSecond = program.run(bareTimeReadOnce, userAddress, 0);
+			res.isMonotonic = nanoseconds <= afterFirst && afterFirst <= afterSecond;
+		});
+		unmap(space);
+		return res;
+	}
+};
+
+}
\ No newline at end of file
@@ -0,0 +1,114 @@
+#pragma once
+
+extern "C" {
+
+#include <Uefi.h>
+#include <Library/BaseLib.h>
+
+}
+
+#include "bare.hpp"
+#include "smp.hpp"
+#include "descriptors.hpp"
+
+namespace bare {
+
+// Low-power waits on the local APIC TSC-deadline timer, to use after `ExitBootServices` on the BSP
+// Relies on the IDT of `DescriptorTables`, with interrupts left disabled outside of waits. Falls back to spinning
+// when the CPU has no TSC-deadline mode. Keeps track of how late wake-ups are and of the share of time spent halted.
+class DeadlineTimer
+{
+	static inline constexpr UINT32 msrTscDeadline = 0x6E0;
+	static inline constexpr UINT32 lvtTimerTscDeadline = 2 << 17;
+	static inline constexpr UINT32 spuriousVector = 0xFF;
+	static inline constexpr UINT32 apicSoftwareEnable = 1 << 8;
+
+	const Clock &m_clock;
+	LocalApic m_apic;
+	bool m_isSupported;
+
+	UINT64 m_statsBegin;
+	UINT64 m_haltedCycles = 0;
+	UINTN m_wakeCount = 0;
+	UINT64 m_lateCycles = 0;
+	UINT64 m_maxLateCycles = 0;
+
+public:
+	static inline constexpr UINT8 vector = 0x40;
+
+	struct Stats {
+		UINTN wakeCount;
+		// How late timed waits returned past their deadline
+		UINT64 meanLateMicroseconds;
+		UINT64 maxLateMicroseconds;
+		// Share of the time spent halted, in thousandths
+		UINTN idlePermille;
+	};
+
+	// Only programs the local APIC, the IDT in place stays whether the timer is supported or not
+	DeadlineTimer(const Clock &clock) :
+		m_clock(clock),
+		m_statsBegin(clock.now())
+	{
+		bareApicEoiAddress = m_apic.isX2Apic() ? 0 : m_apic.getBase() + LocalApic::regEoi;
+		UINT32 ecx;
+		AsmCpuid(1, nullptr, nullptr, &ecx, nullptr);
+		m_isSupported = (ecx >> 24) & 1;
+		if (!m_isSupported)
+			return;
+
+		m_apic.write(LocalApic::regSpuriousVector, apicSoftwareEnable | spuriousVector);
+		m_apic.write(LocalApic::regLvtTimer, lvtTimerTscDeadline | vector);
+	}
+
+	bool isSupported(void) const {
+		return m_isSupported;
+	}
+
+	// Halts until `deadline`, any other interrupt only costs an extra loop
+	void waitUntil(UINT64 deadline) {
+		if (!m_isSupported) {
+			m_clock.spinUntil(deadline);
+			return;
+		}
+
+		AsmWriteMsr64(msrTscDeadline, deadline);
+		UINT64 now;
+		while ((now = m_clock.now()) < deadline) {
+			// `sti` only takes effect after `hlt` starts, so the timer can't fire in between and be missed
+			asm volatile("sti; hlt; cli" : : : "memory");
+			m_haltedCycles += m_clock.now() - now;
+		}
+		// Disarms the timer, in case another interrupt woke the CPU right at the deadline
+		AsmWriteMsr64(msrTscDeadline, 0);
+
+		auto late = m_clock.now() - deadline;
+		m_wakeCount++;
+		m_lateCycles += late;
+		m_maxLateCycles = late > m_maxLateCycles ? late : m_maxLateCycles;
+	}
+
+	void sleep(UINT64 microseconds) {
+		waitUntil(m_clock.getDeadlineIn(microseconds));
+	}
+
+	// Stats since the previous call, then starts measuring again
+	Stats takeStats(void) {
+		auto now = m_clock.now();
+		auto elapsed = now - m_statsBegin;
+		Stats res {
+			.wakeCount = m_wakeCount,
+			.meanLateMicroseconds = m_wakeCount > 0 ? m_clock.toMicroseconds(m_lateCycles / m_wakeCount) : 0,
+			.maxLateMicroseconds = m_clock.toMicroseconds(m_maxLateCycles),
+			.idlePermille = elapsed > 0 ? static_cast<UINTN>(m_haltedCycles / (elapsed / 1000 + 1)) : 0
+		};
+		m_statsBegin = now;
+		m_haltedCycles = 0;
+		m_wakeCount = 0;
+		m_lateCycles = 0;
+		m_maxLateCycles = 0;
+		return res;
+	}
+};
+
+}
\ No newline at end of file
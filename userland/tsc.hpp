@@ -0,0 +1,269 @@
+#pragma once
+
+extern "C" {
+
+#include <Uefi.h>
+#include <Library/BaseLib.h>
+#include <Library/BaseMemoryLib.h>
+#include <Library/IoLib.h>
+#include <Library/UefiLib.h>
+#include <Library/UefiBootServicesTableLib.h>
+#include <Guid/Acpi.h>
+
+}
+
+#include "boot.hpp"
+
+namespace boot {
+
+struct TscCalibration {
+	// `errorPpm` of sources that nothing bounds
+	static inline constexpr UINT64 errorUnknown = ~static_cast<UINT64>(0);
+
+	UINT64 frequency;
+	// Upper bound of the error of `frequency`, in parts per million
+	UINT64 errorPpm;
+	// What the frequency was derived from, for logging
+	const CHAR16 *sourceName;
+
+	void print(void) const {
+		if (errorPpm == errorUnknown)
+			Print(bootUToC16(u"TSC at %,Lu Hz (error unknown, from %s)\n"), frequency, sourceName);
+		else
+			Print(bootUToC16(u"TSC at %,Lu Hz (+/- %Lu ppm, from %s)\n"), frequency, errorPpm, sourceName);
+	}
+};
+
+// Finds the TSC frequency without blocking for long, from the most to the least accurate source:
+// CPUID leaf 0x15 (with 0x16 for the crystal when it isn't reported), the hypervisor timing leaf, then a measurement
+// against the HPET or the ACPI PM timer found through the ACPI tables, and `Stall` as a last resort.
+class TscCalibrator
+{
+	// How long measurements against a reference timer run
+	static inline constexpr UINT64 measureMilliseconds = 10;
+	// Reference reads bracketed at each end of a measurement, only the tightest bracket is kept
+	static inline constexpr UINTN sampleAttemptCount = 8;
+
+	struct __attribute__((packed)) Rsdp {
+		CHAR8 signature[8];
+		UINT8 checksum;
+		CHAR8 oemId[6];
+		UINT8 revision;
+		UINT32 rsdtAddress;
+		UINT32 length;
+		UINT64 xsdtAddress;
+		UINT8 extendedChecksum;
+		UINT8 reserved[3];
+	};
+
+	struct __attribute__((packed)) SdtHeader {
+		CHAR8 signature[4];
+		UINT32 length;
+		UINT8 revision;
+		UINT8 checksum;
+		CHAR8 oemId[6];
+		CHAR8 oemTableId[8];
+		UINT32 oemRevision;
+		UINT32 creatorId;
+		UINT32 creatorRevision;
+	};
+
+	struct __attribute__((packed)) GenericAddress {
+		UINT8 addressSpaceId;
+		UINT8 bitWidth;
+		UINT8 bitOffset;
+		UINT8 accessSize;
+		UINT64 address;
+	};
+
+	static inline constexpr UINT8 addressSpaceMemory = 0;
+	static inline constexpr UINT8 addressSpaceIo = 1;
+
+	// Byte offsets of the fields used within the FADT ("FACP") and the HPET table
+	static inline constexpr UINTN fadtPmTimerBlockOffset = 76;
+	static inline constexpr UINTN fadtFlagsOffset = 112;
+	static inline constexpr UINT32 fadtFlagTimerValueExtended = 1 << 8;
+	static inline constexpr UINTN fadtXPmTimerBlockOffset = 208;
+	static inline constexpr UINTN hpetTableBaseAddressOffset = 40;
+
+	static inline constexpr UINTN hpetCapabilitiesRegister = 0x00;
+	static inline constexpr UINTN hpetConfigurationRegister = 0x10;
+	static inline constexpr UINTN hpetMainCounterRegister = 0xF0;
+	static inline constexpr UINT64 pmTimerFrequency = 3579545;
+
+	// Free-running counter with a known frequency, wrapping at `mask + 1`
+	struct Reference {
+		const CHAR16 *name;
+		UINT64 frequency;
+		UINT64 mask;
+		bool isIo;
+		bool is64Bit;
+		UINTN address;
+
+		UINT64 read(void) const {
+			if (isIo)
+				return IoRead32(address) & mask;
+			return (is64Bit ? MmioRead64(address) : MmioRead32(address)) & mask;
+		}
+	};
+
+	struct Sample {
+		// Midpoint of the TSC reads around the reference read
+		UINT64 tsc;
+		UINT64 reference;
+		UINT64 width;
+	};
+
+	template <typename T>
+	static T readField(const SdtHeader &table, UINTN offset) {
+		T res;
+		CopyMem(&res, reinterpret_cast<const UINT8*>(&table) + offset, sizeof(res));
+		return res;
+	}
+
+	static const SdtHeader* findAcpiTable(const CHAR8 *signature) {
+		void *rsdpPtr;
+		if (EfiGetSystemConfigurationTable(&gEfiAcpiTableGuid, &rsdpPtr) != EFI_SUCCESS)
+			return nullptr;
+		auto &rsdp = *reinterpret_cast<const Rsdp*>(rsdpPtr);
+		bool useXsdt = rsdp.revision >= 2 && rsdp.xsdtAddress != 0;
+		auto &root = *reinterpret_cast<const SdtHeader*>(useXsdt ? rsdp.xsdtAddress : rsdp.rsdtAddress);
+
+		UINTN entrySize = useXsdt ? sizeof(UINT64) : sizeof(UINT32);
+		auto entryCount = (root.length - sizeof(SdtHeader)) / entrySize;
+		for (UINTN i = 0; i < entryCount; i++) {
+			UINT64 address = 0;
+			CopyMem(&address, reinterpret_cast<const UINT8*>(&root) + sizeof(SdtHeader) + i * entrySize, entrySize);
+			auto table = reinterpret_cast<const SdtHeader*>(address);
+			if (table != nullptr && CompareMem(table->signature, signature, sizeof(table->signature)) == 0)
+				return table;
+		}
+		return nullptr;
+	}
+
+	// Only when the firmware left it enabled: it may rely on its configuration
+	static std::optional<Reference> findHpet(void) {
+		auto table = findAcpiTable("HPET");
+		if (table == nullptr)
+			return std::nullopt;
+		auto baseAddress = readField<GenericAddress>(*table, hpetTableBaseAddressOffset);
+		if (baseAddress.addressSpaceId != addressSpaceMemory || baseAddress.address == 0)
+			return std::nullopt;
+		if ((MmioRead64(baseAddress.address + hpetConfigurationRegister) & 1) == 0)
+			return std::nullopt;
+		// Counter period in femtoseconds
+		auto period = MmioRead64(baseAddress.address + hpetCapabilitiesRegister) >> 32;
+		if (period == 0)
+			return std::nullopt;
+		return Reference {
+			.name = bootUToC16(u"HPET"),
+			.frequency = 1000000000000000 / period,
+			.mask = ~static_cast<UINT64>(0),
+			.isIo = false,
+			.is64Bit = true,
+			.address = static_cast<UINTN>(baseAddress.address + hpetMainCounterRegister)
+		};
+	}
+
+	static std::optional<Reference> findPmTimer(void) {
+		auto fadt = findAcpiTable("FACP");
+		if (fadt == nullptr)
+			return std::nullopt;
+		Reference res {
+			.name = bootUToC16(u"ACPI PM timer"),
+			.frequency = pmTimerFrequency,
+			.mask = readField<UINT32>(*fadt, fadtFlagsOffset) & fadtFlagTimerValueExtended ? 0xFFFFFFFF : 0xFFFFFF,
+			.isIo = true,
+			.is64Bit = false,
+			.address = readField<UINT32>(*fadt, fadtPmTimerBlockOffset)
+		};
+		// The extended block takes precedence, and may be memory-mapped
+		if (fadt->length >= fadtXPmTimerBlockOffset + sizeof(GenericAddress)) {
+			auto block = readField<GenericAddress>(*fadt, fadtXPmTimerBlockOffset);
+			if (block.address != 0 && (block.addressSpaceId == addressSpaceIo || block.addressSpaceId == addressSpaceMemory)) {
+				res.isIo = block.addressSpaceId == addressSpaceIo;
+				res.address = static_cast<UINTN>(block.address);
+			}
+		}
+		if (res.address == 0)
+			return std::nullopt;
+		return res;
+	}
+
+	// An SMI or a slow bus access only widens some of the brackets
+	static Sample sample(const Reference &reference) {
+		Sample res { 0, 0, ~static_cast<UINT64>(0) };
+		for (UINTN i = 0; i < sampleAttemptCount; i++) {
+			auto before = AsmReadTsc();
+			auto value = reference.read();
+			auto after = AsmReadTsc();
+			if (after - before < res.width)
+				res = Sample { before + (after - before) / 2, value, after - before };
+		}
+		return res;
+	}
+
+	static TscCalibration measure(const Reference &reference) {
+		auto begin = sample(reference);
+		// Spins on the reference itself, as `Stall` may well be implemented on top of it anyway
+		auto targetDelta = reference.frequency * measureMilliseconds / 1000;
+		while (((reference.read() - begin.reference) & reference.mask) < targetDelta)
+			CpuPause();
+		auto end = sample(reference);
+
+		auto referenceDelta = (end.reference - begin.reference) & reference.mask;
+		auto tscDelta = end.tsc - begin.tsc;
+		return TscCalibration {
+			.frequency = tscDelta * reference.frequency / referenceDelta,
+			// Each end is only known within half its bracket, and the reference within one of its ticks
+			.errorPpm = (begin.width + end.width) / 2 * 1000000 / tscDelta + 1000000 / referenceDelta + 1,
+			.sourceName = reference.name
+		};
+	}
+
+public:
+	static TscCalibration calibrate(void) {
+		UINT32 maxLeaf, eax, ebx, ecx;
+		AsmCpuid(0, &maxLeaf, nullptr, nullptr, nullptr);
+
+		// TSC/crystal ratio as ebx/eax, crystal frequency in ecx when enumerated
+		if (maxLeaf >= 0x15) {
+			AsmCpuid(0x15, &eax, &ebx, &ecx, nullptr);
+			if (eax != 0 && ebx != 0 && ecx != 0)
+				return TscCalibration { static_cast<UINT64>(ecx) * ebx / eax, 0, bootUToC16(u"CPUID 0x15") };
+			// Without the crystal, the TSC runs at the base frequency of leaf 0x16, rounded to the MHz
+			if (eax != 0 && ebx != 0 && maxLeaf >= 0x16) {
+				UINT32 baseMhz;
+				AsmCpuid(0x16, &baseMhz, nullptr, nullptr, nullptr);
+				if (baseMhz != 0)
+					return TscCalibration { static_cast<UINT64>(baseMhz) * 1000000, 500000 / baseMhz + 1, bootUToC16(u"CPUID 0x15/0x16") };
+			}
+		}
+
+		// Hypervisors exposing the timing leaf report the TSC frequency in kHz
+		AsmCpuid(1, nullptr, nullptr, &ecx, nullptr);
+		if ((ecx >> 31) & 1) {
+			UINT32 maxHypervisorLeaf;
+			AsmCpuid(0x40000000, &maxHypervisorLeaf, nullptr, nullptr, nullptr);
+			if (maxHypervisorLeaf >= 0x40000010 && maxHypervisorLeaf < 0x40010000) {
+				UINT32 tscKhz;
+				AsmCpuid(0x40000010, &tscKhz, nullptr, nullptr, nullptr);
+				if (tscKhz != 0)
+					return TscCalibration { static_cast<UINT64>(tscKhz) * 1000, 1000 / tscKhz + 1, bootUToC16(u"hypervisor CPUID 0x40000010") };
+			}
+		}
+
+		if (auto hpet = findHpet())
+			return measure(*hpet);
+		if (auto pmTimer = findPmTimer())
+			return measure(*pmTimer);
+
+		// `Stall` only promises to wait at least as long as asked, so the error has no bound
+		auto begin = AsmReadTsc();
+		bootEfiAssert(gBS->Stall(measureMilliseconds * 1000));
+		auto cycles = AsmReadTsc() - begin;
+		return TscCalibration { cycles * 1000 / measureMilliseconds, TscCalibration::errorUnknown, bootUToC16(u"Stall") };
+	}
+};
+
+}
\ No newline at end of file
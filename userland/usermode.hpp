@@ -0,0 +1,351 @@
+#pragma once
+
+extern "C" {
+
+#include <Uefi.h>
+#include <Library/BaseLib.h>
+#include <Library/BaseMemoryLib.h>
+
+}
+
+#include "bare.hpp"
+#include "paging.hpp"
+#include "descriptors.hpp"
+
+// Kernel side of the transitions between ring 0 and ring 3, see `bare::UserMode`
+// `bareUserEnter(entry, stackTop, arg0, arg1)` saves the callee-saved registers and drops to ring 3 with `sysretq`, until
+// a syscall handler calls `bareUserLeave(result)` which makes `bareUserEnter` return `result`. Syscalls come in through
+// `bareSyscallEntry` (SYSCALL) or `bareSyscallGate` (int 0x80) with the number in rax and arguments in rdi, rsi, rdx,
+// r10, r8 and r9, and both switch to the same kernel stack: rsp is saved aside since SYSCALL doesn't switch it.
+asm(R"(
+	.pushsection .text
+	.global bareUserEnter
+	.global bareUserLeave
+	.global bareSyscallEntry
+	.global bareSyscallGate
+bareUserEnter:
+	pushq %rbx
+	pushq %rbp
+	pushq %r12
+	pushq %r13
+	pushq %r14
+	pushq %r15
+	movq %rsp, bareUserKernelRsp(%rip)
+	movq %rsi, %rsp
+	movq %rdi, %r8
+	movq %rdx, %rdi
+	movq %rcx, %rsi
+	movq %r8, %rcx
+	movl $0x2, %r11d
+	sysretq
+
+bareUserLeave:
+	movq bareUserKernelRsp(%rip), %rsp
+	movq %rdi, %rax
+	popq %r15
+	popq %r14
+	popq %r13
+	popq %r12
+	popq %rbp
+	popq %rbx
+	retq
+
+bareSyscallEntry:
+	movq %rsp, bareSyscallUserRsp(%rip)
+	movq bareSyscallStackTop(%rip), %rsp
+	pushq %rcx
+	pushq %r11
+	cmpq $64, %rax
+	jae 1f
+	movq %r10, %rcx
+	leaq bareSyscallTable(%rip), %r11
+	movq (%r11, %rax, 8), %r11
+	testq %r11, %r11
+	jz 1f
+	callq *%r11
+	jmp 2f
+1:
+	movq $-1, %rax
+2:
+	popq %r11
+	popq %rcx
+	movq bareSyscallUserRsp(%rip), %rsp
+	sysretq
+
+bareSyscallGate:
+	subq $8, %rsp
+	cmpq $64, %rax
+	jae 1f
+	movq %r10, %rcx
+	leaq bareSyscallTable(%rip), %r11
+	movq (%r11, %rax, 8), %r11
+	testq %r11, %r11
+	jz 1f
+	callq *%r11
+	jmp 2f
+1:
+	movq $-1, %rax
+2:
+	addq $8, %rsp
+	iretq
+	.popsection
+
+	.pushsection .data
+	.balign 8
+	.global bareSyscallTable
+	.global bareSyscallStackTop
+bareSyscallTable:
+	.fill 64, 8, 0
+bareSyscallStackTop:
+	.quad 0
+bareSyscallUserRsp:
+	.quad 0
+bareUserKernelRsp:
+	.quad 0
+	.popsection
+)");
+
+// Position-independent ring 3 program timing null syscalls, copied into a user page by `bare::UserMode::benchmark`
+// Makes rsi null syscalls through SYSCALL when rdi is 0 and through int 0x80 otherwise, then exits with the TSC cycles
+// they took.
+asm(R"(
+	.pushsection .text
+	.global bareUserBenchmarkBegin
+	.global bareUserBenchmarkEnd
+bareUserBenchmarkBegin:
+	movq %rsi, %r12
+	movq %rdi, %r13
+	lfence
+	rdtsc
+	shlq $32, %rdx
+	orq %rdx, %rax
+	movq %rax, %r14
+	testq %r13, %r13
+	jnz 2f
+1:
+	movl $1, %eax
+	syscall
+	decq %r12
+	jnz 1b
+	jmp 3f
+2:
+	movl $1, %eax
+	int $0x80
+	decq %r12
+	jnz 2b
+3:
+	lfence
+	rdtsc
+	shlq $32, %rdx
+	orq %rdx, %rax
+	subq %r14, %rax
+	movq %rax, %rdi
+	xorl %eax, %eax
+	syscall
+	ud2
+bareUserBenchmarkEnd:
+	.popsection
+)");
+
+extern "C" __attribute__((sysv_abi)) UINT64 bareUserEnter(UINTN entry, UINTN stackTop, UINT64 arg0, UINT64 arg1);
+extern "C" [[noreturn]] __attribute__((sysv_abi)) void bareUserLeave(UINT64 result);
+extern "C" const UINT8 bareSyscallEntry[];
+extern "C" const UINT8 bareSyscallGate[];
+extern "C" UINT64 bareSyscallTable[];
+extern "C" UINT64 bareSyscallStackTop;
+extern "C" const UINT8 bareUserBenchmarkBegin[];
+extern "C" const UINT8 bareUserBenchmarkEnd[];
+
+namespace bare {
+
+// Ring 3 execution on the BSP, to set up after `DescriptorTables::load`
+// Loads a GDT with the kernel segments of `DescriptorTables`, user segments and a TSS, and an IDT of its own with the
+// gates of `DescriptorTables` plus an int 0x80 gate open to ring 3. Programs run with interrupts disabled, and only on
+// this CPU as syscalls save state in globals rather than per CPU.
+class UserMode
+{
+public:
+	static inline constexpr UINTN syscallCount = 64;
+	// Ends `run` with the argument as its result
+	static inline constexpr UINT64 syscallExit = 0;
+	static inline constexpr UINT64 syscallNull = 1;
+	static inline constexpr UINT8 syscallVector = 0x80;
+
+	static inline constexpr UINT16 kernelCode = DescriptorTables::kernelCode;
+	static inline constexpr UINT16 kernelData = DescriptorTables::kernelData;
+	// SYSRET derives both user selectors from the one before them, hence data before code
+	static inline constexpr UINT16 userData = 0x18 | 3;
+	static inline constexpr UINT16 userCode = 0x20 | 3;
+	static inline constexpr UINT16 taskState = 0x28;
+
+	// Handlers take up to 6 arguments, and return the result left in rax
+	using SyscallHandler = __attribute__((sysv_abi)) UINT64 (*)(UINT64, UINT64, UINT64, UINT64, UINT64, UINT64);
+
+	struct SyscallLatency {
+		// TSC cycles of one round trip from ring 3
+		UINT64 syscallCycles;
+		UINT64 interruptCycles;
+	};
+
+private:
+	static inline constexpr UINTN stackSize = 16 * 1024;
+	static inline constexpr UINT32 msrEfer = 0xC0000080;
+	static inline constexpr UINT32 msrStar = 0xC0000081;
+	static inline constexpr UINT32 msrLstar = 0xC0000082;
+	static inline constexpr UINT32 msrSfmask = 0xC0000084;
+	static inline constexpr UINT64 eferSyscall = 1;
+	// TF, IF, DF, NT and AC are cleared on SYSCALL
+	static inline constexpr UINT64 syscallFlagMask = (1 << 8) | (1 << 9) | (1 << 10) | (1 << 14) | (1 << 18);
+
+	struct __attribute__((packed)) TaskState {
+		UINT32 reserved0;
+		UINT64 rsp[3];
+		UINT64 reserved1;
+		UINT64 ist[7];
+		UINT64 reserved2;
+		UINT16 reserved3;
+		UINT16 ioMapOffset;
+	};
+	static_assert(sizeof(TaskState) == 104);
+
+	__attribute__((sysv_abi)) static UINT64 exit(UINT64 result, UINT64, UINT64, UINT64, UINT64, UINT64) {
+		bareUserLeave(result);
+	}
+
+	__attribute__((sysv_abi)) static UINT64 null(UINT64, UINT64, UINT64, UINT64, UINT64, UINT64) {
+		return 0;
+	}
+
+public:
+	// The GDT, TSS, IDT and kernel stack are carved out of `allocator`
+	UserMode(BumpAllocator &allocator) {
+		auto stack = reinterpret_cast<UINTN>(allocator.allocate(stackSize, 16));
+		bareSyscallStackTop = stack + stackSize;
+
+		auto &tss = *allocator.allocateArray<TaskState>(1);
+		SetMem(&tss, sizeof(tss), 0);
+		// int 0x80 from ring 3 switches to the same stack as SYSCALL
+		tss.rsp[0] = bareSyscallStackTop;
+		tss.ioMapOffset = sizeof(tss);
+
+		auto tssBase = reinterpret_cast<UINT64>(&tss);
+		auto gdt = allocator.allocateArray<UINT64>(7);
+		gdt[0] = 0;
+		gdt[kernelCode >> 3] = 0x00AF9A000000FFFF;
+		gdt[kernelData >> 3] = 0x00CF92000000FFFF;
+		gdt[userData >> 3] = 0x00CFF2000000FFFF;
+		gdt[userCode >> 3] = 0x00AFFA000000FFFF;
+		// Available 64-bit TSS, whose base spans two entries
+		gdt[taskState >> 3] = (sizeof(tss) - 1) | ((tssBase & 0xFFFFFF) << 16) | (static_cast<UINT64>(0x89) << 40) | ((tssBase >> 24 & 0xFF) << 56);
+		gdt[(taskState >> 3) + 1] = tssBase >> 32;
+
+		auto idt = allocator.allocateArray<InterruptGate>(DescriptorTables::gateCount);
+		DescriptorTables::fillGates(idt);
+		idt[syscallVector] = InterruptGate::make(bareSyscallGate, kernelCode, 3);
+
+		DisableInterrupts();
+		DescriptorTables::loadGdt(gdt, 7);
+		AsmWriteTr(taskState);
+		IA32_DESCRIPTOR idtr;
+		idtr.Base = reinterpret_cast<UINTN>(idt);
+		idtr.Limit = static_cast<UINT16>(DescriptorTables::gateCount * sizeof(InterruptGate) - 1);
+		AsmWriteIdtr(&idtr);
+
+		AsmWriteMsr64(msrEfer, AsmReadMsr64(msrEfer) | eferSyscall);
+		// SYSCALL loads bits 32-47 into CS (SS follows), SYSRET loads bits 48-63 + 16 into CS and + 8 into SS
+		AsmWriteMsr64(msrStar, (static_cast<UINT64>(kernelCode) << 32) | (static_cast<UINT64>(userData - 8) << 48));
+		AsmWriteMsr64(msrLstar, reinterpret_cast<UINT64>(bareSyscallEntry));
+		AsmWriteMsr64(msrSfmask, syscallFlagMask);
+
+		setSyscall(syscallExit, exit);
+		setSyscall(syscallNull, null);
+	}
+
+	void setSyscall(UINTN number, SyscallHandler handler) {
+		if (number >= syscallCount)
+			fatalError();
+		bareSyscallTable[number] = reinterpret_cast<UINT64>(handler);
+	}
+
+	// Calls the handler of `number` from the kernel, `syscallExit` only makes sense from ring 3 and fails like unknown numbers
+	static UINT64 call(UINT64 number, const UINT64 *args) {
+		if (number >= syscallCount || number == syscallExit || bareSyscallTable[number] == 0)
+			return ~static_cast<UINT64>(0);
+		auto handler = reinterpret_cast<SyscallHandler>(bareSyscallTable[number]);
+		return handler(args[0], args[1], args[2], args[3], args[4], args[5]);
+	}
+
+	// Runs ring 3 code at `entry` on the user stack ending at `stackTop`, with `arg0` and `arg1` in rdi and rsi
+	// Both must be mapped for ring 3 in the active address space. Returns what it passes to `syscallExit`.
+	UINT64 run(UINTN entry, UINTN stackTop, UINT64 arg0, UINT64 arg1) {
+		return bareUserEnter(entry, stackTop, arg0, arg1);
+	}
+
+	// Position-independent program copied to `AddressSpace::base` by `runProgram`, with a one-page stack after it
+	class Program
+	{
+		UserMode &m_userMode;
+		const UINT8 *m_begin;
+
+	public:
+		static inline constexpr UINTN stackTop = AddressSpace::base + 2 * EFI_PAGE_SIZE;
+
+		Program(UserMode &userMode, const UINT8 *begin) :
+			m_userMode(userMode),
+			m_begin(begin)
+		{
+		}
+
+		// Runs the code at `label`, a symbol within the original program
+		UINT64 run(const UINT8 *label, UINT64 arg0, UINT64 arg1) {
+			return m_userMode.run(AddressSpace::base + (label - m_begin), stackTop, arg0, arg1);
+		}
+
+		// Runs `count` iterations of a loop taking them in rsi, after a shorter run to warm the caches and the TLB up
+		UINT64 measure(const UINT8 *label, UINT64 arg0, UINTN count) {
+			run(label, arg0, count / 16 + 1);
+			return run(label, arg0, count);
+		}
+	};
+
+	// Copies the program from `begin` to `end`, up to a page, into `space` and calls `fn(program)` with `space` active
+	// The program and its stack take two pages of `pageFrames` for the time of the call. CR3 is restored after. Returns
+	// false when page frames ran out.
+	template <typename Fn>
+	bool runProgram(AddressSpace &space, SharedPageFrames &pageFrames, const UINT8 *begin, const UINT8 *end, Fn fn) {
+		if (end - begin > static_cast<INTN>(EFI_PAGE_SIZE))
+			fatalError();
+		auto pages = reinterpret_cast<UINT8*>(pageFrames.allocate(1));
+		if (pages == nullptr)
+			return false;
+		CopyMem(pages, begin, end - begin);
+		auto &tables = space.getTables();
+		tables.map(AddressSpace::base, reinterpret_cast<UINTN>(pages), EFI_PAGE_SIZE, PageTables::user);
+		tables.map(AddressSpace::base + EFI_PAGE_SIZE, reinterpret_cast<UINTN>(pages) + EFI_PAGE_SIZE, EFI_PAGE_SIZE, PageTables::user | PageTables::writable);
+
+		auto cr3 = AsmReadCr3();
+		space.activate();
+		auto program = Program(*this, begin);
+		fn(program);
+		AsmWriteCr3(cr3);
+
+		tables.unmap(AddressSpace::base, 2 * EFI_PAGE_SIZE);
+		pageFrames.free(pages);
+		return true;
+	}
+
+	// Makes `count` null syscalls from a ring 3 program in `space` through SYSCALL, then as many through int 0x80
+	// See `runProgram` for the pages it takes.
+	SyscallLatency benchmark(AddressSpace &space, SharedPageFrames &pageFrames, UINTN count) {
+		SyscallLatency res { 0, 0 };
+		if (count == 0)
+			return res;
+		runProgram(space, pageFrames, bareUserBenchmarkBegin, bareUserBenchmarkEnd, [&](Program &program) {
+			res.syscallCycles = program.measure(bareUserBenchmarkBegin, 0, count) / count;
+			res.interruptCycles = program.measure(bareUserBenchmarkBegin, 1, count) / count;
+		});
+		return res;
+	}
+};
+
+}
\ No newline at end of file